@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+static char *arena_align(char *pointer) {
+  return (char *) (((uintptr_t) pointer + ARENA_ALIGNMENT - 1) & ~(uintptr_t) (ARENA_ALIGNMENT - 1));
+}
+
+/* Initializes ARENA. No memory is allocated until the first arena_alloc. */
+void arena_init(struct arena *arena, size_t block_size) {
+  arena->first = NULL;
+  arena->current = NULL;
+  arena->cursor = NULL;
+  arena->limit = NULL;
+  arena->block_size = block_size;
+}
+
+/* Releases every allocation at once, keeping the blocks for reuse. */
+void arena_reset(struct arena *arena) {
+  arena->current = arena->first;
+  if (arena->first) {
+    arena->cursor = arena->first->data;
+    arena->limit = arena->first->data + arena->first->size;
+  } else {
+    arena->cursor = arena->limit = NULL;
+  }
+}
+
+/* Returns every block to malloc. */
+void arena_destroy(struct arena *arena) {
+  struct arena_block *block = arena->first;
+  while (block) {
+    struct arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  arena_init(arena, arena->block_size);
+}
+
+/*
+ * Moves to the next block in the chain that can hold SIZE bytes, allocating
+ * one if the chain is exhausted. Blocks skipped because they are too small
+ * stay in the chain for later resets.
+ */
+static int arena_grow(struct arena *arena, size_t size) {
+  struct arena_block *next = arena->current ? arena->current->next : arena->first;
+  if (!next || next->size < size + ARENA_ALIGNMENT) {
+    size_t block_size = arena->block_size;
+    if (block_size < size + ARENA_ALIGNMENT) block_size = size + ARENA_ALIGNMENT;
+    struct arena_block *block = malloc(sizeof(struct arena_block) + block_size);
+    if (!block) return -1;
+    block->size = block_size;
+    block->next = next;
+    if (arena->current)
+      arena->current->next = block;
+    else
+      arena->first = block;
+    next = block;
+  }
+  arena->current = next;
+  arena->cursor = next->data;
+  arena->limit = next->data + next->size;
+  return 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  char *start = arena->cursor ? arena_align(arena->cursor) : NULL;
+  if (!start || start > arena->limit || (size_t) (arena->limit - start) < size) {
+    if (arena_grow(arena, size) < 0) return NULL;
+    start = arena_align(arena->cursor);
+  }
+  arena->cursor = start + size;
+  return start;
+}
+
+char *arena_strndup(struct arena *arena, const char *string, size_t length) {
+  char *copy = arena_alloc(arena, length + 1);
+  if (!copy) return NULL;
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump allocator that owns all memory scoped to one connection.
+ *
+ * Allocations are carved out of a chain of blocks and are never freed
+ * individually. arena_reset() rewinds to the first block in O(1) and keeps
+ * the chain, so a connection serving a stream of keep-alive requests stops
+ * calling malloc once its arena has grown to fit a typical request.
+ */
+
+struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  char data[];
+};
+
+struct arena {
+  struct arena_block *first;
+  struct arena_block *current;
+  char *cursor;
+  char *limit;
+  size_t block_size;
+};
+
+void arena_init(struct arena *arena, size_t block_size);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+/* Returns SIZE bytes aligned for any type, or NULL if malloc fails. */
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *string, size_t length);
+
+#endif
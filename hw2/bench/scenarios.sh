@@ -0,0 +1,185 @@
+#!/bin/bash
+#
+# Runs the httpbench scenarios against a local httpserver.
+#
+#   ./bench/scenarios.sh [SCENARIO...]
+#
+# With no arguments every scenario is run. Each scenario starts its own
+# servers on private ports and fails (non-zero exit) when throughput drops
+# below MIN_RPS or corrected p99 latency rises above MAX_P99_MS, so the
+# script can gate a deploy. Tune the run with the environment:
+#
+#   DURATION    seconds per scenario (default 5)
+#   THREADS     httpbench threads (default 2)
+#   CONNECTIONS httpbench connections (default 32)
+#   RATE        arrival rate for the open loop scenarios (default 2000)
+#   MIN_RPS     minimum acceptable requests/s (default 0, disabled)
+#   MAX_P99_MS  maximum acceptable corrected p99 in ms (default 0, disabled)
+#   SERVER_ARGS extra arguments for every httpserver (e.g. "--num-threads 8")
+
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+CONNECTIONS=${CONNECTIONS:-32}
+RATE=${RATE:-2000}
+MIN_RPS=${MIN_RPS:-0}
+MAX_P99_MS=${MAX_P99_MS:-0}
+SERVER_ARGS=${SERVER_ARGS:-}
+
+FILES_PORT=${FILES_PORT:-18080}
+BACKEND_PORT=${BACKEND_PORT:-18081}
+PROXY_PORT=${PROXY_PORT:-18082}
+
+SERVER_PIDS=()
+
+stop_servers() {
+  for pid in "${SERVER_PIDS[@]}"; do
+    kill "$pid" 2>/dev/null
+    wait "$pid" 2>/dev/null
+  done
+  SERVER_PIDS=()
+}
+trap stop_servers EXIT
+
+# start_server PORT ARGS... -- starts httpserver and waits for it to listen.
+start_server() {
+  local port=$1
+  shift
+  # shellcheck disable=SC2086
+  ./httpserver --port "$port" "$@" $SERVER_ARGS > /dev/null 2>&1 &
+  SERVER_PIDS+=($!)
+  for _ in $(seq 50); do
+    # Exit status 7 means nothing is listening yet.
+    curl -s -o /dev/null --max-time 1 "http://127.0.0.1:$port/"
+    if [ $? -ne 7 ]; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "httpserver on port $port did not start" >&2
+  return 1
+}
+
+# bench PORT ARGS... -- runs httpbench with the shared thresholds.
+bench() {
+  local port=$1
+  shift
+  ./httpbench --port "$port" --duration "$DURATION" --warmup 1 \
+    --threads "$THREADS" --connections "$CONNECTIONS" \
+    --min-rps "$MIN_RPS" --max-p99 "$MAX_P99_MS" "$@"
+}
+
+scenario_files_closed() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  bench "$FILES_PORT" --path / --path /my_documents/credit.txt
+}
+
+scenario_files_pipelined() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  bench "$FILES_PORT" --path /my_documents/credit.txt --pipeline 8
+}
+
+scenario_files_open() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  bench "$FILES_PORT" --path / --rate "$RATE"
+}
+
+scenario_files_large() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  bench "$FILES_PORT" --path /my_documents/BIG_DATA.pdf --connections "$THREADS"
+}
+
+scenario_files_no_keep_alive() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  bench "$FILES_PORT" --path / --no-keep-alive
+}
+
+scenario_proxy_closed() {
+  start_server "$BACKEND_PORT" --files files/ || return 1
+  start_server "$PROXY_PORT" --proxy "127.0.0.1:$BACKEND_PORT" || return 1
+  bench "$PROXY_PORT" --path / --path /my_documents/credit.txt
+}
+
+scenario_proxy_open() {
+  start_server "$BACKEND_PORT" --files files/ || return 1
+  start_server "$PROXY_PORT" --proxy "127.0.0.1:$BACKEND_PORT" || return 1
+  bench "$PROXY_PORT" --path / --rate "$RATE"
+}
+
+# Hot-upgrades a proxy with SIGUSR2 and checks the new process still proxies.
+scenario_proxy_upgrade() {
+  start_server "$BACKEND_PORT" --files files/ || return 1
+  start_server "$PROXY_PORT" --proxy "127.0.0.1:$BACKEND_PORT" || return 1
+  local old=${SERVER_PIDS[-1]}
+  kill -USR2 "$old"
+  # The new server sends the old one SIGTERM once it is serving.
+  for _ in $(seq 50); do
+    kill -0 "$old" 2>/dev/null || break
+    sleep 0.1
+  done
+  if kill -0 "$old" 2>/dev/null; then
+    echo "httpserver on port $PROXY_PORT did not upgrade" >&2
+    return 1
+  fi
+  SERVER_PIDS+=($(pgrep -n -f "^./httpserver --port $PROXY_PORT "))
+  if ! curl -s --max-time 5 "http://127.0.0.1:$PROXY_PORT/my_documents/credit.txt" |
+      cmp -s - files/my_documents/credit.txt; then
+    echo "upgraded proxy on port $PROXY_PORT does not reach its backend" >&2
+    return 1
+  fi
+  bench "$PROXY_PORT" --path / --path /my_documents/credit.txt
+}
+
+# status_of PORT REQUEST -- sends a raw request and prints the status code.
+status_of() {
+  local response
+  exec 3<> "/dev/tcp/127.0.0.1/$1" || return 1
+  printf '%b' "$2" >&3
+  IFS= read -r -t 5 response <&3
+  exec 3<&-
+  response=${response#* }
+  echo "${response%% *}"
+}
+
+# Requests whose repeated Content-Length headers disagree are refused.
+scenario_content_length() {
+  start_server "$FILES_PORT" --files files/ || return 1
+  local head='GET /my_documents/credit.txt HTTP/1.1\r\nConnection: close\r\n'
+  local status
+  status=$(status_of "$FILES_PORT" "${head}Content-Length: 0\r\nContent-Length: 0\r\n\r\n")
+  if [ "$status" != 200 ]; then
+    echo "matching Content-Length headers got $status, expected 200" >&2
+    return 1
+  fi
+  status=$(status_of "$FILES_PORT" "${head}Content-Length: 0\r\nContent-Length: 5\r\n\r\nhello")
+  if [ "$status" != 400 ]; then
+    echo "conflicting Content-Length headers got $status, expected 400" >&2
+    return 1
+  fi
+}
+
+ALL_SCENARIOS="files_closed files_pipelined files_open files_large
+  files_no_keep_alive proxy_closed proxy_open proxy_upgrade content_length"
+
+if [ ! -x ./httpserver ] || [ ! -x ./httpbench ]; then
+  echo "Build httpserver and httpbench first (make)" >&2
+  exit 1
+fi
+
+failed=0
+for scenario in ${*:-$ALL_SCENARIOS}; do
+  if ! declare -F "scenario_$scenario" > /dev/null; then
+    echo "Unknown scenario: $scenario" >&2
+    failed=1
+    continue
+  fi
+  echo "=== $scenario"
+  if ! "scenario_$scenario"; then
+    echo "=== $scenario FAILED"
+    failed=1
+  fi
+  stop_servers
+done
+
+exit $failed
@@ -0,0 +1,83 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+/* Chunks allocated at a time when the shared free list runs dry. */
+#define BUFPOOL_REFILL_CHUNKS 16
+
+/* Chunks each thread keeps before returning them to the shared list. */
+#define BUFPOOL_LOCAL_CHUNKS 4
+
+struct bufpool_chunk {
+  struct bufpool_chunk *next;
+};
+
+struct bufpool_node {
+  struct bufpool_chunk *free_list;
+  pthread_mutex_t lock;
+} __attribute__((aligned(64)));
+
+static struct bufpool_node bufpool_nodes[BUFPOOL_MAX_NODES] = {
+  [0 ... BUFPOOL_MAX_NODES - 1] = { NULL, PTHREAD_MUTEX_INITIALIZER }
+};
+
+static __thread struct bufpool_chunk *bufpool_local_list;
+static __thread int bufpool_local_count;
+static __thread int bufpool_local_node;
+
+void bufpool_set_node(int node) {
+  bufpool_local_node = node >= 0 && node < BUFPOOL_MAX_NODES ? node : 0;
+}
+
+/* Must be called with NODE's lock held. */
+static int bufpool_refill(struct bufpool_node *node) {
+  char *slab = malloc((size_t) BUFPOOL_REFILL_CHUNKS * BUFPOOL_CHUNK_SIZE);
+  if (!slab) return -1;
+  /* Fault every page in from this thread so the kernel places it on our node. */
+  memset(slab, 0, (size_t) BUFPOOL_REFILL_CHUNKS * BUFPOOL_CHUNK_SIZE);
+  for (int i = 0; i < BUFPOOL_REFILL_CHUNKS; i++) {
+    struct bufpool_chunk *chunk = (struct bufpool_chunk *) (slab + (size_t) i * BUFPOOL_CHUNK_SIZE);
+    chunk->next = node->free_list;
+    node->free_list = chunk;
+  }
+  return 0;
+}
+
+char *bufpool_get() {
+  struct bufpool_chunk *chunk = bufpool_local_list;
+  if (chunk) {
+    bufpool_local_list = chunk->next;
+    bufpool_local_count--;
+    return (char *) chunk;
+  }
+
+  struct bufpool_node *node = &bufpool_nodes[bufpool_local_node];
+  pthread_mutex_lock(&node->lock);
+  if (!node->free_list && bufpool_refill(node) < 0) {
+    pthread_mutex_unlock(&node->lock);
+    return NULL;
+  }
+  chunk = node->free_list;
+  node->free_list = chunk->next;
+  pthread_mutex_unlock(&node->lock);
+  return (char *) chunk;
+}
+
+void bufpool_put(char *buffer) {
+  struct bufpool_chunk *chunk = (struct bufpool_chunk *) buffer;
+  if (!chunk) return;
+  if (bufpool_local_count < BUFPOOL_LOCAL_CHUNKS) {
+    chunk->next = bufpool_local_list;
+    bufpool_local_list = chunk;
+    bufpool_local_count++;
+    return;
+  }
+
+  struct bufpool_node *node = &bufpool_nodes[bufpool_local_node];
+  pthread_mutex_lock(&node->lock);
+  chunk->next = node->free_list;
+  node->free_list = chunk;
+  pthread_mutex_unlock(&node->lock);
+}
@@ -0,0 +1,26 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+/*
+ * A process-wide pool of fixed size I/O buffers.
+ *
+ * Connections borrow a chunk while they have bytes to read or a response to
+ * write and hand it back as soon as they go idle, so memory follows the
+ * number of active connections rather than open ones. Each thread keeps a
+ * few chunks of its own in front of a shared, locked free list. There is
+ * one shared list per NUMA node, and new chunks are first touched by the
+ * thread that allocates them, so a thread pinned to a node (see
+ * bufpool_set_node) gets buffers in that node's memory.
+ */
+
+#define BUFPOOL_CHUNK_SIZE (16 * 1024)
+#define BUFPOOL_MAX_NODES 64
+
+/* Returns a BUFPOOL_CHUNK_SIZE byte buffer, or NULL if memory runs out. */
+char *bufpool_get();
+void bufpool_put(char *buffer);
+
+/* Makes the calling thread draw from and return to NODE's free list. */
+void bufpool_set_node(int node);
+
+#endif
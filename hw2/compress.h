@@ -0,0 +1,34 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/*
+ * On-the-fly gzip of static files (--gzip).
+ *
+ * The compressed length is not known until the file has been deflated, so
+ * the body is streamed with chunked transfer-coding as it is produced rather
+ * than compressed into memory first. Each thread keeps one deflate state and
+ * resets it per response, since setting one up costs a few hundred KB of
+ * allocations.
+ */
+
+/* Files smaller than this are sent as they are. */
+#define COMPRESS_MIN_SIZE 1024
+
+/* Returns 1 if REQUEST's Accept-Encoding admits gzip. */
+int compress_accepts_gzip(struct http_request *request);
+
+/* Returns 1 if a file of MIME_TYPE and SIZE is worth compressing. */
+int compress_worthwhile(char *mime_type, off_t size);
+
+/*
+ * Sends SIZE bytes of FILE_FD gzipped with http_send_chunk(), for a response
+ * whose headers included http_start_chunked(), and ends the body. A file
+ * that cannot be read aborts the response.
+ */
+void compress_send_file(int fd, int file_fd, off_t size);
+
+#endif
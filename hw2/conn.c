@@ -0,0 +1,146 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "conn.h"
+#include "h2.h"
+#include "ratelimit.h"
+#include "tls.h"
+
+/* Connections carved out of each slab. */
+#define CONN_SLAB_SIZE 64
+
+struct conn_pool {
+  struct conn *free_list;         /* Touched only by the owning thread. */
+  struct conn *remote_free_list;  /* Pushed by other threads, drained by the owner. */
+};
+
+static __thread struct conn_pool *conn_local_pool;
+static int conn_open;
+
+uint64_t conn_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct conn *conn_pool_take(struct conn_pool *pool) {
+  if (!pool->free_list) {
+    /* Claim everything other threads have freed in one atomic swap. */
+    pool->free_list = __atomic_exchange_n(&pool->remote_free_list, NULL, __ATOMIC_ACQUIRE);
+  }
+  if (!pool->free_list) {
+    struct conn *slab = malloc(CONN_SLAB_SIZE * sizeof(struct conn));
+    if (!slab) return NULL;
+    for (int i = 0; i < CONN_SLAB_SIZE; i++) {
+      slab[i].pool = pool;
+      slab[i].next_free = pool->free_list;
+      pool->free_list = &slab[i];
+    }
+  }
+  struct conn *conn = pool->free_list;
+  pool->free_list = conn->next_free;
+  return conn;
+}
+
+static void conn_pool_give(struct conn *conn) {
+  struct conn_pool *pool = conn->pool;
+  if (pool == conn_local_pool) {
+    conn->next_free = pool->free_list;
+    pool->free_list = conn;
+    return;
+  }
+  struct conn *head = __atomic_load_n(&pool->remote_free_list, __ATOMIC_RELAXED);
+  do {
+    conn->next_free = head;
+  } while (!__atomic_compare_exchange_n(&pool->remote_free_list, &head, conn, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+struct conn *conn_alloc(int fd, struct sockaddr_in *address) {
+  if (!conn_local_pool) {
+    conn_local_pool = calloc(1, sizeof(struct conn_pool));
+    if (!conn_local_pool) return NULL;
+  }
+  struct conn *conn = conn_pool_take(conn_local_pool);
+  if (!conn) return NULL;
+
+  struct conn_pool *pool = conn->pool;
+  memset(conn, 0, sizeof(*conn));
+  conn->pool = pool;
+  conn->fd = fd;
+  if (address) conn->address = *address;
+  conn->accepted_at = conn->last_active = conn->request_started = conn_now();
+  __atomic_add_fetch(&conn_open, 1, __ATOMIC_RELAXED);
+  return conn;
+}
+
+void conn_release_buffers(struct conn *conn) {
+  if (conn->read_buffer && conn->read_length == 0) {
+    bufpool_put(conn->read_buffer);
+    conn->read_buffer = NULL;
+  }
+  if (conn->output.buffer) {
+    bufpool_put(conn->output.buffer);
+    conn->output.buffer = NULL;
+    conn->output.capacity = 0;
+  }
+}
+
+void conn_close(struct conn *conn) {
+  if (conn->h2) h2_session_free(conn->h2);
+  if (conn->tls) tls_free(conn->tls);
+  close(conn->fd);
+  if (conn->limited) ratelimit_connection_close(conn->address.sin_addr.s_addr);
+  conn->read_length = 0;
+  conn_release_buffers(conn);
+  conn_pool_give(conn);
+  __atomic_sub_fetch(&conn_open, 1, __ATOMIC_RELAXED);
+}
+
+int conn_open_count() {
+  return __atomic_load_n(&conn_open, __ATOMIC_RELAXED);
+}
+
+ssize_t conn_read(struct conn *conn) {
+  if (!conn->read_buffer) {
+    conn->read_buffer = bufpool_get();
+    if (!conn->read_buffer) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  if (conn->read_length == BUFPOOL_CHUNK_SIZE) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ssize_t bytes_read;
+  if (conn->tls) {
+    bytes_read = tls_read(conn->tls, conn->read_buffer + conn->read_length,
+        BUFPOOL_CHUNK_SIZE - conn->read_length);
+  } else {
+    do {
+      bytes_read = recv(conn->fd, conn->read_buffer + conn->read_length,
+          BUFPOOL_CHUNK_SIZE - conn->read_length, MSG_DONTWAIT);
+    } while (bytes_read < 0 && errno == EINTR);
+  }
+
+  if (bytes_read > 0) {
+    conn->last_active = conn_now();
+    if (conn->read_length == 0) conn->request_started = conn->last_active;
+    conn->read_length += bytes_read;
+  }
+  return bytes_read;
+}
+
+void conn_consume(struct conn *conn, size_t length) {
+  memmove(conn->read_buffer, conn->read_buffer + length, conn->read_length - length);
+  conn->read_length -= length;
+  /* A pipelined request started arriving no later than the last read. */
+  if (conn->read_length > 0) conn->request_started = conn->last_active;
+}
@@ -0,0 +1,85 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "libhttp.h"
+#include "timer.h"
+#include "wq.h"
+
+/*
+ * Connection deadlines, shared by the thread pool and the io_uring engine.
+ */
+
+/* How long a keep-alive connection may sit idle between requests. */
+#define CONNECTION_IDLE_TIMEOUT_MS 15000
+
+/* How long a client has to send a complete request head, however slowly. */
+#define CONNECTION_REQUEST_TIMEOUT_MS 10000
+
+/* How long a response may go without write progress before it fails. */
+#define CONNECTION_WRITE_TIMEOUT_MS 10000
+
+/*
+ * A client connection and everything needed to resume it between requests.
+ *
+ * Connections come from per-thread slab pools: the thread that allocates a
+ * connection owns it, and a connection closed on another thread is pushed
+ * back to its owner's lock-free remote free list. The read and write buffers
+ * are borrowed from bufpool only while in use, so an idle keep-alive
+ * connection costs just this struct.
+ */
+struct conn {
+  wq_item_t queue_item;         /* Link in the work queue; must be first. */
+  int fd;
+  struct sockaddr_in address;
+  struct tls *tls;              /* TLS session, or NULL for plain HTTP. */
+  struct h2_session *h2;        /* Set once the client has sent the HTTP/2 preface. */
+
+  char *read_buffer;            /* Unparsed bytes, including pipelined requests. */
+  size_t read_length;
+  struct http_output output;    /* Response state; output.buffer is the write buffer. */
+  struct http_request *request; /* Parsed request between pipeline stages. */
+  struct arena *arena;          /* Holds request while it is between stages. */
+
+  uint64_t accepted_at;         /* conn_now() timestamps. */
+  uint64_t last_active;
+  uint64_t request_started;     /* First byte of the request being read. */
+  struct timer timer;           /* Deadline while parked in the idle poller. */
+  int requests_served;
+  int registered;               /* fd is in the idle poller's epoll set. */
+  int limited;                  /* Counted by ratelimit_connection_open. */
+  int worker;                   /* Index of the worker whose queue serves it. */
+
+  struct conn_pool *pool;       /* Owning pool. */
+  struct conn *next_free;
+};
+
+/* Wraps the accepted socket FD. Returns NULL if memory runs out. */
+struct conn *conn_alloc(int fd, struct sockaddr_in *address);
+
+/* Closes the socket, returns the buffers and frees CONN. */
+void conn_close(struct conn *conn);
+
+/*
+ * Reads whatever the socket has without blocking, decrypted if the
+ * connection uses TLS. Returns the number of bytes read, 0 at end of
+ * stream, or -1 with errno set (EAGAIN when there is nothing to read yet).
+ */
+ssize_t conn_read(struct conn *conn);
+
+/* Drops the first LENGTH bytes of the read buffer. */
+void conn_consume(struct conn *conn, size_t length);
+
+/* Returns the borrowed buffers the connection does not need while idle. */
+void conn_release_buffers(struct conn *conn);
+
+/* Number of connections allocated and not yet closed, across all threads. */
+int conn_open_count();
+
+/* Monotonic time in milliseconds. */
+uint64_t conn_now();
+
+#endif
@@ -0,0 +1,48 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+static int cpu_nodes[CPU_SETSIZE];
+static pthread_once_t cpu_nodes_once = PTHREAD_ONCE_INIT;
+
+/* Reads every CPU's node once: the sysfs directory of cpuN holds a nodeM link. */
+static void cpu_read_nodes() {
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *directory = opendir(path);
+    if (!directory) continue;
+    struct dirent *dirent;
+    while ((dirent = readdir(directory)) != NULL) {
+      if (strncmp(dirent->d_name, "node", 4) == 0 &&
+          dirent->d_name[4] >= '0' && dirent->d_name[4] <= '9') {
+        cpu_nodes[cpu] = atoi(dirent->d_name + 4);
+        break;
+      }
+    }
+    closedir(directory);
+  }
+}
+
+int cpu_list_allowed(int *cpus, int max) {
+  cpu_set_t allowed;
+  int count = 0;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+    if (CPU_ISSET(cpu, &allowed)) cpus[count++] = cpu;
+  return count;
+}
+
+int cpu_node(int cpu) {
+  pthread_once(&cpu_nodes_once, cpu_read_nodes);
+  return cpu >= 0 && cpu < CPU_SETSIZE ? cpu_nodes[cpu] : 0;
+}
+
+int cpu_pin_self(cpu_set_t *cpus) {
+  return pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+}
@@ -0,0 +1,21 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <sched.h>
+
+/*
+ * CPU and NUMA topology helpers for placing worker threads. Node numbers
+ * come from sysfs; on a machine without NUMA information every CPU is on
+ * node 0.
+ */
+
+/* Fills CPUS with the CPUs this process may run on, in order. Returns the count. */
+int cpu_list_allowed(int *cpus, int max);
+
+/* Returns the NUMA node of CPU. */
+int cpu_node(int cpu);
+
+/* Restricts the calling thread to CPUS. Returns 0 on success. */
+int cpu_pin_self(cpu_set_t *cpus);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+
+#include "deque.h"
+
+#define DEQUE_INITIAL_SIZE 256
+
+struct deque_array {
+  long size;                    /* A power of two. */
+  struct deque_array *next_retired;
+  void *items[];
+};
+
+static struct deque_array *deque_array_new(long size) {
+  struct deque_array *array = malloc(sizeof(struct deque_array) + size * sizeof(void *));
+  if (!array) return NULL;
+  array->size = size;
+  array->next_retired = NULL;
+  return array;
+}
+
+static void *deque_array_get(struct deque_array *array, long index) {
+  return __atomic_load_n(&array->items[index & (array->size - 1)], __ATOMIC_RELAXED);
+}
+
+static void deque_array_put(struct deque_array *array, long index, void *item) {
+  __atomic_store_n(&array->items[index & (array->size - 1)], item, __ATOMIC_RELAXED);
+}
+
+int deque_init(struct deque *deque) {
+  deque->top = deque->bottom = 0;
+  deque->retired = NULL;
+  deque->array = deque_array_new(DEQUE_INITIAL_SIZE);
+  return deque->array ? 0 : -1;
+}
+
+void deque_destroy(struct deque *deque) {
+  while (deque->retired) {
+    struct deque_array *next = deque->retired->next_retired;
+    free(deque->retired);
+    deque->retired = next;
+  }
+  free(deque->array);
+  deque->array = NULL;
+}
+
+/* Copies the live items [TOP, BOTTOM) into a buffer twice the size. */
+static struct deque_array *deque_grow(struct deque *deque, struct deque_array *array,
+    long top, long bottom) {
+  struct deque_array *grown = deque_array_new(array->size * 2);
+  if (!grown) return NULL;
+  for (long i = top; i < bottom; i++)
+    deque_array_put(grown, i, deque_array_get(array, i));
+  array->next_retired = deque->retired;
+  deque->retired = array;
+  __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+
+int deque_push(struct deque *deque, void *item) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  if (bottom - top > array->size - 1) {
+    array = deque_grow(deque, array, top, bottom);
+    if (!array) return -1;
+  }
+  deque_array_put(array, bottom, item);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void *deque_pop(struct deque *deque) {
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  void *item = deque_array_get(array, bottom);
+  if (top == bottom) {
+    /* Last item: whoever moves top first gets it. */
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      item = NULL;
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return item;
+}
+
+void *deque_steal(struct deque *deque) {
+  long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) return NULL;
+
+  struct deque_array *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  void *item = deque_array_get(array, top);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return item;
+}
+
+long deque_size(struct deque *deque) {
+  long size = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) -
+      __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+  return size > 0 ? size : 0;
+}
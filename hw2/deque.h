@@ -0,0 +1,39 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+/*
+ * A Chase-Lev work-stealing deque of pointers.
+ *
+ * Only the owning thread may push and pop, both at the bottom, so the owner
+ * keeps reusing its most recent (cache-warm) items. Any other thread may
+ * steal from the top. Push and pop take no atomic read-modify-write except
+ * when racing a thief for the last item. The buffer grows as needed; old
+ * buffers are kept until the deque is destroyed, since a thief may still be
+ * reading one.
+ */
+
+struct deque_array;
+
+struct deque {
+  long top __attribute__((aligned(64)));
+  long bottom __attribute__((aligned(64)));
+  struct deque_array *array;
+  struct deque_array *retired;
+};
+
+int deque_init(struct deque *deque);
+void deque_destroy(struct deque *deque);
+
+/* Owner only. Returns -1 if the deque needed to grow and malloc failed. */
+int deque_push(struct deque *deque, void *item);
+
+/* Owner only. Returns the newest item, or NULL if the deque is empty. */
+void *deque_pop(struct deque *deque);
+
+/* Returns the oldest item, or NULL if the deque is empty or another thread won it. */
+void *deque_steal(struct deque *deque);
+
+/* A racy estimate of the number of items, for load balancing. */
+long deque_size(struct deque *deque);
+
+#endif
@@ -0,0 +1,255 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.h"
+#include "libhttp.h"
+
+#define FILES_LISTING_FOOTER "</ul></body></html>\n"
+
+/* Longest listing line: a path and a name percent-encoded, then the name HTML-escaped. */
+#define FILES_LISTING_LINE_MAX (3 * (PATH_MAX + NAME_MAX + 1) + 6 * NAME_MAX + 64)
+
+/*
+ * Output that goes on counting past its end, as snprintf() does, unless it
+ * may grow: then data is malloc'ed and doubled as needed, and freed and set
+ * to NULL if that fails.
+ */
+struct files_output {
+  char *data;
+  size_t size;
+  size_t length;
+  int growable;
+};
+
+static void files_put(struct files_output *output, char *string, size_t length) {
+  if (output->growable && output->data && output->length + length > output->size) {
+    size_t size = output->size;
+    while (size < output->length + length) size *= 2;
+    char *grown = realloc(output->data, size);
+    if (!grown) free(output->data);
+    output->data = grown;
+    output->size = size;
+  }
+  if (output->data && output->length + length <= output->size)
+    memcpy(output->data + output->length, string, length);
+  output->length += length;
+}
+
+static void files_put_string(struct files_output *output, char *string) {
+  files_put(output, string, strlen(string));
+}
+
+/* Puts TEXT with the characters that are markup in HTML as entities. */
+static void files_put_html(struct files_output *output, char *text) {
+  for (; *text; text++) {
+    switch (*text) {
+      case '&': files_put_string(output, "&amp;"); break;
+      case '<': files_put_string(output, "&lt;"); break;
+      case '>': files_put_string(output, "&gt;"); break;
+      case '"': files_put_string(output, "&quot;"); break;
+      default: files_put(output, text, 1); break;
+    }
+  }
+}
+
+/* Puts PATH percent-encoded, except for '/' and the unreserved characters. */
+static void files_put_url(struct files_output *output, char *path) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (; *path; path++) {
+    unsigned char c = *path;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        strchr("/-._~", c)) {
+      files_put(output, path, 1);
+    } else {
+      char escape[3] = { '%', hex[c >> 4], hex[c & 15] };
+      files_put(output, escape, 3);
+    }
+  }
+}
+
+static int files_hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Decodes the percent-escapes in REQUEST_PATH into PATH (of SIZE bytes).
+ * Returns -1 if an escape is malformed or stands for NUL, or if the result
+ * does not fit.
+ */
+static int files_decode_path(char *request_path, char *path, size_t size) {
+  size_t length = 0;
+  for (char *cursor = request_path; *cursor; cursor++) {
+    char c = *cursor;
+    if (c == '%') {
+      int high = files_hex_value(cursor[1]);
+      int low = high < 0 ? -1 : files_hex_value(cursor[2]);
+      if (low < 0 || (high == 0 && low == 0)) return -1;
+      c = high << 4 | low;
+      cursor += 2;
+    }
+    if (length + 1 >= size) return -1;
+    path[length++] = c;
+  }
+  path[length] = '\0';
+  return 0;
+}
+
+/* Rejects any ".." path component so requests cannot climb out of ROOT. */
+static int files_path_is_safe(char *request_path) {
+  char *component = request_path;
+  while (component) {
+    if (component[0] == '.' && component[1] == '.' &&
+        (component[2] == '/' || component[2] == '\0'))
+      return 0;
+    component = strchr(component, '/');
+    if (component) component++;
+  }
+  return 1;
+}
+
+int files_upload_path(char *root, char *request_path, char *path, size_t size) {
+  struct stat path_stat;
+  char decoded[PATH_MAX];
+  if (!request_path || files_decode_path(request_path, decoded, sizeof(decoded)) < 0)
+    return -1;
+  size_t length = strlen(decoded);
+  if (length < 2 || decoded[0] != '/' || decoded[length - 1] == '/' ||
+      !files_path_is_safe(decoded))
+    return -1;
+  int written = snprintf(path, size, "%s%s", root, decoded);
+  if (written < 0 || (size_t) written >= size)
+    return -1;
+  if (stat(path, &path_stat) == 0 && !S_ISREG(path_stat.st_mode))
+    return -1;
+
+  /* The directory has to exist already; uploads do not create any. */
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  int parent_ok = stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode);
+  *slash = '/';
+  return parent_ok ? 0 : -1;
+}
+
+static enum files_kind files_open_regular(struct files_entry *entry) {
+  struct stat file_stat;
+  entry->fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+  if (entry->fd < 0 || fstat(entry->fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+    if (entry->fd >= 0) close(entry->fd);
+    entry->fd = -1;
+    return entry->kind = FILES_NOT_FOUND;
+  }
+  entry->size = file_stat.st_size;
+  entry->mime_type = http_get_mime_type(entry->path);
+  return entry->kind = FILES_REGULAR;
+}
+
+enum files_kind files_lookup(char *root, char *request_path, struct files_entry *entry) {
+  struct stat path_stat;
+  char decoded[PATH_MAX];
+
+  entry->fd = -1;
+  entry->size = 0;
+  entry->mime_type = NULL;
+  entry->kind = FILES_NOT_FOUND;
+
+  if (!request_path || files_decode_path(request_path, decoded, sizeof(decoded)) < 0 ||
+      decoded[0] != '/' || !files_path_is_safe(decoded))
+    return FILES_NOT_FOUND;
+
+  int length = snprintf(entry->path, sizeof(entry->path), "%s%s", root, decoded);
+  if (length < 0 || length >= (int) sizeof(entry->path))
+    return FILES_NOT_FOUND;
+
+  if (stat(entry->path, &path_stat) < 0)
+    return FILES_NOT_FOUND;
+
+  if (S_ISREG(path_stat.st_mode))
+    return files_open_regular(entry);
+
+  if (!S_ISDIR(path_stat.st_mode))
+    return FILES_NOT_FOUND;
+
+  char directory[PATH_MAX];
+  memcpy(directory, entry->path, length + 1);
+  if (snprintf(entry->path, sizeof(entry->path), "%s/index.html", directory) <
+      (int) sizeof(entry->path) && files_open_regular(entry) == FILES_REGULAR)
+    return FILES_REGULAR;
+
+  memcpy(entry->path, directory, length + 1);
+  return entry->kind = FILES_DIRECTORY;
+}
+
+/*
+ * Writes the listing's header into OUTPUT, for the directory at the decoded
+ * PATH, and returns the separator that goes between PATH and the names.
+ */
+static char *files_listing_header(struct files_output *output, char *path) {
+  files_put_string(output, "<html><body><h1>Index of ");
+  files_put_html(output, path);
+  files_put_string(output, "</h1><ul>\n");
+  return path[strlen(path) - 1] == '/' ? "" : "/";
+}
+
+/* Writes the listing's line for NAME into OUTPUT. */
+static void files_listing_entry(struct files_output *output, char *path, char *separator,
+    char *name) {
+  files_put_string(output, "<li><a href=\"");
+  files_put_url(output, path);
+  files_put_url(output, separator);
+  files_put_url(output, name);
+  files_put_string(output, "\">");
+  files_put_html(output, name);
+  files_put_string(output, "</a></li>\n");
+}
+
+char *files_render_listing(struct files_entry *entry, char *request_path, size_t *length) {
+  char path[PATH_MAX];
+  if (files_decode_path(request_path, path, sizeof(path)) < 0) return NULL;
+
+  struct files_output output = { malloc(1024), 1024, 0, 1 };
+  DIR *directory = opendir(entry->path);
+  struct dirent *dirent;
+
+  char *separator = files_listing_header(&output, path);
+  while (output.data && directory && (dirent = readdir(directory)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0) continue;
+    files_listing_entry(&output, path, separator, dirent->d_name);
+  }
+  if (directory) closedir(directory);
+
+  /* The footer goes in with its NUL. */
+  files_put(&output, FILES_LISTING_FOOTER, sizeof(FILES_LISTING_FOOTER));
+  *length = output.length - 1;
+  return output.data;
+}
+
+void files_send_listing(int fd, struct files_entry *entry, char *request_path) {
+  char path[PATH_MAX];
+  if (files_decode_path(request_path, path, sizeof(path)) < 0) return;
+
+  char line[FILES_LISTING_LINE_MAX];
+  struct files_output output = { line, sizeof(line), 0, 0 };
+  char *separator = files_listing_header(&output, path);
+  if (output.length <= output.size) http_send_chunk(fd, line, output.length);
+
+  DIR *directory = opendir(entry->path);
+  struct dirent *dirent;
+  while (directory && (dirent = readdir(directory)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0) continue;
+    output.length = 0;
+    files_listing_entry(&output, path, separator, dirent->d_name);
+    if (output.length <= output.size) http_send_chunk(fd, line, output.length);
+  }
+  if (directory) closedir(directory);
+
+  http_send_chunk(fd, FILES_LISTING_FOOTER, strlen(FILES_LISTING_FOOTER));
+}
@@ -0,0 +1,58 @@
+/*
+ * Maps request paths onto a directory of static files.
+ *
+ * Shared by every engine that serves --files, so they agree on which file,
+ * index page or directory listing a path refers to.
+ */
+
+#ifndef FILES_H
+#define FILES_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+enum files_kind {
+  FILES_NOT_FOUND,
+  FILES_REGULAR,
+  FILES_DIRECTORY
+};
+
+struct files_entry {
+  enum files_kind kind;
+  int fd;             /* Open file for FILES_REGULAR, -1 otherwise. */
+  off_t size;         /* Size of the open file. */
+  char *mime_type;    /* Content-Type of the open file. */
+  char path[PATH_MAX];
+};
+
+/*
+ * Looks up REQUEST_PATH, after decoding its percent-escapes, under ROOT. A
+ * directory containing index.html resolves to that file. Paths that try to
+ * escape ROOT are reported as FILES_NOT_FOUND. The caller closes entry->fd.
+ */
+enum files_kind files_lookup(char *root, char *request_path, struct files_entry *entry);
+
+/*
+ * Resolves REQUEST_PATH under ROOT as the target of an upload, storing the
+ * file's path in PATH (of SIZE bytes). Returns -1 if the path is unsafe,
+ * names a directory or anything other than a regular file, or lies in a
+ * directory that does not exist.
+ */
+int files_upload_path(char *root, char *request_path, char *path, size_t size);
+
+/*
+ * Renders an HTML page linking to every file in the FILES_DIRECTORY ENTRY.
+ * Names are HTML-escaped in the text and percent-encoded in the links, so a
+ * file name cannot inject markup. Returns a malloc'ed buffer and stores its
+ * length in *length, or returns NULL if memory runs out.
+ */
+char *files_render_listing(struct files_entry *entry, char *request_path, size_t *length);
+
+/*
+ * Sends the same page to FD with http_send_chunk() as the directory is read,
+ * for a response whose headers included http_start_chunked(). The caller
+ * ends the body with http_end_chunked().
+ */
+void files_send_listing(int fd, struct files_entry *entry, char *request_path);
+
+#endif
@@ -0,0 +1,919 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "h2.h"
+#include "hpack.h"
+
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384         /* SETTINGS_MAX_FRAME_SIZE; we keep the default. */
+#define H2_DEFAULT_WINDOW_SIZE 65535
+#define H2_MAX_WINDOW_SIZE 0x7fffffff
+#define H2_MAX_CONCURRENT_STREAMS 100
+#define H2_MAX_HEADER_BLOCK_SIZE (64 * 1024)
+#define H2_MAX_HEADERS 100
+#define H2_STREAM_ARENA_BLOCK_SIZE 1024
+
+/*
+ * Request bodies are collected before the handler runs, since handlers run
+ * one at a time between reads. A stream whose body would push a session's
+ * collected bytes past this limit is answered 413 instead.
+ */
+#define H2_MAX_REQUEST_BODY_SIZE (1024 * 1024)
+
+enum h2_frame_type {
+  H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS, H2_PUSH_PROMISE,
+  H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum h2_error {
+  H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+  H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+  H2_CANCEL, H2_COMPRESSION_ERROR, H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+
+enum h2_setting {
+  H2_SETTINGS_HEADER_TABLE_SIZE = 1, H2_SETTINGS_ENABLE_PUSH, H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+  H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_SETTINGS_MAX_FRAME_SIZE, H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+struct h2_stream {
+  struct h2_session *session;
+  uint32_t id;
+  int end_stream_received;      /* The client has finished its request. */
+  int handled;                  /* The handler ran; the response is queued. */
+  int headers_sent;
+  int aborted;                  /* The handler gave up; reset after HEADERS. */
+  int64_t send_window;          /* Can go negative when the peer shrinks it. */
+
+  struct arena arena;           /* Holds request. */
+  struct http_request *request;
+  char *request_body;           /* DATA received so far. */
+  size_t request_body_length;
+  size_t request_body_capacity;
+  int request_body_too_large;
+  struct http_output output;    /* Bound to the session's fd while handling. */
+
+  unsigned char *header_block;  /* HPACK-encoded response headers. */
+  size_t header_length;
+  size_t header_capacity;
+  char *body;
+  size_t body_length;
+  size_t body_capacity;
+  size_t body_sent;
+  int file_fd;                  /* Sent after body, or -1. */
+  off_t file_size;
+  off_t file_sent;
+
+  struct h2_stream *next;
+};
+
+struct h2_session {
+  int fd;
+  ssize_t (*write)(void *context, char *data, size_t size);
+  void *write_context;
+
+  struct hpack_table decoder;
+  struct hpack_table encoder;
+
+  struct h2_stream *streams;    /* Open streams, oldest first. */
+  struct h2_stream **streams_tail;
+  int num_streams;
+  uint32_t last_stream_id;      /* Highest stream the client opened. */
+
+  int64_t send_window;          /* Connection-level window for our DATA. */
+  int64_t initial_window;       /* Client's SETTINGS_INITIAL_WINDOW_SIZE. */
+  size_t request_body_size;     /* Sum of the streams' request_body_length. */
+  int settings_received;
+  int goaway_sent;
+  int goaway_received;
+
+  /* Header block being assembled from HEADERS and CONTINUATION frames. */
+  unsigned char *header_block;
+  size_t header_length;
+  size_t header_capacity;
+  uint32_t header_stream;       /* 0 when no block is in progress. */
+  int header_end_stream;
+
+  /* A frame that arrived split across h2_session_receive() calls. */
+  unsigned char *partial;
+  size_t partial_length;
+
+  /* Control frames waiting for h2_session_send(). */
+  unsigned char *control;
+  size_t control_length;
+  size_t control_capacity;
+};
+
+int h2_match_preface(char *buffer, size_t length) {
+  size_t compared = length < H2_PREFACE_LENGTH ? length : H2_PREFACE_LENGTH;
+  if (compared > 0 && memcmp(buffer, H2_PREFACE, compared) != 0) return -1;
+  return length >= H2_PREFACE_LENGTH;
+}
+
+/* Grows *BUFFER so it can take ADDITIONAL more bytes after LENGTH. */
+static void h2_reserve(unsigned char **buffer, size_t *capacity, size_t length,
+    size_t additional) {
+  if (length + additional <= *capacity) return;
+  size_t grown = *capacity ? *capacity : 256;
+  while (grown < length + additional) grown *= 2;
+  unsigned char *resized = realloc(*buffer, grown);
+  if (!resized) http_fatal_error("Malloc failed");
+  *buffer = resized;
+  *capacity = grown;
+}
+
+static void h2_write_frame_header(unsigned char *out, size_t length, int type, int flags,
+    uint32_t stream_id) {
+  out[0] = length >> 16;
+  out[1] = length >> 8;
+  out[2] = length;
+  out[3] = type;
+  out[4] = flags;
+  out[5] = stream_id >> 24 & 0x7f;
+  out[6] = stream_id >> 16;
+  out[7] = stream_id >> 8;
+  out[8] = stream_id;
+}
+
+static uint32_t h2_read_uint32(unsigned char *data) {
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static void h2_write_uint32(unsigned char *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+/* Queues a control frame with PAYLOAD. */
+static void h2_queue_frame(struct h2_session *session, int type, int flags,
+    uint32_t stream_id, unsigned char *payload, size_t length) {
+  h2_reserve(&session->control, &session->control_capacity, session->control_length,
+      H2_FRAME_HEADER_SIZE + length);
+  unsigned char *out = session->control + session->control_length;
+  h2_write_frame_header(out, length, type, flags, stream_id);
+  if (length > 0) memcpy(out + H2_FRAME_HEADER_SIZE, payload, length);
+  session->control_length += H2_FRAME_HEADER_SIZE + length;
+}
+
+static void h2_queue_rst_stream(struct h2_session *session, uint32_t stream_id, int error) {
+  unsigned char payload[4];
+  h2_write_uint32(payload, error);
+  h2_queue_frame(session, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+static void h2_queue_window_update(struct h2_session *session, uint32_t stream_id,
+    uint32_t increment) {
+  unsigned char payload[4];
+  h2_write_uint32(payload, increment);
+  h2_queue_frame(session, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+static void h2_queue_goaway(struct h2_session *session, int error) {
+  if (session->goaway_sent) return;
+  unsigned char payload[8];
+  h2_write_uint32(payload, session->last_stream_id);
+  h2_write_uint32(payload + 4, error);
+  h2_queue_frame(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+  session->goaway_sent = 1;
+}
+
+struct h2_session *h2_session_new(int fd, ssize_t (*write)(void *, char *, size_t),
+    void *write_context) {
+  struct h2_session *session = calloc(1, sizeof(struct h2_session));
+  if (!session) return NULL;
+  session->fd = fd;
+  session->write = write;
+  session->write_context = write_context;
+  hpack_table_init(&session->decoder);
+  hpack_table_init(&session->encoder);
+  session->streams_tail = &session->streams;
+  session->send_window = H2_DEFAULT_WINDOW_SIZE;
+  session->initial_window = H2_DEFAULT_WINDOW_SIZE;
+
+  unsigned char settings[6];
+  settings[0] = 0;
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  h2_write_uint32(settings + 2, H2_MAX_CONCURRENT_STREAMS);
+  h2_queue_frame(session, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+  return session;
+}
+
+static void h2_stream_free(struct h2_stream *stream) {
+  struct h2_session *session = stream->session;
+  struct h2_stream **link = &session->streams;
+  while (*link != stream) link = &(*link)->next;
+  *link = stream->next;
+  if (session->streams_tail == &stream->next) session->streams_tail = link;
+  session->num_streams--;
+
+  if (stream->output.has_file) close(stream->output.file_fd);
+  if (stream->file_fd >= 0) close(stream->file_fd);
+  arena_destroy(&stream->arena);
+  free(stream->header_block);
+  free(stream->body);
+  free(stream->request_body);
+  session->request_body_size -= stream->request_body_length;
+  free(stream);
+}
+
+void h2_session_free(struct h2_session *session) {
+  while (session->streams) h2_stream_free(session->streams);
+  hpack_table_destroy(&session->decoder);
+  hpack_table_destroy(&session->encoder);
+  free(session->header_block);
+  free(session->partial);
+  free(session->control);
+  free(session);
+}
+
+static struct h2_stream *h2_session_find(struct h2_session *session, uint32_t stream_id) {
+  for (struct h2_stream *stream = session->streams; stream; stream = stream->next)
+    if (stream->id == stream_id) return stream;
+  return NULL;
+}
+
+/*
+ * Turns decoded HEADERS into STREAM's request. Pseudo-headers become the
+ * method and path, :authority becomes Host, and the rest are kept as they
+ * are. Returns 0 if the request is malformed.
+ */
+static int h2_stream_build_request(struct h2_stream *stream, struct http_header *headers,
+    int num_headers) {
+  struct http_request *request = arena_alloc(&stream->arena, sizeof(struct http_request));
+  struct http_header *regular = arena_alloc(&stream->arena,
+      (num_headers + 1) * sizeof(struct http_header));
+  if (!request || !regular) http_fatal_error("Malloc failed");
+  memset(request, 0, sizeof(*request));
+  request->headers = regular;
+  request->minor_version = 1;
+  request->keep_alive = 1;
+
+  char *authority = NULL;
+  for (int i = 0; i < num_headers; i++) {
+    char *key = headers[i].key;
+    if (key[0] == ':') {
+      if (request->num_headers > 0) return 0;   /* Pseudo-headers come first. */
+      if (strcmp(key, ":method") == 0)
+        request->method = headers[i].value;
+      else if (strcmp(key, ":path") == 0)
+        request->path = headers[i].value;
+      else if (strcmp(key, ":authority") == 0)
+        authority = headers[i].value;
+      else if (strcmp(key, ":scheme") != 0)
+        return 0;
+      continue;
+    }
+    for (char *c = key; *c; c++)
+      if (isupper((unsigned char) *c)) return 0;
+    if (strcmp(key, "connection") == 0 || strcmp(key, "transfer-encoding") == 0)
+      return 0;
+    regular[request->num_headers++] = headers[i];
+  }
+  if (!request->method || !request->path || !request->path[0]) return 0;
+  if (authority && !http_request_header(request, "host")) {
+    regular[request->num_headers].key = "host";
+    regular[request->num_headers].value = authority;
+    request->num_headers++;
+  }
+  stream->request = request;
+  return 1;
+}
+
+/*
+ * Decodes the header block assembled for session->header_stream. Every
+ * block is decoded, even for streams we refuse, to keep the HPACK tables in
+ * step. Returns -1 on a connection error.
+ */
+static int h2_end_headers(struct h2_session *session) {
+  uint32_t stream_id = session->header_stream;
+  int end_stream = session->header_end_stream;
+  session->header_stream = 0;
+
+  struct h2_stream *stream = h2_session_find(session, stream_id);
+  if (stream || stream_id <= session->last_stream_id) {
+    /* Trailers: decode and drop. HEADERS on a closed stream is fatal. */
+    if (!stream) {
+      h2_queue_goaway(session, H2_STREAM_CLOSED);
+      return -1;
+    }
+    struct arena scratch;
+    struct http_header *headers;
+    arena_init(&scratch, H2_STREAM_ARENA_BLOCK_SIZE);
+    int result = hpack_decode(&session->decoder, session->header_block,
+        session->header_length, &scratch, &headers, H2_MAX_HEADERS);
+    arena_destroy(&scratch);
+    if (result < 0 || !end_stream) {
+      h2_queue_goaway(session, result < 0 ? H2_COMPRESSION_ERROR : H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    stream->end_stream_received = 1;
+    return 0;
+  }
+
+  session->last_stream_id = stream_id;
+  stream = calloc(1, sizeof(struct h2_stream));
+  if (!stream) http_fatal_error("Malloc failed");
+  stream->session = session;
+  stream->id = stream_id;
+  stream->end_stream_received = end_stream;
+  stream->send_window = session->initial_window;
+  stream->file_fd = -1;
+  arena_init(&stream->arena, H2_STREAM_ARENA_BLOCK_SIZE);
+  *session->streams_tail = stream;
+  session->streams_tail = &stream->next;
+  session->num_streams++;
+
+  struct http_header *headers;
+  int num_headers = hpack_decode(&session->decoder, session->header_block,
+      session->header_length, &stream->arena, &headers, H2_MAX_HEADERS);
+  if (num_headers < 0) {
+    h2_queue_goaway(session, H2_COMPRESSION_ERROR);
+    return -1;
+  }
+
+  int refuse = session->goaway_sent || session->num_streams > H2_MAX_CONCURRENT_STREAMS;
+  if (refuse || !h2_stream_build_request(stream, headers, num_headers)) {
+    h2_queue_rst_stream(session, stream_id, refuse ? H2_REFUSED_STREAM : H2_PROTOCOL_ERROR);
+    h2_stream_free(stream);
+  }
+  return 0;
+}
+
+/* Strips padding from a PADDED frame's payload. Returns 0 if it is malformed. */
+static int h2_unpad(int flags, unsigned char **payload, size_t *length) {
+  if (!(flags & H2_FLAG_PADDED)) return 1;
+  if (*length < 1 || (*payload)[0] >= *length) return 0;
+  *length -= 1 + (*payload)[0];
+  (*payload)++;
+  return 1;
+}
+
+static int h2_receive_headers(struct h2_session *session, int type, int flags,
+    uint32_t stream_id, unsigned char *payload, size_t length) {
+  if (type == H2_CONTINUATION) {
+    if (stream_id != session->header_stream) {
+      h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+  } else {
+    if (stream_id == 0 || !(stream_id & 1) || !h2_unpad(flags, &payload, &length)) {
+      h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+      if (length < 5) {
+        h2_queue_goaway(session, H2_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      payload += 5;
+      length -= 5;
+    }
+    session->header_stream = stream_id;
+    session->header_end_stream = flags & H2_FLAG_END_STREAM;
+    session->header_length = 0;
+  }
+
+  if (session->header_length + length > H2_MAX_HEADER_BLOCK_SIZE) {
+    h2_queue_goaway(session, H2_ENHANCE_YOUR_CALM);
+    return -1;
+  }
+  h2_reserve(&session->header_block, &session->header_capacity, session->header_length, length);
+  memcpy(session->header_block + session->header_length, payload, length);
+  session->header_length += length;
+
+  return flags & H2_FLAG_END_HEADERS ? h2_end_headers(session) : 0;
+}
+
+static int h2_receive_settings(struct h2_session *session, int flags,
+    unsigned char *payload, size_t length) {
+  if (flags & H2_FLAG_ACK) {
+    if (length != 0) {
+      h2_queue_goaway(session, H2_FRAME_SIZE_ERROR);
+      return -1;
+    }
+    return 0;
+  }
+  if (length % 6 != 0) {
+    h2_queue_goaway(session, H2_FRAME_SIZE_ERROR);
+    return -1;
+  }
+
+  for (size_t i = 0; i < length; i += 6) {
+    int id = payload[i] << 8 | payload[i + 1];
+    uint32_t value = h2_read_uint32(payload + i + 2);
+    switch (id) {
+      case H2_SETTINGS_HEADER_TABLE_SIZE:
+        hpack_table_set_limit(&session->encoder, value);
+        break;
+      case H2_SETTINGS_ENABLE_PUSH:
+        if (value > 1) {
+          h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+          return -1;
+        }
+        break;
+      case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+        if (value > H2_MAX_WINDOW_SIZE) {
+          h2_queue_goaway(session, H2_FLOW_CONTROL_ERROR);
+          return -1;
+        }
+        /* The change applies to every open stream's window. */
+        int64_t delta = (int64_t) value - session->initial_window;
+        for (struct h2_stream *stream = session->streams; stream; stream = stream->next)
+          stream->send_window += delta;
+        session->initial_window = value;
+        break;
+      }
+      case H2_SETTINGS_MAX_FRAME_SIZE:
+        /* Our frames never exceed the 16384 every peer must accept. */
+        if (value < H2_MAX_FRAME_SIZE || value > 0xffffff) {
+          h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+          return -1;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  session->settings_received = 1;
+  h2_queue_frame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+  return 0;
+}
+
+static int h2_receive_window_update(struct h2_session *session, uint32_t stream_id,
+    unsigned char *payload, size_t length) {
+  if (length != 4) {
+    h2_queue_goaway(session, H2_FRAME_SIZE_ERROR);
+    return -1;
+  }
+  uint32_t increment = h2_read_uint32(payload) & 0x7fffffff;
+  if (stream_id == 0) {
+    if (increment == 0 || session->send_window + increment > H2_MAX_WINDOW_SIZE) {
+      h2_queue_goaway(session, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+      return -1;
+    }
+    session->send_window += increment;
+    return 0;
+  }
+  struct h2_stream *stream = h2_session_find(session, stream_id);
+  if (!stream) return 0;
+  if (increment == 0 || stream->send_window + increment > H2_MAX_WINDOW_SIZE) {
+    h2_queue_rst_stream(session, stream_id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+    h2_stream_free(stream);
+    return 0;
+  }
+  stream->send_window += increment;
+  return 0;
+}
+
+/*
+ * Collects DATA into the stream's request body. Both receive windows are
+ * refunded straight away: what a session holds is bounded by
+ * H2_MAX_REQUEST_BODY_SIZE rather than by flow control, and the DATA of a
+ * stream over the limit is dropped.
+ */
+static int h2_receive_data(struct h2_session *session, int flags, uint32_t stream_id,
+    unsigned char *payload, size_t length) {
+  size_t frame_length = length;
+  if (stream_id == 0 || !h2_unpad(flags, &payload, &length)) {
+    h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  if (stream_id > session->last_stream_id) {
+    h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+  if (frame_length > 0) h2_queue_window_update(session, 0, frame_length);
+
+  struct h2_stream *stream = h2_session_find(session, stream_id);
+  if (!stream) return 0;
+  if (stream->end_stream_received) {
+    h2_queue_rst_stream(session, stream_id, H2_STREAM_CLOSED);
+    h2_stream_free(stream);
+    return 0;
+  }
+  if (length > 0 && !stream->request_body_too_large) {
+    if (session->request_body_size + length > H2_MAX_REQUEST_BODY_SIZE) {
+      stream->request_body_too_large = 1;
+    } else {
+      h2_reserve((unsigned char **) &stream->request_body, &stream->request_body_capacity,
+          stream->request_body_length, length);
+      memcpy(stream->request_body + stream->request_body_length, payload, length);
+      stream->request_body_length += length;
+      session->request_body_size += length;
+    }
+  }
+  if (flags & H2_FLAG_END_STREAM)
+    stream->end_stream_received = 1;
+  else if (frame_length > 0)
+    h2_queue_window_update(session, stream_id, frame_length);
+  return 0;
+}
+
+/* Dispatches one complete frame. Returns -1 on a connection error. */
+static int h2_receive_frame(struct h2_session *session, unsigned char *frame) {
+  size_t length = frame[0] << 16 | frame[1] << 8 | frame[2];
+  int type = frame[3], flags = frame[4];
+  uint32_t stream_id = h2_read_uint32(frame + 5) & 0x7fffffff;
+  unsigned char *payload = frame + H2_FRAME_HEADER_SIZE;
+
+  /* The client's preface continues with SETTINGS, and a header block with
+   * its CONTINUATION frames may not be interrupted. */
+  if ((!session->settings_received && type != H2_SETTINGS) ||
+      (session->header_stream && type != H2_CONTINUATION)) {
+    h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+    return -1;
+  }
+
+  switch (type) {
+    case H2_DATA:
+      return h2_receive_data(session, flags, stream_id, payload, length);
+
+    case H2_HEADERS:
+    case H2_CONTINUATION:
+      return h2_receive_headers(session, type, flags, stream_id, payload, length);
+
+    case H2_PRIORITY:
+      if (stream_id == 0 || length != 5) {
+        h2_queue_goaway(session, stream_id ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      return 0;
+
+    case H2_RST_STREAM: {
+      if (stream_id == 0 || length != 4) {
+        h2_queue_goaway(session, stream_id ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      struct h2_stream *stream = h2_session_find(session, stream_id);
+      if (stream) h2_stream_free(stream);
+      return 0;
+    }
+
+    case H2_SETTINGS:
+      if (stream_id != 0) {
+        h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+        return -1;
+      }
+      return h2_receive_settings(session, flags, payload, length);
+
+    case H2_PING:
+      if (stream_id != 0 || length != 8) {
+        h2_queue_goaway(session, stream_id ? H2_PROTOCOL_ERROR : H2_FRAME_SIZE_ERROR);
+        return -1;
+      }
+      if (!(flags & H2_FLAG_ACK))
+        h2_queue_frame(session, H2_PING, H2_FLAG_ACK, 0, payload, length);
+      return 0;
+
+    case H2_GOAWAY:
+      session->goaway_received = 1;
+      return 0;
+
+    case H2_WINDOW_UPDATE:
+      return h2_receive_window_update(session, stream_id, payload, length);
+
+    case H2_PUSH_PROMISE:
+      h2_queue_goaway(session, H2_PROTOCOL_ERROR);
+      return -1;
+
+    default:
+      return 0;                 /* Unknown frame types are ignored. */
+  }
+}
+
+int h2_session_receive(struct h2_session *session, char *data, size_t length) {
+  unsigned char *cursor = (unsigned char *) data, *end = cursor + length;
+
+  while (cursor < end) {
+    unsigned char *frame;
+    size_t available;
+
+    if (session->partial_length > 0) {
+      /* Top up the frame we already have part of. */
+      size_t needed = H2_FRAME_HEADER_SIZE;
+      if (session->partial_length >= H2_FRAME_HEADER_SIZE)
+        needed += session->partial[0] << 16 | session->partial[1] << 8 | session->partial[2];
+      size_t take = needed - session->partial_length;
+      if (take > (size_t) (end - cursor)) take = end - cursor;
+      memcpy(session->partial + session->partial_length, cursor, take);
+      session->partial_length += take;
+      cursor += take;
+      frame = session->partial;
+      available = session->partial_length;
+    } else {
+      frame = cursor;
+      available = end - cursor;
+    }
+
+    if (available < H2_FRAME_HEADER_SIZE) {
+      if (frame == cursor) goto keep_partial;
+      continue;
+    }
+    size_t frame_length = frame[0] << 16 | frame[1] << 8 | frame[2];
+    if (frame_length > H2_MAX_FRAME_SIZE) {
+      h2_queue_goaway(session, H2_FRAME_SIZE_ERROR);
+      return -1;
+    }
+    if (available < H2_FRAME_HEADER_SIZE + frame_length) {
+      if (frame == cursor) goto keep_partial;
+      continue;
+    }
+
+    if (frame == cursor)
+      cursor += H2_FRAME_HEADER_SIZE + frame_length;
+    else
+      session->partial_length = 0;
+    if (h2_receive_frame(session, frame) < 0) return -1;
+    continue;
+
+  keep_partial:
+    if (!session->partial) {
+      session->partial = malloc(H2_FRAME_HEADER_SIZE + H2_MAX_FRAME_SIZE);
+      if (!session->partial) http_fatal_error("Malloc failed");
+    }
+    memcpy(session->partial, cursor, available);
+    session->partial_length = available;
+    break;
+  }
+  return 0;
+}
+
+struct h2_stream *h2_session_next_request(struct h2_session *session) {
+  for (struct h2_stream *stream = session->streams; stream; stream = stream->next)
+    if (!stream->handled && stream->end_stream_received) return stream;
+  return NULL;
+}
+
+/* The stream's http_output write hook: buffers the response body. */
+static ssize_t h2_stream_write(void *void_stream, char *data, size_t size) {
+  struct h2_stream *stream = void_stream;
+  h2_reserve((unsigned char **) &stream->body, &stream->body_capacity, stream->body_length, size);
+  memcpy(stream->body + stream->body_length, data, size);
+  stream->body_length += size;
+  return size;
+}
+
+static void h2_stream_encode_header(struct h2_stream *stream, char *name, char *value) {
+  struct hpack_table *encoder = &stream->session->encoder;
+  while (1) {
+    size_t length = hpack_encode(encoder, name, value, stream->header_block,
+        stream->header_length, stream->header_capacity);
+    if (length > 0) {
+      stream->header_length = length;
+      return;
+    }
+    h2_reserve(&stream->header_block, &stream->header_capacity, stream->header_capacity,
+        strlen(name) + strlen(value) + 16);
+  }
+}
+
+void h2_stream_start_response(struct h2_stream *stream, int status_code) {
+  char status[16];
+  snprintf(status, sizeof(status), "%d", status_code);
+  h2_stream_encode_header(stream, ":status", status);
+}
+
+void h2_stream_send_header(struct h2_stream *stream, char *key, char *value) {
+  /* HTTP/2 has no connection-specific headers, and names are lowercase. */
+  static char *hop_by_hop[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"
+  };
+  for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+    if (strcasecmp(key, hop_by_hop[i]) == 0) return;
+
+  char name[256];
+  size_t length = strlen(key);
+  if (length >= sizeof(name)) return;
+  for (size_t i = 0; i <= length; i++)
+    name[i] = tolower((unsigned char) key[i]);
+  h2_stream_encode_header(stream, name, value);
+}
+
+void h2_stream_handle(struct h2_stream *stream,
+    void (*request_handler)(int, struct http_request *)) {
+  struct h2_session *session = stream->session;
+  struct http_output *output = &stream->output;
+
+  http_output_attach(session->fd, output, stream->request);
+  output->stream = stream;
+  output->write = h2_stream_write;
+  output->write_context = stream;
+  if (stream->request_body_too_large) {
+    http_start_response(session->fd, 413);
+    http_send_header(session->fd, "Content-Length", "0");
+    http_end_headers(session->fd);
+  } else {
+    /* The body is all here, so it reads like one with a Content-Length. */
+    struct http_body body;
+    stream->request->chunked = 0;
+    stream->request->content_length = stream->request_body_length;
+    http_body_init(&body, stream->request, session->fd, stream->request_body,
+        &stream->request_body_length, stream->request_body_length, NULL, NULL, 0);
+    size_t received = stream->request_body_length;
+    request_handler(session->fd, stream->request);
+    stream->request->body = NULL;
+    session->request_body_size -= received;
+    stream->request_body_length = 0;
+    free(stream->request_body);
+    stream->request_body = NULL;
+  }
+  http_output_unbind(session->fd);
+
+  /* A file the handler sent is read into DATA frames as the windows allow. */
+  if (output->has_file) {
+    stream->file_fd = output->file_fd;
+    stream->file_size = output->file_size;
+    output->has_file = 0;
+  }
+  stream->handled = 1;
+  if (stream->header_length == 0) {
+    h2_queue_rst_stream(session, stream->id, H2_INTERNAL_ERROR);
+    h2_stream_free(stream);
+  } else if (output->failed) {
+    /* The header block still has to go out: the encoder has indexed it. */
+    stream->aborted = 1;
+    stream->body_length = 0;
+    if (stream->file_fd >= 0) close(stream->file_fd);
+    stream->file_fd = -1;
+    stream->file_size = 0;
+  }
+}
+
+static int h2_write_all(struct h2_session *session, unsigned char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes_sent = session->write
+        ? session->write(session->write_context, (char *) data, size)
+        : write(session->fd, data, size);
+    if (bytes_sent < 0 && errno == EINTR && !session->write) continue;
+    if (bytes_sent <= 0) return -1;
+    size -= bytes_sent;
+    data += bytes_sent;
+  }
+  return 0;
+}
+
+/* Output is assembled in a bufpool chunk and written whenever it fills. */
+struct h2_writer {
+  struct h2_session *session;
+  unsigned char *buffer;
+  size_t length;
+  int failed;
+};
+
+static void h2_writer_flush(struct h2_writer *writer) {
+  if (writer->length > 0 && !writer->failed &&
+      h2_write_all(writer->session, writer->buffer, writer->length) < 0)
+    writer->failed = 1;
+  writer->length = 0;
+}
+
+/* Returns room for a frame of at least MINIMUM payload bytes, flushing if needed. */
+static size_t h2_writer_room(struct h2_writer *writer, size_t minimum) {
+  if (BUFPOOL_CHUNK_SIZE - writer->length < H2_FRAME_HEADER_SIZE + minimum)
+    h2_writer_flush(writer);
+  return BUFPOOL_CHUNK_SIZE - writer->length - H2_FRAME_HEADER_SIZE;
+}
+
+static void h2_writer_append(struct h2_writer *writer, unsigned char *data, size_t size) {
+  if (BUFPOOL_CHUNK_SIZE - writer->length < size) h2_writer_flush(writer);
+  if (size > BUFPOOL_CHUNK_SIZE) {
+    if (!writer->failed && h2_write_all(writer->session, data, size) < 0) writer->failed = 1;
+    return;
+  }
+  memcpy(writer->buffer + writer->length, data, size);
+  writer->length += size;
+}
+
+/* Emits STREAM's header block as HEADERS plus CONTINUATION frames. */
+static void h2_write_headers(struct h2_writer *writer, struct h2_stream *stream) {
+  int end_stream = stream->body_length == 0 && stream->file_size == 0 && !stream->aborted;
+  size_t offset = 0;
+  do {
+    size_t room = h2_writer_room(writer, 1024);
+    size_t length = stream->header_length - offset;
+    if (length > room) length = room;
+    int last = offset + length == stream->header_length;
+    int type = offset == 0 ? H2_HEADERS : H2_CONTINUATION;
+    int flags = (last ? H2_FLAG_END_HEADERS : 0) |
+        (type == H2_HEADERS && end_stream ? H2_FLAG_END_STREAM : 0);
+    h2_write_frame_header(writer->buffer + writer->length, length, type, flags, stream->id);
+    memcpy(writer->buffer + writer->length + H2_FRAME_HEADER_SIZE,
+        stream->header_block + offset, length);
+    writer->length += H2_FRAME_HEADER_SIZE + length;
+    offset += length;
+  } while (offset < stream->header_length);
+  stream->headers_sent = 1;
+}
+
+/*
+ * Emits one DATA frame for STREAM, as large as the windows and the chunk
+ * allow. Returns 1 if it made progress.
+ */
+static int h2_write_data(struct h2_writer *writer, struct h2_stream *stream) {
+  struct h2_session *session = stream->session;
+  off_t remaining = (stream->body_length - stream->body_sent) +
+      (stream->file_size - stream->file_sent);
+  int64_t window = session->send_window < stream->send_window
+      ? session->send_window : stream->send_window;
+  if (remaining == 0 || window <= 0) return 0;
+
+  size_t room = h2_writer_room(writer, 4096);
+  size_t length = remaining < (off_t) room ? remaining : room;
+  if ((int64_t) length > window) length = window;
+
+  unsigned char *payload = writer->buffer + writer->length + H2_FRAME_HEADER_SIZE;
+  size_t from_body = stream->body_length - stream->body_sent;
+  if (from_body > length) from_body = length;
+  if (from_body > 0) memcpy(payload, stream->body + stream->body_sent, from_body);
+  if (length > from_body) {
+    ssize_t bytes_read = pread(stream->file_fd, payload + from_body, length - from_body,
+        stream->file_sent);
+    if (bytes_read <= 0) {
+      writer->failed = 1;
+      return 0;
+    }
+    length = from_body + bytes_read;
+    stream->file_sent += bytes_read;
+  }
+  stream->body_sent += from_body;
+
+  int last = (off_t) length == remaining;
+  h2_write_frame_header(writer->buffer + writer->length, length, H2_DATA,
+      last ? H2_FLAG_END_STREAM : 0, stream->id);
+  writer->length += H2_FRAME_HEADER_SIZE + length;
+  session->send_window -= length;
+  stream->send_window -= length;
+  return 1;
+}
+
+/* Returns 1 once STREAM's whole response is out. */
+static int h2_stream_finished(struct h2_stream *stream) {
+  return stream->headers_sent && stream->body_sent == stream->body_length &&
+      stream->file_sent == stream->file_size;
+}
+
+int h2_session_send(struct h2_session *session) {
+  struct h2_writer writer = { session, (unsigned char *) bufpool_get(), 0, 0 };
+  if (!writer.buffer) return -1;
+
+  h2_writer_append(&writer, session->control, session->control_length);
+  session->control_length = 0;
+
+  /* HEADERS are not flow controlled, and must leave in the order their
+   * blocks were encoded. */
+  for (struct h2_stream *stream = session->streams; stream; stream = stream->next)
+    if (stream->handled && !stream->headers_sent) h2_write_headers(&writer, stream);
+
+  /* Round robin, one DATA frame per stream per pass. */
+  int progress;
+  do {
+    progress = 0;
+    for (struct h2_stream *stream = session->streams; stream && !writer.failed;
+        stream = stream->next)
+      if (stream->headers_sent) progress |= h2_write_data(&writer, stream);
+  } while (progress && !writer.failed);
+
+  struct h2_stream *stream = session->streams;
+  while (stream) {
+    struct h2_stream *next = stream->next;
+    if (h2_stream_finished(stream)) {
+      /* We are done with a stream the client is still sending on. */
+      if (!stream->end_stream_received || stream->aborted) {
+        unsigned char frame[H2_FRAME_HEADER_SIZE + 4];
+        h2_write_frame_header(frame, 4, H2_RST_STREAM, 0, stream->id);
+        h2_write_uint32(frame + H2_FRAME_HEADER_SIZE,
+            stream->aborted ? H2_INTERNAL_ERROR : H2_NO_ERROR);
+        h2_writer_append(&writer, frame, sizeof(frame));
+      }
+      h2_stream_free(stream);
+    }
+    stream = next;
+  }
+
+  h2_writer_flush(&writer);
+  bufpool_put((char *) writer.buffer);
+  return writer.failed ? -1 : 0;
+}
+
+void h2_session_shutdown(struct h2_session *session) {
+  h2_queue_goaway(session, H2_NO_ERROR);
+}
+
+int h2_session_done(struct h2_session *session) {
+  return (session->goaway_sent || session->goaway_received) && session->num_streams == 0;
+}
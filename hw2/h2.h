@@ -0,0 +1,89 @@
+#ifndef H2_H
+#define H2_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "libhttp.h"
+
+/*
+ * HTTP/2 connections (RFC 9113).
+ *
+ * A client speaks HTTP/2 by opening with the connection preface, either in
+ * cleartext with prior knowledge (h2c) or after choosing "h2" through ALPN
+ * on TLS. The session then demultiplexes its streams into ordinary
+ * struct http_request values and runs the unchanged request handlers on
+ * them one at a time. libhttp turns what a handler writes for a stream into
+ * an HPACK-encoded HEADERS frame and a body; the body and any file the
+ * handler sent are split into DATA frames, interleaved across streams and
+ * held back when the client's flow-control windows run out.
+ *
+ * Sessions do no reading of their own: the caller feeds in whatever bytes
+ * arrive, so an HTTP/2 connection parks between reads like any other.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LENGTH 24
+
+struct h2_session;
+struct h2_stream;
+
+/*
+ * Returns 1 if the LENGTH bytes at BUFFER start with the connection preface,
+ * 0 if they are a prefix of it (so far), or -1 if they cannot be.
+ */
+int h2_match_preface(char *buffer, size_t length);
+
+/*
+ * Starts a session on the socket FD, whose preface has been read, and
+ * queues our SETTINGS. WRITE and WRITE_CONTEXT work like the http_output
+ * write hook; leave WRITE NULL to write to FD. Returns NULL if memory runs
+ * out.
+ */
+struct h2_session *h2_session_new(int fd, ssize_t (*write)(void *, char *, size_t),
+    void *write_context);
+void h2_session_free(struct h2_session *session);
+
+/*
+ * Processes the LENGTH bytes at DATA, all of which are consumed; a frame
+ * split across calls is kept until the rest arrives. Returns -1 if the
+ * client broke the protocol, in which case a GOAWAY is queued and the
+ * connection should be closed after one more h2_session_send().
+ */
+int h2_session_receive(struct h2_session *session, char *data, size_t length);
+
+/*
+ * Returns the oldest stream whose request, body included, is complete but
+ * unhandled, or NULL.
+ */
+struct h2_stream *h2_session_next_request(struct h2_session *session);
+
+/*
+ * Runs REQUEST_HANDLER on STREAM's request with its output bound to the
+ * session's fd, and queues the response. A handler that sends nothing, or
+ * calls http_abort_response(), gets the stream reset.
+ */
+void h2_stream_handle(struct h2_stream *stream,
+    void (*request_handler)(int, struct http_request *));
+
+/*
+ * Writes queued control frames, the HEADERS of every handled stream and as
+ * much of their bodies as the flow-control windows allow. Returns -1 if a
+ * write failed.
+ */
+int h2_session_send(struct h2_session *session);
+
+/* Sends GOAWAY (once): streams already opened finish, new ones are refused. */
+void h2_session_shutdown(struct h2_session *session);
+
+/* Returns 1 once either side has sent GOAWAY and no streams are left. */
+int h2_session_done(struct h2_session *session);
+
+/*
+ * Used by libhttp while a stream's output is attached: the response status
+ * and headers go into the stream's header block instead of a status line.
+ */
+void h2_stream_start_response(struct h2_stream *stream, int status_code);
+void h2_stream_send_header(struct h2_stream *stream, char *key, char *value);
+
+#endif
@@ -0,0 +1,418 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "hpack.h"
+
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_HUFFMAN_SYMBOLS 257    /* 256 octets and EOS. */
+#define HPACK_HUFFMAN_MAX_LENGTH 30
+
+/* Values longer than this are never worth a table slot. */
+#define HPACK_MAX_INDEXED_VALUE 256
+
+static const char *hpack_static_table[HPACK_STATIC_TABLE_SIZE][2] = {
+  { ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+  { ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+  { ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+  { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+  { ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+  { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+  { "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+  { "content-disposition", "" }, { "content-encoding", "" },
+  { "content-language", "" }, { "content-length", "" }, { "content-location", "" },
+  { "content-range", "" }, { "content-type", "" }, { "cookie", "" }, { "date", "" },
+  { "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+  { "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+  { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+  { "link", "" }, { "location", "" }, { "max-forwards", "" },
+  { "proxy-authenticate", "" }, { "proxy-authorization", "" }, { "range", "" },
+  { "referer", "" }, { "refresh", "" }, { "retry-after", "" }, { "server", "" },
+  { "set-cookie", "" }, { "strict-transport-security", "" },
+  { "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+  { "www-authenticate", "" },
+};
+
+/*
+ * Code lengths of the HPACK Huffman code (RFC 7541 Appendix B), by symbol.
+ * The code is canonical, so the codes themselves follow from the lengths.
+ */
+static const unsigned char hpack_huffman_lengths[HPACK_HUFFMAN_SYMBOLS] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+/* Canonical decoding tables, built once from hpack_huffman_lengths. */
+static uint32_t hpack_huffman_codes[HPACK_HUFFMAN_SYMBOLS];
+static uint32_t hpack_huffman_first[HPACK_HUFFMAN_MAX_LENGTH + 1];
+static uint32_t hpack_huffman_count[HPACK_HUFFMAN_MAX_LENGTH + 1];
+static uint32_t hpack_huffman_offset[HPACK_HUFFMAN_MAX_LENGTH + 1];
+static uint16_t hpack_huffman_sorted[HPACK_HUFFMAN_SYMBOLS];
+static pthread_once_t hpack_huffman_once = PTHREAD_ONCE_INIT;
+
+static void hpack_huffman_init() {
+  for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; symbol++)
+    hpack_huffman_count[hpack_huffman_lengths[symbol]]++;
+
+  uint32_t code = 0, offset = 0;
+  for (int length = 1; length <= HPACK_HUFFMAN_MAX_LENGTH; length++) {
+    code = (code + hpack_huffman_count[length - 1]) << 1;
+    hpack_huffman_first[length] = code;
+    hpack_huffman_offset[length] = offset;
+    offset += hpack_huffman_count[length];
+  }
+
+  /* Symbols of equal length get consecutive codes in symbol order. */
+  uint32_t next[HPACK_HUFFMAN_MAX_LENGTH + 1];
+  memcpy(next, hpack_huffman_first, sizeof(next));
+  for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; symbol++) {
+    int length = hpack_huffman_lengths[symbol];
+    uint32_t rank = next[length]++ - hpack_huffman_first[length];
+    hpack_huffman_codes[symbol] = hpack_huffman_first[length] + rank;
+    hpack_huffman_sorted[hpack_huffman_offset[length] + rank] = symbol;
+  }
+}
+
+/* Decodes LENGTH Huffman-coded bytes at DATA into OUT. Returns the decoded length or -1. */
+static ssize_t hpack_huffman_decode(unsigned char *data, size_t length, char *out) {
+  uint32_t code = 0;
+  int bits = 0;
+  char *cursor = out;
+  for (size_t i = 0; i < length; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = code << 1 | ((data[i] >> bit) & 1);
+      bits++;
+      if (code - hpack_huffman_first[bits] < hpack_huffman_count[bits]) {
+        int symbol = hpack_huffman_sorted[hpack_huffman_offset[bits] + code - hpack_huffman_first[bits]];
+        if (symbol == 256) return -1;
+        *cursor++ = symbol;
+        code = 0;
+        bits = 0;
+      } else if (bits == HPACK_HUFFMAN_MAX_LENGTH) {
+        return -1;
+      }
+    }
+  }
+  /* Padding is at most 7 bits, all ones (a prefix of EOS). */
+  if (bits > 7 || code != (1u << bits) - 1) return -1;
+  return cursor - out;
+}
+
+static size_t hpack_huffman_length(char *data, size_t length) {
+  size_t bits = 0;
+  for (size_t i = 0; i < length; i++)
+    bits += hpack_huffman_lengths[(unsigned char) data[i]];
+  return (bits + 7) / 8;
+}
+
+static void hpack_huffman_encode(char *data, size_t length, unsigned char *out) {
+  uint64_t pending = 0;
+  int bits = 0;
+  for (size_t i = 0; i < length; i++) {
+    unsigned char symbol = data[i];
+    pending = pending << hpack_huffman_lengths[symbol] | hpack_huffman_codes[symbol];
+    bits += hpack_huffman_lengths[symbol];
+    while (bits >= 8) {
+      bits -= 8;
+      *out++ = pending >> bits;
+    }
+  }
+  if (bits > 0) *out = (pending << (8 - bits)) | (0xff >> bits);
+}
+
+void hpack_table_init(struct hpack_table *table) {
+  pthread_once(&hpack_huffman_once, hpack_huffman_init);
+  table->count = 0;
+  table->size = 0;
+  table->max_size = HPACK_DEFAULT_TABLE_SIZE;
+  table->size_update_pending = 0;
+}
+
+void hpack_table_destroy(struct hpack_table *table) {
+  for (int i = 0; i < table->count; i++)
+    free(table->entries[i]);
+  table->count = 0;
+  table->size = 0;
+}
+
+static size_t hpack_entry_size(struct hpack_entry *entry) {
+  return entry->name_length + entry->value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+static void hpack_table_evict(struct hpack_table *table, size_t max_size) {
+  while (table->count > 0 && table->size > max_size) {
+    struct hpack_entry *oldest = table->entries[--table->count];
+    table->size -= hpack_entry_size(oldest);
+    free(oldest);
+  }
+}
+
+/* Adds an entry, evicting old ones. An entry larger than the table empties it. */
+static void hpack_table_add(struct hpack_table *table, char *name, size_t name_length,
+    char *value, size_t value_length) {
+  size_t size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+  if (size > table->max_size) {
+    hpack_table_evict(table, 0);
+    return;
+  }
+  hpack_table_evict(table, table->max_size - size);
+
+  struct hpack_entry *entry = malloc(sizeof(struct hpack_entry) + name_length + value_length + 2);
+  if (!entry) http_fatal_error("Malloc failed");
+  entry->name_length = name_length;
+  entry->value_length = value_length;
+  memcpy(entry->data, name, name_length);
+  entry->data[name_length] = '\0';
+  memcpy(entry->data + name_length + 1, value, value_length);
+  entry->data[name_length + 1 + value_length] = '\0';
+
+  memmove(&table->entries[1], &table->entries[0], table->count * sizeof(table->entries[0]));
+  table->entries[0] = entry;
+  table->count++;
+  table->size += size;
+}
+
+/* Looks up INDEX (1-based, static entries first). Returns 0 if it is out of range. */
+static int hpack_table_get(struct hpack_table *table, uint32_t index,
+    const char **name, const char **value) {
+  if (index == 0) return 0;
+  if (index <= HPACK_STATIC_TABLE_SIZE) {
+    *name = hpack_static_table[index - 1][0];
+    *value = hpack_static_table[index - 1][1];
+    return 1;
+  }
+  index -= HPACK_STATIC_TABLE_SIZE + 1;
+  if (index >= (uint32_t) table->count) return 0;
+  *name = table->entries[index]->data;
+  *value = table->entries[index]->data + table->entries[index]->name_length + 1;
+  return 1;
+}
+
+/* Reads an integer with an N-bit prefix. Returns 0 if it is truncated or too large. */
+static int hpack_read_integer(unsigned char **cursor, unsigned char *end, int prefix_bits,
+    uint32_t *value) {
+  uint32_t limit = (1u << prefix_bits) - 1;
+  if (*cursor >= end) return 0;
+  *value = *(*cursor)++ & limit;
+  if (*value < limit) return 1;
+  for (int shift = 0; shift <= 21; shift += 7) {
+    if (*cursor >= end) return 0;
+    unsigned char byte = *(*cursor)++;
+    *value += (uint32_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return 1;
+  }
+  return 0;
+}
+
+static char *hpack_read_string(unsigned char **cursor, unsigned char *end,
+    struct arena *arena, size_t *length) {
+  if (*cursor >= end) return NULL;
+  int huffman = **cursor & 0x80;
+  uint32_t encoded_length;
+  if (!hpack_read_integer(cursor, end, 7, &encoded_length) ||
+      encoded_length > (size_t) (end - *cursor))
+    return NULL;
+
+  /* The shortest code is 5 bits, so decoding grows a string by at most 8/5. */
+  size_t capacity = huffman ? encoded_length * 8 / 5 + 1 : encoded_length + 1;
+  char *string = arena_alloc(arena, capacity);
+  if (!string) http_fatal_error("Malloc failed");
+  if (huffman) {
+    ssize_t decoded = hpack_huffman_decode(*cursor, encoded_length, string);
+    if (decoded < 0) return NULL;
+    *length = decoded;
+  } else {
+    memcpy(string, *cursor, encoded_length);
+    *length = encoded_length;
+  }
+  string[*length] = '\0';
+  *cursor += encoded_length;
+  return string;
+}
+
+int hpack_decode(struct hpack_table *table, unsigned char *block, size_t length,
+    struct arena *arena, struct http_header **headers_out, int max_headers) {
+  unsigned char *cursor = block, *end = block + length;
+  struct http_header *headers = arena_alloc(arena, max_headers * sizeof(struct http_header));
+  if (!headers) http_fatal_error("Malloc failed");
+  int num_headers = 0;
+
+  while (cursor < end) {
+    unsigned char first = *cursor;
+    uint32_t index;
+    const char *name, *value;
+
+    if (first & 0x80) {
+      /* Indexed header field. */
+      if (!hpack_read_integer(&cursor, end, 7, &index) ||
+          !hpack_table_get(table, index, &name, &value))
+        return -1;
+      if (num_headers == max_headers) return -1;
+      headers[num_headers].key = arena_strndup(arena, name, strlen(name));
+      headers[num_headers].value = arena_strndup(arena, value, strlen(value));
+      if (!headers[num_headers].key || !headers[num_headers].value)
+        http_fatal_error("Malloc failed");
+      num_headers++;
+      continue;
+    }
+
+    if ((first & 0xe0) == 0x20) {
+      /* Dynamic table size update; only allowed before the first field. */
+      uint32_t size;
+      if (num_headers > 0 || !hpack_read_integer(&cursor, end, 5, &size) ||
+          size > HPACK_DEFAULT_TABLE_SIZE)
+        return -1;
+      table->max_size = size;
+      hpack_table_evict(table, size);
+      continue;
+    }
+
+    /* Literal: with incremental indexing (01), without (0000) or never (0001). */
+    int indexing = (first & 0xc0) == 0x40;
+    if (!hpack_read_integer(&cursor, end, indexing ? 6 : 4, &index)) return -1;
+
+    char *literal_name;
+    size_t name_length, value_length;
+    if (index > 0) {
+      if (!hpack_table_get(table, index, &name, &value)) return -1;
+      name_length = strlen(name);
+      literal_name = arena_strndup(arena, name, name_length);
+      if (!literal_name) http_fatal_error("Malloc failed");
+    } else {
+      literal_name = hpack_read_string(&cursor, end, arena, &name_length);
+      if (!literal_name) return -1;
+    }
+    char *literal_value = hpack_read_string(&cursor, end, arena, &value_length);
+    if (!literal_value) return -1;
+
+    if (indexing)
+      hpack_table_add(table, literal_name, name_length, literal_value, value_length);
+    if (num_headers == max_headers) return -1;
+    headers[num_headers].key = literal_name;
+    headers[num_headers].value = literal_value;
+    num_headers++;
+  }
+
+  *headers_out = headers;
+  return num_headers;
+}
+
+void hpack_table_set_limit(struct hpack_table *table, size_t limit) {
+  if (limit > HPACK_DEFAULT_TABLE_SIZE) limit = HPACK_DEFAULT_TABLE_SIZE;
+  if (limit == table->max_size) return;
+  table->max_size = limit;
+  table->size_update_pending = 1;
+  hpack_table_evict(table, limit);
+}
+
+/* Writes VALUE with an N-bit prefix whose other bits are FLAGS. Returns the length or 0. */
+static size_t hpack_write_integer(unsigned char *out, size_t capacity, unsigned char flags,
+    int prefix_bits, uint32_t value) {
+  uint32_t limit = (1u << prefix_bits) - 1;
+  if (capacity < 1) return 0;
+  if (value < limit) {
+    out[0] = flags | value;
+    return 1;
+  }
+  out[0] = flags | limit;
+  value -= limit;
+  size_t length = 1;
+  while (1) {
+    if (length == capacity) return 0;
+    if (value < 0x80) {
+      out[length++] = value;
+      return length;
+    }
+    out[length++] = 0x80 | (value & 0x7f);
+    value >>= 7;
+  }
+}
+
+/* Writes a string literal, Huffman-coded when that is shorter. Returns the length or 0. */
+static size_t hpack_write_string(unsigned char *out, size_t capacity, char *string) {
+  size_t length = strlen(string);
+  size_t huffman_length = hpack_huffman_length(string, length);
+  int huffman = huffman_length < length;
+  size_t encoded_length = huffman ? huffman_length : length;
+
+  size_t prefix = hpack_write_integer(out, capacity, huffman ? 0x80 : 0, 7, encoded_length);
+  if (prefix == 0 || capacity - prefix < encoded_length) return 0;
+  if (huffman)
+    hpack_huffman_encode(string, length, out + prefix);
+  else
+    memcpy(out + prefix, string, length);
+  return prefix + encoded_length;
+}
+
+/* Finds NAME: VALUE in either table. Returns the full match, or 0 with *NAME_INDEX set. */
+static uint32_t hpack_table_find(struct hpack_table *table, char *name, char *value,
+    uint32_t *name_index) {
+  *name_index = 0;
+  for (int i = 0; i < HPACK_STATIC_TABLE_SIZE; i++) {
+    if (strcmp(hpack_static_table[i][0], name) != 0) continue;
+    if (strcmp(hpack_static_table[i][1], value) == 0) return i + 1;
+    if (!*name_index) *name_index = i + 1;
+  }
+  for (int i = 0; i < table->count; i++) {
+    struct hpack_entry *entry = table->entries[i];
+    if (strcmp(entry->data, name) != 0) continue;
+    if (strcmp(entry->data + entry->name_length + 1, value) == 0)
+      return HPACK_STATIC_TABLE_SIZE + 1 + i;
+    if (!*name_index) *name_index = HPACK_STATIC_TABLE_SIZE + 1 + i;
+  }
+  return 0;
+}
+
+size_t hpack_encode(struct hpack_table *table, char *name, char *value,
+    unsigned char *out, size_t length, size_t capacity) {
+  size_t start = length, written;
+
+  if (table->size_update_pending && length == 0) {
+    written = hpack_write_integer(out, capacity, 0x20, 5, table->max_size);
+    if (written == 0) return 0;
+    length += written;
+  }
+
+  uint32_t name_index, index = hpack_table_find(table, name, value, &name_index);
+  if (index) {
+    written = hpack_write_integer(out + length, capacity - length, 0x80, 7, index);
+    if (written == 0) return 0;
+    length += written;
+  } else {
+    int indexing = strcmp(name, "content-length") != 0 && strlen(value) <= HPACK_MAX_INDEXED_VALUE;
+    written = hpack_write_integer(out + length, capacity - length, indexing ? 0x40 : 0,
+        indexing ? 6 : 4, name_index);
+    if (written == 0) return 0;
+    length += written;
+    if (!name_index) {
+      written = hpack_write_string(out + length, capacity - length, name);
+      if (written == 0) return 0;
+      length += written;
+    }
+    written = hpack_write_string(out + length, capacity - length, value);
+    if (written == 0) return 0;
+    length += written;
+    if (indexing) hpack_table_add(table, name, strlen(name), value, strlen(value));
+  }
+
+  if (start == 0) table->size_update_pending = 0;
+  return length;
+}
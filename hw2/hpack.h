@@ -0,0 +1,66 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "libhttp.h"
+
+/*
+ * HPACK header compression for HTTP/2 (RFC 7541).
+ *
+ * Each direction of a connection has its own dynamic table: the decoder's
+ * mirrors what the client added, the encoder's what we told the client to
+ * add. Header blocks must be decoded, and encoded blocks sent, in the order
+ * they appear on the connection, or the two ends' tables drift apart.
+ *
+ * The encoder sends headers it has sent before as a single index, and adds
+ * the rest to its table so the next response can do the same; only values
+ * that differ per response (Content-Length) are sent literally every time.
+ */
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+
+struct hpack_entry {
+  size_t name_length;
+  size_t value_length;
+  char data[];                  /* Name, NUL, value, NUL. */
+};
+
+struct hpack_table {
+  struct hpack_entry *entries[HPACK_DEFAULT_TABLE_SIZE / HPACK_ENTRY_OVERHEAD];
+  int count;                    /* entries[0] is the newest. */
+  size_t size;                  /* Sum of entry sizes as RFC 7541 counts them. */
+  size_t max_size;              /* Current limit, at most HPACK_DEFAULT_TABLE_SIZE. */
+  int size_update_pending;      /* Encoder: announce max_size in the next block. */
+};
+
+void hpack_table_init(struct hpack_table *table);
+void hpack_table_destroy(struct hpack_table *table);
+
+/*
+ * Decodes the header block of LENGTH bytes at BLOCK into an array of at most
+ * MAX_HEADERS headers allocated from ARENA. Returns the number of headers,
+ * or -1 if the block is malformed (a connection-level COMPRESSION_ERROR) or
+ * holds more than MAX_HEADERS.
+ */
+int hpack_decode(struct hpack_table *table, unsigned char *block, size_t length,
+    struct arena *arena, struct http_header **headers, int max_headers);
+
+/*
+ * Lowers the encoder's table size to what the peer allows (its
+ * SETTINGS_HEADER_TABLE_SIZE), evicting entries as needed. The change is
+ * announced at the start of the next header block.
+ */
+void hpack_table_set_limit(struct hpack_table *table, size_t limit);
+
+/*
+ * Appends NAME: VALUE to a header block being built at OUT, which holds
+ * LENGTH bytes of CAPACITY. NAME must be lowercase. Returns the new length,
+ * or 0 if CAPACITY is too small, in which case nothing was changed.
+ */
+size_t hpack_encode(struct hpack_table *table, char *name, char *value,
+    unsigned char *out, size_t length, size_t capacity);
+
+#endif
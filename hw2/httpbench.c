@@ -0,0 +1,862 @@
+/*
+ * httpbench: a multi-threaded, epoll-driven HTTP load generator.
+ *
+ * Every thread owns an epoll instance and a slice of the connections. Two
+ * load models are supported:
+ *
+ *   closed loop  Each connection keeps --pipeline requests in flight and
+ *                issues a new one as soon as a response completes.
+ *   open loop    Requests are scheduled at a constant arrival rate (--rate)
+ *                regardless of how fast the server answers. A request that
+ *                cannot be sent on time waits in a backlog.
+ *
+ * Latency is measured from the time a request was *intended* to be sent, not
+ * the time it was actually written, so a stalled server cannot hide its
+ * queueing delay behind a stalled client (coordinated omission). Closed loop
+ * runs additionally get the HdrHistogram-style back-fill correction using the
+ * mean latency as the expected interval.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_PATHS 64
+#define BENCH_MAX_PIPELINE 64
+#define BENCH_READ_BUFFER_SIZE 16384
+#define BENCH_REQUEST_MAX_SIZE 1024
+#define BENCH_MAX_EVENTS 256
+
+/*
+ * Log-linear latency histogram (values in microseconds). Each power of two
+ * is split into 2^HIST_SUB_BITS linear sub-buckets, which bounds the relative
+ * error of any reported percentile to under 1%.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SIZE ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+  uint64_t counts[HIST_SIZE];
+  uint64_t total;
+  uint64_t max;
+  uint64_t sum;
+};
+
+static int histogram_index(uint64_t value) {
+  if (value < HIST_SUB_COUNT)
+    return (int) value;
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int) ((value >> shift) - HIST_SUB_COUNT);
+}
+
+/* Returns the highest value that maps to bucket INDEX. */
+static uint64_t histogram_value(int index) {
+  if (index < HIST_SUB_COUNT)
+    return index;
+  int shift = (index >> HIST_SUB_BITS) - 1;
+  uint64_t sub = (index & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT;
+  return (sub << shift) + ((1ULL << shift) - 1);
+}
+
+static void histogram_record_n(struct histogram *h, uint64_t value, uint64_t n) {
+  h->counts[histogram_index(value)] += n;
+  h->total += n;
+  h->sum += value * n;
+  if (value > h->max) h->max = value;
+}
+
+static void histogram_merge(struct histogram *dst, struct histogram *src) {
+  for (int i = 0; i < HIST_SIZE; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->max > dst->max) dst->max = src->max;
+}
+
+static uint64_t histogram_percentile(struct histogram *h, double percentile) {
+  if (h->total == 0) return 0;
+  uint64_t target = (uint64_t) (h->total * percentile / 100.0 + 0.5);
+  if (target < 1) target = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_SIZE; i++) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      uint64_t value = histogram_value(i);
+      return value > h->max ? h->max : value;
+    }
+  }
+  return h->max;
+}
+
+/*
+ * Copies SRC into DST, adding the samples a closed loop client would have
+ * recorded had it not waited for each slow response: a response that took
+ * N expected intervals hides N - 1 requests that were never sent.
+ */
+static void histogram_correct(struct histogram *dst, struct histogram *src,
+    uint64_t expected_interval) {
+  memset(dst, 0, sizeof(*dst));
+  for (int i = 0; i < HIST_SIZE; i++) {
+    if (src->counts[i] == 0) continue;
+    uint64_t value = histogram_value(i);
+    if (value > src->max) value = src->max;
+    histogram_record_n(dst, value, src->counts[i]);
+    if (expected_interval == 0) continue;
+    for (uint64_t missing = value > expected_interval ? value - expected_interval : 0;
+        missing >= expected_interval; missing -= expected_interval)
+      histogram_record_n(dst, missing, src->counts[i]);
+  }
+}
+
+/*
+ * Global configuration, set up in main() from the command line.
+ */
+char *bench_host = "127.0.0.1";
+char *bench_port = "8000";
+char *bench_paths[BENCH_MAX_PATHS];
+int bench_num_paths;
+int bench_num_threads = 2;
+int bench_num_connections = 16;
+double bench_duration = 10.0;
+double bench_warmup = 0.0;
+double bench_rate = 0.0;
+int bench_pipeline = 1;
+int bench_keep_alive = 1;
+double bench_min_rps = 0.0;
+double bench_max_p99_ms = 0.0;
+
+struct addrinfo *bench_address;
+volatile sig_atomic_t bench_interrupted;
+
+/* Prebuilt request strings, one per path. */
+char *bench_requests[BENCH_MAX_PATHS];
+size_t bench_request_lengths[BENCH_MAX_PATHS];
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+enum body_mode {
+  BODY_NONE,
+  BODY_LENGTH,
+  BODY_CHUNKED,
+  BODY_UNTIL_CLOSE
+};
+
+struct bench_conn {
+  int fd;
+  int connected;
+  int close_after_response;
+
+  /* Intended start times of in-flight requests, oldest first. */
+  uint64_t in_flight[BENCH_MAX_PIPELINE];
+  int in_flight_head;
+  int in_flight_count;
+
+  char write_buffer[BENCH_MAX_PIPELINE * BENCH_REQUEST_MAX_SIZE];
+  size_t write_length;
+  size_t write_offset;
+
+  char read_buffer[BENCH_READ_BUFFER_SIZE];
+  size_t read_length;
+
+  /* Response parser state. */
+  int headers_done;
+  int status_code;
+  enum body_mode body_mode;
+  uint64_t body_remaining;
+  int chunk_trailer;
+};
+
+struct bench_thread {
+  pthread_t thread;
+  int id;
+  int epoll_fd;
+  struct bench_conn *conns;
+  int num_conns;
+  int next_path;
+
+  /* Open loop schedule and backlog of requests waiting for a connection. */
+  double interval_ns;
+  uint64_t scheduled;
+  uint64_t *backlog;
+  size_t backlog_capacity;
+  size_t backlog_head;
+  size_t backlog_count;
+
+  uint64_t start;
+  uint64_t record_after;
+  uint64_t stop;
+
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t non_2xx;
+  uint64_t connects;
+  uint64_t bytes_read;
+  struct histogram latency;
+};
+
+static void backlog_push(struct bench_thread *t, uint64_t start, int front) {
+  if (t->backlog_count == t->backlog_capacity) {
+    size_t capacity = t->backlog_capacity ? t->backlog_capacity * 2 : 1024;
+    uint64_t *backlog = malloc(capacity * sizeof(uint64_t));
+    if (!backlog) {
+      fprintf(stderr, "Malloc failed\n");
+      exit(ENOMEM);
+    }
+    for (size_t i = 0; i < t->backlog_count; i++)
+      backlog[i] = t->backlog[(t->backlog_head + i) % t->backlog_capacity];
+    free(t->backlog);
+    t->backlog = backlog;
+    t->backlog_capacity = capacity;
+    t->backlog_head = 0;
+  }
+  if (front) {
+    t->backlog_head = (t->backlog_head + t->backlog_capacity - 1) % t->backlog_capacity;
+    t->backlog[t->backlog_head] = start;
+  } else {
+    t->backlog[(t->backlog_head + t->backlog_count) % t->backlog_capacity] = start;
+  }
+  t->backlog_count++;
+}
+
+static uint64_t backlog_pop(struct bench_thread *t) {
+  uint64_t start = t->backlog[t->backlog_head];
+  t->backlog_head = (t->backlog_head + 1) % t->backlog_capacity;
+  t->backlog_count--;
+  return start;
+}
+
+static int conn_open(struct bench_thread *t, struct bench_conn *c) {
+  c->fd = socket(bench_address->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd < 0) {
+    perror("Failed to create a new socket");
+    return -1;
+  }
+  int option = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+  if (connect(c->fd, bench_address->ai_addr, bench_address->ai_addrlen) < 0 &&
+      errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    t->errors++;
+    return -1;
+  }
+
+  c->connected = 0;
+  c->close_after_response = !bench_keep_alive;
+  c->in_flight_head = c->in_flight_count = 0;
+  c->write_length = c->write_offset = 0;
+  c->read_length = 0;
+  c->headers_done = 0;
+  t->connects++;
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+  event.data.ptr = c;
+  epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+  return 0;
+}
+
+/* Closes C and hands requests that never got a response back to the backlog. */
+static void conn_close(struct bench_thread *t, struct bench_conn *c) {
+  if (c->fd >= 0) {
+    epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+  }
+  c->fd = -1;
+  for (int i = c->in_flight_count - 1; i >= 0; i--)
+    backlog_push(t, c->in_flight[(c->in_flight_head + i) % BENCH_MAX_PIPELINE], 1);
+  c->in_flight_count = 0;
+}
+
+static void conn_update_events(struct bench_thread *t, struct bench_conn *c) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP;
+  if (!c->connected || c->write_offset < c->write_length)
+    event.events |= EPOLLOUT;
+  event.data.ptr = c;
+  epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+}
+
+static int conn_flush(struct bench_thread *t, struct bench_conn *c) {
+  while (c->write_offset < c->write_length) {
+    ssize_t sent = send(c->fd, c->write_buffer + c->write_offset,
+        c->write_length - c->write_offset, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    c->write_offset += sent;
+  }
+  if (c->write_offset == c->write_length)
+    c->write_offset = c->write_length = 0;
+  conn_update_events(t, c);
+  return 0;
+}
+
+static int conn_capacity(struct bench_conn *c) {
+  if (c->fd < 0) return 0;
+  int limit = c->close_after_response ? 1 : bench_pipeline;
+  return limit - c->in_flight_count;
+}
+
+static void conn_enqueue(struct bench_thread *t, struct bench_conn *c, uint64_t start) {
+  int path = t->next_path++ % bench_num_paths;
+  if (c->write_offset > 0) {
+    memmove(c->write_buffer, c->write_buffer + c->write_offset,
+        c->write_length - c->write_offset);
+    c->write_length -= c->write_offset;
+    c->write_offset = 0;
+  }
+  memcpy(c->write_buffer + c->write_length, bench_requests[path],
+      bench_request_lengths[path]);
+  c->write_length += bench_request_lengths[path];
+  c->in_flight[(c->in_flight_head + c->in_flight_count) % BENCH_MAX_PIPELINE] = start;
+  c->in_flight_count++;
+}
+
+/* Hands queued or new requests to every connection that has room for them. */
+static void dispatch(struct bench_thread *t, uint64_t now) {
+  int open_loop = bench_rate > 0;
+  for (int i = 0; i < t->num_conns; i++) {
+    struct bench_conn *c = &t->conns[i];
+    if (c->fd < 0) {
+      if (now >= t->stop) continue;
+      if (!open_loop || t->backlog_count > 0) conn_open(t, c);
+      continue;
+    }
+    int queued = 0;
+    while (conn_capacity(c) > 0) {
+      if (t->backlog_count > 0) {
+        conn_enqueue(t, c, backlog_pop(t));
+      } else if (!open_loop && now < t->stop) {
+        conn_enqueue(t, c, now);
+      } else {
+        break;
+      }
+      queued = 1;
+    }
+    if (queued && c->connected && conn_flush(t, c) < 0) {
+      t->errors++;
+      conn_close(t, c);
+    }
+  }
+}
+
+static void record_response(struct bench_thread *t, struct bench_conn *c, uint64_t now) {
+  uint64_t start = c->in_flight[c->in_flight_head];
+  c->in_flight_head = (c->in_flight_head + 1) % BENCH_MAX_PIPELINE;
+  c->in_flight_count--;
+  if (start < t->record_after) return;
+  t->completed++;
+  if (c->status_code < 200 || c->status_code > 299) t->non_2xx++;
+  histogram_record_n(&t->latency, (now - start) / 1000, 1);
+}
+
+static char *find_crlf(char *data, size_t length) {
+  for (size_t i = 0; i + 1 < length; i++)
+    if (data[i] == '\r' && data[i + 1] == '\n') return data + i;
+  return NULL;
+}
+
+static char *find_header_end(char *data, size_t length) {
+  for (size_t i = 0; i + 3 < length; i++)
+    if (memcmp(data + i, "\r\n\r\n", 4) == 0) return data + i;
+  return NULL;
+}
+
+/*
+ * Parses the status line and headers in DATA..END. Returns -1 on a malformed
+ * response.
+ */
+static int parse_headers(struct bench_conn *c, char *data, char *end) {
+  if (end - data < 12 || strncmp(data, "HTTP/1.", 7) != 0) return -1;
+  int minor = data[7] - '0';
+  c->status_code = atoi(data + 9);
+  int keep_alive = minor >= 1;
+  c->body_mode = BODY_UNTIL_CLOSE;
+  if (c->status_code == 204 || c->status_code == 304 || c->status_code / 100 == 1)
+    c->body_mode = BODY_NONE;
+
+  char *line = find_crlf(data, end - data + 2) + 2;
+  while (line < end) {
+    char *line_end = find_crlf(line, end - line + 2);
+    char *colon = memchr(line, ':', line_end - line);
+    if (colon) {
+      char *value = colon + 1;
+      while (value < line_end && *value == ' ') value++;
+      size_t key_length = colon - line;
+      size_t value_length = line_end - value;
+      if (key_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        c->body_mode = BODY_LENGTH;
+        c->body_remaining = strtoull(value, NULL, 10);
+      } else if (key_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0 &&
+          value_length >= 7 && strncasecmp(line_end - 7, "chunked", 7) == 0) {
+        c->body_mode = BODY_CHUNKED;
+        c->body_remaining = 0;
+        c->chunk_trailer = 0;
+      } else if (key_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+        if (value_length >= 5 && strncasecmp(value, "close", 5) == 0)
+          keep_alive = 0;
+        else if (value_length >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+          keep_alive = 1;
+      }
+    }
+    line = line_end + 2;
+  }
+
+  if (!keep_alive) c->close_after_response = 1;
+  return 0;
+}
+
+/*
+ * Consumes as much of the read buffer as possible. Returns the number of
+ * bytes consumed, or -1 on a protocol error. Sets *done when the response at
+ * the head of the pipeline is complete.
+ */
+static ssize_t parse_response(struct bench_conn *c, int *done) {
+  char *data = c->read_buffer;
+  size_t length = c->read_length;
+  size_t consumed = 0;
+  *done = 0;
+
+  if (!c->headers_done) {
+    char *end = find_header_end(data, length);
+    if (!end) return length == sizeof(c->read_buffer) ? -1 : 0;
+    if (parse_headers(c, data, end) < 0) return -1;
+    c->headers_done = 1;
+    consumed = end + 4 - data;
+  }
+
+  switch (c->body_mode) {
+    case BODY_NONE:
+      *done = 1;
+      break;
+    case BODY_LENGTH: {
+      uint64_t available = length - consumed;
+      uint64_t take = available < c->body_remaining ? available : c->body_remaining;
+      consumed += take;
+      c->body_remaining -= take;
+      if (c->body_remaining == 0) *done = 1;
+      break;
+    }
+    case BODY_UNTIL_CLOSE:
+      consumed = length;
+      break;
+    case BODY_CHUNKED:
+      while (consumed < length) {
+        if (c->body_remaining > 0) {
+          uint64_t available = length - consumed;
+          uint64_t take = available < c->body_remaining ? available : c->body_remaining;
+          consumed += take;
+          c->body_remaining -= take;
+          continue;
+        }
+        char *line_end = find_crlf(data + consumed, length - consumed);
+        if (!line_end) break;
+        size_t line_length = line_end - (data + consumed);
+        if (c->chunk_trailer) {
+          consumed += line_length + 2;
+          if (line_length == 0) {
+            *done = 1;
+            break;
+          }
+          continue;
+        }
+        if (line_length == 0) {
+          /* CRLF terminating the previous chunk's data. */
+          consumed += 2;
+          continue;
+        }
+        uint64_t size = strtoull(data + consumed, NULL, 16);
+        consumed += line_length + 2;
+        if (size == 0)
+          c->chunk_trailer = 1;
+        else
+          c->body_remaining = size;
+      }
+      break;
+  }
+
+  if (*done) c->headers_done = 0;
+  return consumed;
+}
+
+static void conn_read(struct bench_thread *t, struct bench_conn *c) {
+  while (c->fd >= 0) {
+    ssize_t bytes = recv(c->fd, c->read_buffer + c->read_length,
+        sizeof(c->read_buffer) - c->read_length, 0);
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      t->errors++;
+      conn_close(t, c);
+      return;
+    }
+
+    uint64_t now = now_ns();
+    if (bytes == 0) {
+      if (c->in_flight_count > 0) {
+        if (c->headers_done && c->body_mode == BODY_UNTIL_CLOSE) {
+          c->headers_done = 0;
+          record_response(t, c, now);
+        } else {
+          /* The request at the head got no (complete) response. */
+          c->in_flight_head = (c->in_flight_head + 1) % BENCH_MAX_PIPELINE;
+          c->in_flight_count--;
+          c->headers_done = 0;
+          t->errors++;
+        }
+      }
+      conn_close(t, c);
+      return;
+    }
+
+    t->bytes_read += bytes;
+    c->read_length += bytes;
+    while (c->read_length > 0 && c->in_flight_count > 0) {
+      int done;
+      ssize_t consumed = parse_response(c, &done);
+      if (consumed < 0) {
+        t->errors++;
+        c->headers_done = 0;
+        conn_close(t, c);
+        return;
+      }
+      memmove(c->read_buffer, c->read_buffer + consumed, c->read_length - consumed);
+      c->read_length -= consumed;
+      if (!done) break;
+      record_response(t, c, now);
+      if (c->close_after_response) {
+        conn_close(t, c);
+        return;
+      }
+    }
+  }
+}
+
+static void *bench_thread_run(void *arg) {
+  struct bench_thread *t = arg;
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  uint64_t drain_deadline = t->stop + 2000000000ULL;
+
+  t->epoll_fd = epoll_create1(0);
+  if (t->epoll_fd < 0) {
+    perror("Failed to create epoll instance");
+    exit(errno);
+  }
+  for (int i = 0; i < t->num_conns; i++)
+    t->conns[i].fd = -1;
+
+  while (!bench_interrupted) {
+    uint64_t now = now_ns();
+
+    if (bench_rate > 0) {
+      while (now < t->stop) {
+        uint64_t next = t->start + (uint64_t) (t->scheduled * t->interval_ns);
+        if (next > now) break;
+        backlog_push(t, next, 0);
+        t->scheduled++;
+      }
+    }
+    dispatch(t, now);
+
+    int busy = 0;
+    for (int i = 0; i < t->num_conns; i++)
+      if (t->conns[i].fd >= 0 && t->conns[i].in_flight_count > 0) busy = 1;
+    if (now >= t->stop && (!busy || now >= drain_deadline)) break;
+
+    int timeout = 100;
+    if (bench_rate > 0 && now < t->stop) {
+      uint64_t next = t->start + (uint64_t) (t->scheduled * t->interval_ns);
+      timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+    }
+
+    int n = epoll_wait(t->epoll_fd, events, BENCH_MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      struct bench_conn *c = events[i].data.ptr;
+      if (c->fd < 0) continue;
+      if (!c->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+          t->errors++;
+          conn_close(t, c);
+          continue;
+        }
+        c->connected = 1;
+      }
+      if (events[i].events & EPOLLOUT) {
+        if (conn_flush(t, c) < 0) {
+          t->errors++;
+          conn_close(t, c);
+          continue;
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        conn_read(t, c);
+    }
+  }
+
+  for (int i = 0; i < t->num_conns; i++) {
+    struct bench_conn *c = &t->conns[i];
+    if (c->fd >= 0) {
+      t->errors += c->in_flight_count;
+      c->in_flight_count = 0;
+      conn_close(t, c);
+    }
+  }
+  close(t->epoll_fd);
+  return NULL;
+}
+
+static void print_percentiles(char *title, struct histogram *h) {
+  static const double percentiles[] = {50, 75, 90, 99, 99.9, 99.99};
+  printf("  %s\n", title);
+  for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+    printf("    p%-6g %10.3f ms\n", percentiles[i],
+        histogram_percentile(h, percentiles[i]) / 1000.0);
+  printf("    max     %10.3f ms\n", h->max / 1000.0);
+}
+
+static void build_requests() {
+  for (int i = 0; i < bench_num_paths; i++) {
+    char request[BENCH_REQUEST_MAX_SIZE];
+    int length = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: httpbench\r\n%s\r\n",
+        bench_paths[i], bench_host, bench_port,
+        bench_keep_alive ? "" : "Connection: close\r\n");
+    if (length < 0 || length >= (int) sizeof(request)) {
+      fprintf(stderr, "Request for %s is too long\n", bench_paths[i]);
+      exit(EXIT_FAILURE);
+    }
+    bench_requests[i] = strdup(request);
+    bench_request_lengths[i] = length;
+  }
+}
+
+void signal_callback_handler(int signum) {
+  bench_interrupted = 1;
+}
+
+char *USAGE =
+  "Usage: ./httpbench [--host 127.0.0.1] [--port 8000] [--path /]...\n"
+  "                   [--threads 2] [--connections 16] [--duration 10]\n"
+  "                   [--warmup 0] [--rate REQUESTS_PER_SECOND]\n"
+  "                   [--pipeline 1] [--no-keep-alive]\n"
+  "                   [--min-rps N] [--max-p99 MILLISECONDS]\n"
+  "\n"
+  "Without --rate the benchmark runs closed loop; with --rate it runs open\n"
+  "loop at a constant arrival rate. --min-rps and --max-p99 make the exit\n"
+  "status non-zero when the run misses either target.\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+static double parse_positive(char *option, char *value) {
+  char *end;
+  double number = value ? strtod(value, &end) : 0;
+  if (!value || *end != '\0' || number < 0) {
+    fprintf(stderr, "Expected non-negative number after %s\n", option);
+    exit_with_usage();
+  }
+  return number;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGINT, signal_callback_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp("--host", argv[i]) == 0 && i + 1 < argc) {
+      bench_host = argv[++i];
+    } else if (strcmp("--port", argv[i]) == 0 && i + 1 < argc) {
+      bench_port = argv[++i];
+    } else if (strcmp("--path", argv[i]) == 0 && i + 1 < argc) {
+      if (bench_num_paths == BENCH_MAX_PATHS) {
+        fprintf(stderr, "At most %d paths are supported\n", BENCH_MAX_PATHS);
+        exit_with_usage();
+      }
+      bench_paths[bench_num_paths++] = argv[++i];
+    } else if (strcmp("--threads", argv[i]) == 0) {
+      bench_num_threads = (int) parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--connections", argv[i]) == 0) {
+      bench_num_connections = (int) parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--duration", argv[i]) == 0) {
+      bench_duration = parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--warmup", argv[i]) == 0) {
+      bench_warmup = parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--rate", argv[i]) == 0) {
+      bench_rate = parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--pipeline", argv[i]) == 0) {
+      bench_pipeline = (int) parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--no-keep-alive", argv[i]) == 0) {
+      bench_keep_alive = 0;
+    } else if (strcmp("--min-rps", argv[i]) == 0) {
+      bench_min_rps = parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--max-p99", argv[i]) == 0) {
+      bench_max_p99_ms = parse_positive(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+
+  if (bench_num_paths == 0) bench_paths[bench_num_paths++] = "/";
+  if (bench_num_threads < 1) bench_num_threads = 1;
+  if (bench_num_connections < bench_num_threads) bench_num_connections = bench_num_threads;
+  if (bench_pipeline < 1) bench_pipeline = 1;
+  if (bench_pipeline > BENCH_MAX_PIPELINE) bench_pipeline = BENCH_MAX_PIPELINE;
+  if (!bench_keep_alive) bench_pipeline = 1;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int status = getaddrinfo(bench_host, bench_port, &hints, &bench_address);
+  if (status != 0) {
+    fprintf(stderr, "Failed to resolve %s:%s: %s\n", bench_host, bench_port,
+        gai_strerror(status));
+    exit(EXIT_FAILURE);
+  }
+
+  build_requests();
+
+  printf("Running %.1fs test @ http://%s:%s%s\n", bench_duration, bench_host,
+      bench_port, bench_paths[0]);
+  if (bench_rate > 0)
+    printf("  %d threads, %d connections, open loop at %.0f req/s",
+        bench_num_threads, bench_num_connections, bench_rate);
+  else
+    printf("  %d threads, %d connections, closed loop",
+        bench_num_threads, bench_num_connections);
+  printf(", pipeline %d, %s\n", bench_pipeline,
+      bench_keep_alive ? "keep-alive" : "connection per request");
+
+  struct bench_thread *threads = calloc(bench_num_threads, sizeof(struct bench_thread));
+  if (!threads) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOMEM);
+  }
+
+  uint64_t start = now_ns();
+  uint64_t record_after = start + (uint64_t) (bench_warmup * 1e9);
+  uint64_t stop = record_after + (uint64_t) (bench_duration * 1e9);
+
+  for (i = 0; i < bench_num_threads; i++) {
+    struct bench_thread *t = &threads[i];
+    t->id = i;
+    t->num_conns = bench_num_connections / bench_num_threads +
+        (i < bench_num_connections % bench_num_threads);
+    t->conns = calloc(t->num_conns, sizeof(struct bench_conn));
+    if (!t->conns) {
+      fprintf(stderr, "Malloc failed\n");
+      exit(ENOMEM);
+    }
+    t->next_path = i;
+    t->start = start;
+    t->record_after = record_after;
+    t->stop = stop;
+    if (bench_rate > 0)
+      t->interval_ns = 1e9 * bench_num_threads / bench_rate;
+    if (pthread_create(&t->thread, NULL, bench_thread_run, t) != 0) {
+      fprintf(stderr, "Failed to start thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  uint64_t completed = 0, errors = 0, non_2xx = 0, connects = 0, bytes_read = 0;
+  struct histogram *latency = calloc(1, sizeof(struct histogram));
+  struct histogram *corrected = calloc(1, sizeof(struct histogram));
+  for (i = 0; i < bench_num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    completed += threads[i].completed;
+    errors += threads[i].errors;
+    non_2xx += threads[i].non_2xx;
+    connects += threads[i].connects;
+    bytes_read += threads[i].bytes_read;
+    histogram_merge(latency, &threads[i].latency);
+    free(threads[i].conns);
+    free(threads[i].backlog);
+  }
+
+  double elapsed = (now_ns() - record_after) / 1e9;
+  if (elapsed > bench_duration) elapsed = bench_duration;
+  double rps = elapsed > 0 ? completed / elapsed : 0;
+
+  printf("  Requests:   %llu (%.1f/s), %llu errors, %llu non-2xx, %llu connects\n",
+      (unsigned long long) completed, rps, (unsigned long long) errors,
+      (unsigned long long) non_2xx, (unsigned long long) connects);
+  printf("  Transfer:   %.2f MB (%.2f MB/s)\n", bytes_read / 1e6,
+      elapsed > 0 ? bytes_read / 1e6 / elapsed : 0);
+
+  /*
+   * Open loop latencies are already measured from the intended send time.
+   * Closed loop latencies are back-filled using the mean as the interval at
+   * which an unblocked client would have kept sending.
+   */
+  if (bench_rate > 0) {
+    memcpy(corrected, latency, sizeof(*latency));
+  } else {
+    uint64_t mean = latency->total ? latency->sum / latency->total : 0;
+    histogram_correct(corrected, latency, mean);
+  }
+  print_percentiles("Latency (corrected for coordinated omission):", corrected);
+  if (bench_rate == 0)
+    print_percentiles("Latency (uncorrected):", latency);
+
+  int result = EXIT_SUCCESS;
+  if (bench_min_rps > 0 && rps < bench_min_rps) {
+    printf("FAIL: throughput %.1f/s is below --min-rps %.1f\n", rps, bench_min_rps);
+    result = EXIT_FAILURE;
+  }
+  double p99 = histogram_percentile(corrected, 99) / 1000.0;
+  if (bench_max_p99_ms > 0 && p99 > bench_max_p99_ms) {
+    printf("FAIL: p99 latency %.3f ms is above --max-p99 %.3f ms\n", p99, bench_max_p99_ms);
+    result = EXIT_FAILURE;
+  }
+  if (completed == 0) {
+    printf("FAIL: no requests completed\n");
+    result = EXIT_FAILURE;
+  }
+
+  free(latency);
+  free(corrected);
+  free(threads);
+  freeaddrinfo(bench_address);
+  return result;
+}
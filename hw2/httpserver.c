@@ -1,21 +1,43 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
-#include <unistd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "bufpool.h"
+#include "compress.h"
+#include "conn.h"
+#include "cpu.h"
+#include "deque.h"
+#include "files.h"
+#include "h2.h"
 #include "libhttp.h"
+#include "ratelimit.h"
+#include "router.h"
+#include "timer.h"
+#include "tls.h"
+#include "uring.h"
 #include "wq.h"
 
 /*
@@ -24,17 +46,189 @@
  * handle_proxy_request. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
-wq_t work_queue;
-int num_threads;
+int num_threads = 1;
 int server_port;
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+char *server_config_file;
+struct route_target server_proxy_target;
+int server_use_gzip;
+int server_allow_uploads;
+int server_use_io_uring;
+int server_use_tls;
+int server_max_connections;
+enum pin_mode { PIN_NONE, PIN_CPU, PIN_NODE } server_pin_mode;
+
+/*
+ * Server state set up at startup: the worker threads, the idle poller's
+ * epoll set and deadlines, and what a hot upgrade needs to re-exec the
+ * binary and hand over the listening socket.
+ */
+struct worker **workers;
+int idle_epoll_fd;
+struct timer_wheel idle_timers;
+pthread_mutex_t idle_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+char **server_argv;
+int server_fd = -1;
+int server_inherited_socket;
+
+/* Set by signal handlers, acted on by the main thread. */
+volatile sig_atomic_t server_stop_requested;
+volatile sig_atomic_t server_upgrade_requested;
+volatile sig_atomic_t server_stats_requested;
+
+/* Set once the server stops accepting; read by every thread. */
+int server_draining;
+
+/* Initial block size of the request arena each worker lends to connections. */
+#define CONNECTION_ARENA_BLOCK_SIZE (4 * 1024)
 
+/* Pipelined requests served back to back before a connection yields. */
+#define CONNECTION_MAX_REQUESTS_PER_TURN 16
+
+/* How long accept() waits for a new connection's first bytes. */
+#define CONNECTION_DEFER_ACCEPT_SECONDS 5
+
+#define IDLE_POLLER_MAX_EVENTS 256
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * A worker thread, its ready connections and where it runs.
+ *
+ * The accept loop and the idle poller queue connections in a worker's
+ * inbox. The worker serves the oldest one and moves the rest into its
+ * Chase-Lev deque, where it keeps taking the newest (cache-warm) ones while
+ * idle workers steal the oldest from random victims. Each worker allocates
+ * this struct itself, after pinning, so it lives in its node's memory.
+ */
+struct worker {
+  struct deque deque;
+  wq_t inbox;
+  int index;
+  unsigned random;              /* xorshift state for picking victims. */
+  cpu_set_t cpus;
+  int node;
+} __attribute__((aligned(64)));
+
+/*
+ * Idle workers sleep on idle_workers_cond. Queueing work bumps work_epoch
+ * and only takes the lock if someone is asleep; a worker re-checks the
+ * epoch under the lock before sleeping, so no wakeup is lost.
+ */
+pthread_mutex_t idle_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t idle_workers_cond = PTHREAD_COND_INITIALIZER;
+int idle_workers;
+unsigned long work_epoch;
+
+/*
+ * With --stages, requests flow through separate thread pools connected by
+ * queues instead of running to completion on one worker: the accept loop
+ * and idle poller feed the parse stage, which feeds handle, which feeds
+ * send, which hands keep-alive connections back to parse. SIGUSR1 prints
+ * each stage's queue depth, so the bottleneck stage is the one whose queue
+ * grows.
+ */
+enum stage_id { STAGE_PARSE, STAGE_HANDLE, STAGE_SEND, NUM_STAGES };
+
+struct stage {
+  char *name;
+  int num_threads;
+  wq_t queue;
+  unsigned long processed;
+  int max_depth;
+} __attribute__((aligned(64)));
+
+struct stage stages[NUM_STAGES] = { { "parse" }, { "handle" }, { "send" } };
+int server_use_stages;
+
+/* Responses the send stage takes off its queue at a time. */
+#define STAGE_SEND_BATCH 32
+
+void dispatch_connection(struct conn *conn);
+
+struct worker_placement {
+  cpu_set_t cpus;
+  int node;
+};
+
+/* How long in-flight connections get to finish after a stop is requested. */
+#define SERVER_DRAIN_TIMEOUT_SECONDS 30
+
+/* Most of an upload moved to disk per http_splice_body() call. */
+#define UPLOAD_SPLICE_SIZE (1024 * 1024)
+
+/* How long the proxy waits on its target before giving up on a request. */
+#define PROXY_TIMEOUT_MS 10000
+
+/* Names the inherited Unix socket the listening socket arrives on. */
+#define SERVER_UPGRADE_ENV "HTTPSERVER_UPGRADE_FD"
+
+
+/*
+ * Sends a complete response with a short HTML BODY. The Content-Length lets
+ * the connection stay open afterwards.
+ */
+void send_html_response(int fd, int status_code, char *body) {
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", strlen(body));
+  http_start_response(fd, status_code);
+  http_send_header(fd, "Content-Type", "text/html");
+  http_send_header(fd, "Content-Length", content_length);
+  http_end_headers(fd);
+  http_send_string(fd, body);
+}
+
+
+/*
+ * Stores the body of a PUT or POST (with --uploads) as the file at PATH
+ * under ROOT. The body is spliced into a temporary file beside the target,
+ * which replaces it only once complete, so readers never see part of an
+ * upload and memory use does not grow with its size.
+ */
+void serve_upload(int fd, struct http_request *request, char *root, char *request_path) {
+  char path[PATH_MAX], temporary[PATH_MAX + 16];
+  if (files_upload_path(root, request_path, path, sizeof(path)) < 0 ||
+      snprintf(temporary, sizeof(temporary), "%s.upload-XXXXXX", path) >=
+        (int) sizeof(temporary)) {
+    send_html_response(fd, 403, "<center><h1>403 Forbidden</h1></center>");
+    return;
+  }
+  int file_fd = mkostemp(temporary, O_CLOEXEC);
+  if (file_fd < 0) {
+    send_html_response(fd, 500, "");
+    return;
+  }
+  fchmod(file_fd, 0644);
+
+  /* Reserving the space up front turns a full disk away before any copying. */
+  int status_code = 0;
+  if (request->content_length > 0 &&
+      fallocate(file_fd, 0, 0, request->content_length) < 0 && errno == ENOSPC)
+    status_code = 507;
+
+  ssize_t moved = 0;
+  while (status_code == 0 &&
+      (moved = http_splice_body(request, file_fd, UPLOAD_SPLICE_SIZE)) > 0) {}
+  if (status_code == 0 && moved < 0)
+    status_code = errno == ENOSPC || errno == EDQUOT ? 507 : 400;
+  close(file_fd);
+
+  int created = access(path, F_OK) < 0;
+  if (status_code == 0 && rename(temporary, path) < 0)
+    status_code = 500;
+  if (status_code != 0) {
+    unlink(temporary);
+    send_html_response(fd, status_code, "");
+    return;
+  }
+  http_start_response(fd, created ? 201 : 204);
+  if (created) http_send_header(fd, "Content-Length", "0");
+  http_end_headers(fd);
+}
+
+/*
+ * Serves the parsed REQUEST read from stream (fd) from the files at PATH
+ * under ROOT by writing an HTTP response containing:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -42,61 +236,1133 @@ int server_proxy_port;
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * PUT and POST store the request body instead (see serve_upload).
  */
-void handle_files_request(int fd) {
+void serve_files(int fd, struct http_request *request, char *root, char *path) {
+  if (strcmp(request->method, "PUT") == 0 || strcmp(request->method, "POST") == 0) {
+    if (server_allow_uploads)
+      serve_upload(fd, request, root, path);
+    else
+      send_html_response(fd, 405, "<center><h1>405 Method Not Allowed</h1></center>");
+    return;
+  }
 
-  /*
-   * TODO: Your solution for Task 1 goes here! Feel free to delete/modify *
-   * any existing code.
-   */
+  struct files_entry entry;
+  switch (files_lookup(root, path, &entry)) {
+    case FILES_REGULAR: {
+      int compressible = server_use_gzip && compress_worthwhile(entry.mime_type, entry.size);
+      http_start_response(fd, 200);
+      http_send_header(fd, "Content-Type", entry.mime_type);
+      if (compressible) http_send_header(fd, "Vary", "Accept-Encoding");
+      if (compressible && compress_accepts_gzip(request)) {
+        http_send_header(fd, "Content-Encoding", "gzip");
+        http_start_chunked(fd);
+        http_end_headers(fd);
+        compress_send_file(fd, entry.fd, entry.size);
+      } else {
+        char content_length[32];
+        snprintf(content_length, sizeof(content_length), "%lld", (long long) entry.size);
+        http_send_header(fd, "Content-Length", content_length);
+        http_end_headers(fd);
+        http_send_file(fd, entry.fd, entry.size);
+      }
+      close(entry.fd);
+      break;
+    }
 
-  struct http_request *request = http_request_parse(fd);
+    case FILES_DIRECTORY:
+      /* Streamed as the directory is read, however many entries it has. */
+      http_start_response(fd, 200);
+      http_send_header(fd, "Content-Type", "text/html");
+      http_start_chunked(fd);
+      http_end_headers(fd);
+      files_send_listing(fd, &entry, request->path);
+      http_end_chunked(fd);
+      break;
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  http_send_string(fd,
-      "<center>"
-      "<h1>Welcome to httpserver!</h1>"
-      "<hr>"
-      "<p>Nothing's here yet.</p>"
-      "</center>");
+    default:
+      send_html_response(fd, 404, "<center><h1>404 Not Found</h1></center>");
+      break;
+  }
 }
 
+/* Serves the files under --files. */
+void handle_files_request(int fd, struct http_request *request) {
+  serve_files(fd, request, server_files_directory, request->path);
+}
+
+
+/* Returns 1 for headers that only describe one hop and are not relayed. */
+int is_hop_by_hop_header(char *key) {
+  static char *hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Transfer-Encoding", "Upgrade"
+  };
+  for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++)
+    if (strcasecmp(key, hop_by_hop[i]) == 0) return 1;
+  return 0;
+}
+
+/* Connects to TARGET with PROXY_TIMEOUT_MS on every step, or returns -1. */
+int connect_to_proxy_target(struct route_target *target) {
+  int target_fd = socket(target->address.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (target_fd < 0) return -1;
+  struct timeval timeout = { PROXY_TIMEOUT_MS / 1000, PROXY_TIMEOUT_MS % 1000 * 1000 };
+  int enable = 1;
+  setsockopt(target_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(target_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(target_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  if (connect(target_fd, (struct sockaddr *) &target->address, target->address_length) < 0) {
+    close(target_fd);
+    return -1;
+  }
+  return target_fd;
+}
+
+/* Sends all SIZE bytes of DATA to the proxy target. Returns -1 on failure. */
+int send_to_proxy_target(int target_fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes_sent = send(target_fd, data, size, MSG_NOSIGNAL);
+    if (bytes_sent < 0 && errno == EINTR) continue;
+    if (bytes_sent <= 0) return -1;
+    data += bytes_sent;
+    size -= bytes_sent;
+  }
+  return 0;
+}
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
+ * Forwards REQUEST, body included, to the proxy target with Connection:
+ * close, so the target always ends its response by closing. It goes as
+ * HTTP/1.0, which keeps the target from answering in chunks, unless the
+ * body itself is chunked. Returns -1 if the request could not be sent.
+ */
+int send_proxy_request(int target_fd, struct http_request *request) {
+  char head[LIBHTTP_REQUEST_MAX_SIZE + 64];
+  size_t length = snprintf(head, sizeof(head), "%s %s HTTP/1.%d\r\n",
+      request->method, request->path, request->chunked);
+  for (int i = 0; i < request->num_headers && length < sizeof(head); i++) {
+    struct http_header *header = &request->headers[i];
+    /* The client's 100 Continue comes from us as the body is read. */
+    if (is_hop_by_hop_header(header->key) || strcasecmp(header->key, "Expect") == 0)
+      continue;
+    length += snprintf(head + length, sizeof(head) - length, "%s: %s\r\n",
+        header->key, header->value);
+  }
+  if (length < sizeof(head))
+    length += snprintf(head + length, sizeof(head) - length, "%sConnection: close\r\n\r\n",
+        request->chunked ? "Transfer-Encoding: chunked\r\n" : "");
+  if (length >= sizeof(head) || send_to_proxy_target(target_fd, head, length) < 0)
+    return -1;
+
+  char piece[LIBHTTP_FILE_CHUNK_SIZE];
+  ssize_t piece_length;
+  while ((piece_length = http_read_body(request, piece, sizeof(piece))) > 0) {
+    char chunk_size[32];
+    int chunk_size_length = snprintf(chunk_size, sizeof(chunk_size), "%zx\r\n", piece_length);
+    if ((request->chunked && send_to_proxy_target(target_fd, chunk_size, chunk_size_length) < 0) ||
+        send_to_proxy_target(target_fd, piece, piece_length) < 0 ||
+        (request->chunked && send_to_proxy_target(target_fd, "\r\n", 2) < 0))
+      return -1;
+  }
+  if (piece_length < 0) return -1;
+  if (request->chunked && send_to_proxy_target(target_fd, "0\r\n\r\n", 5) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Relays the body of the target's response, the first BUFFERED bytes of
+ * which arrived with its head in DATA. LIMIT is the body's Content-Length,
+ * or -1 to relay until the target closes; CHUNKED sends it with
+ * http_send_chunk(). Each piece is flushed as soon as it arrives, so a slow
+ * target's response streams through. Returns -1 if the body was cut short.
+ */
+int relay_proxy_body(int fd, int target_fd, char *data, size_t buffered, off_t limit,
+    int chunked) {
+  char piece[LIBHTTP_FILE_CHUNK_SIZE];
+  off_t relayed = 0;
+  ssize_t length = buffered;
+  while (limit < 0 || relayed < limit) {
+    if (length == 0) {
+      size_t wanted = sizeof(piece);
+      if (limit >= 0 && limit - relayed < (off_t) wanted) wanted = limit - relayed;
+      length = recv(target_fd, piece, wanted, 0);
+      if (length < 0 && errno == EINTR) {
+        length = 0;
+        continue;
+      }
+      if (length < 0) return -1;
+      if (length == 0) return limit < 0 ? 0 : -1;
+      data = piece;
+    }
+    if (limit >= 0 && length > limit - relayed) length = limit - relayed;
+    if (chunked)
+      http_send_chunk(fd, data, length);
+    else
+      http_send_data(fd, data, length);
+    if (http_flush(fd) < 0) return -1;
+    relayed += length;
+    length = 0;
+  }
+  return 0;
+}
+
+/*
+ * Opens a connection to the proxy TARGET and relays traffic to/from the
+ * stream fd and the proxy target. HTTP requests from the client (fd) should be sent to the
  * proxy target, and HTTP responses from the proxy target should be sent to
  * the client (fd).
  *
  *   +--------+     +------------+     +--------------+
  *   | client | <-> | httpserver | <-> | proxy target |
  *   +--------+     +------------+     +--------------+
+ *
+ * Each request gets its own connection to the target. The client's
+ * connection outlives it: a response the target delimited by closing is
+ * passed on with chunked transfer-coding instead, so keep-alive survives.
+ */
+void serve_proxy(int fd, struct http_request *request, struct route_target *target) {
+  int target_fd = connect_to_proxy_target(target);
+  if (target_fd < 0 || send_proxy_request(target_fd, request) < 0) {
+    if (target_fd >= 0) close(target_fd);
+    send_html_response(fd, 502, "<center><h1>502 Bad Gateway</h1></center>");
+    return;
+  }
+
+  /* Read the response head. */
+  char head[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t head_read = 0;
+  struct arena arena;
+  arena_init(&arena, 4096);
+  struct http_response *response = NULL;
+  int head_length;
+  while (1) {
+    head_length = http_response_parse_buffer(head, head_read, &arena, &response);
+    /* Interim responses are skipped; we sent our own 100 Continue. */
+    if (head_length > 0 && response->status_code / 100 == 1) {
+      memmove(head, head + head_length, head_read - head_length);
+      head_read -= head_length;
+      continue;
+    }
+    if (head_length != 0) break;
+    ssize_t bytes_read = recv(target_fd, head + head_read, sizeof(head) - head_read, 0);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      head_length = bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? -2 : -1;
+      break;
+    }
+    head_read += bytes_read;
+  }
+  if (head_length < 0) {
+    if (head_length == -2)
+      send_html_response(fd, 504, "<center><h1>504 Gateway Timeout</h1></center>");
+    else
+      send_html_response(fd, 502, "<center><h1>502 Bad Gateway</h1></center>");
+    arena_destroy(&arena);
+    close(target_fd);
+    return;
+  }
+
+  char *content_length = http_find_header(response->headers, response->num_headers,
+      "Content-Length");
+  char *transfer_encoding = http_find_header(response->headers, response->num_headers,
+      "Transfer-Encoding");
+  int status_code = response->status_code;
+  int has_body = strcmp(request->method, "HEAD") != 0 && status_code / 100 != 1 &&
+      status_code != 204 && status_code != 304;
+
+  http_start_response(fd, status_code);
+  for (int i = 0; i < response->num_headers; i++) {
+    struct http_header *header = &response->headers[i];
+    /* A chunked body from the target is relayed as it is. */
+    if (is_hop_by_hop_header(header->key) &&
+        !(transfer_encoding && strcasecmp(header->key, "Transfer-Encoding") == 0))
+      continue;
+    http_send_header(fd, header->key, header->value);
+  }
+
+  off_t limit = -1;
+  int chunked = 0;
+  if (!has_body) {
+    limit = 0;
+  } else if (content_length && !transfer_encoding) {
+    limit = atoll(content_length);
+  } else if (!transfer_encoding) {
+    http_start_chunked(fd);
+    chunked = 1;
+  }
+  http_end_headers(fd);
+
+  if (relay_proxy_body(fd, target_fd, head + head_length, head_read - head_length,
+        limit, chunked) < 0)
+    http_abort_response(fd);
+  else if (chunked)
+    http_end_chunked(fd);
+
+  arena_destroy(&arena);
+  close(target_fd);
+}
+
+/* Relays to the --proxy target. */
+void handle_proxy_request(int fd, struct http_request *request) {
+  serve_proxy(fd, request, &server_proxy_target);
+}
+
+
+/* Answers a stats route with the server's load, one "name value" per line. */
+void send_server_stats(int fd) {
+  char body[512];
+  int length = snprintf(body, sizeof(body),
+      "connections_open %d\nthreads %d\ndraining %d\n",
+      conn_open_count(), num_threads, (int) __atomic_load_n(&server_draining, __ATOMIC_RELAXED));
+  for (int i = 0; server_use_stages && i < NUM_STAGES; i++)
+    length += snprintf(body + length, sizeof(body) - length, "stage_%s_depth %d\n",
+        stages[i].name, __atomic_load_n(&stages[i].queue.size, __ATOMIC_RELAXED));
+
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%d", length);
+  http_start_response(fd, 200);
+  http_send_header(fd, "Content-Type", "text/plain");
+  http_send_header(fd, "Cache-Control", "no-store");
+  http_send_header(fd, "Content-Length", content_length);
+  http_end_headers(fd);
+  http_send_data(fd, body, length);
+}
+
+/*
+ * Dispatches REQUEST through the routes from --config. A redirect keeps the
+ * part of the path below its prefix: "/old/ redirect /new/" sends /old/a to
+ * /new/a.
  */
-void handle_proxy_request(int fd) {
+void handle_routed_request(int fd, struct http_request *request) {
+  struct route *route = router_match(request);
+  if (!route) {
+    send_html_response(fd, 404, "<center><h1>404 Not Found</h1></center>");
+    return;
+  }
+
+  switch (route->kind) {
+    case ROUTE_FILES:
+      serve_files(fd, request, route->root, router_local_path(route, request->path));
+      break;
+
+    case ROUTE_PROXY:
+      serve_proxy(fd, request, &route->target);
+      break;
+
+    case ROUTE_HEALTH:
+      http_start_response(fd, 200);
+      http_send_header(fd, "Content-Type", "text/plain");
+      http_send_header(fd, "Cache-Control", "no-store");
+      http_send_header(fd, "Content-Length", "3");
+      http_end_headers(fd);
+      http_send_string(fd, "ok\n");
+      break;
+
+    case ROUTE_STATS:
+      send_server_stats(fd);
+      break;
+
+    case ROUTE_REDIRECT: {
+      char location[LIBHTTP_REQUEST_MAX_SIZE + 1024];
+      char *rest = router_local_path(route, request->path);
+      size_t length = strlen(route->location);
+      if (length > 0 && route->location[length - 1] == '/') rest++;
+      snprintf(location, sizeof(location), "%s%s", route->location, rest);
+      http_start_response(fd, 301);
+      http_send_header(fd, "Location", location);
+      http_send_header(fd, "Content-Length", "0");
+      http_end_headers(fd);
+      break;
+    }
+  }
+}
+
+
+/*
+ * Turns a client away with STATUS_CODE (429 or 503) without reading its
+ * request. Never blocks: a client that is not reading just misses the
+ * response. TLS clients get the response through TLS (a record is small
+ * enough not to block on a live socket) once their session is up; before
+ * that there is no way to answer them, so they are only disconnected. The
+ * caller closes the connection.
+ */
+void send_rejection(int fd, struct tls *tls, int status_code) {
+  char response[128];
+  int length = snprintf(response, sizeof(response),
+      "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n",
+      status_code, http_get_response_message(status_code));
+  if (tls && !tls_kernel_send(tls))
+    tls_write(tls, response, length);
+  else if (tls || !server_use_tls)
+    send(fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  /* Unread request bytes would turn the close into a reset. */
+  shutdown(fd, SHUT_WR);
+}
+
+/*
+ * Returns when CONN should be reaped if no more bytes arrive: a request head
+ * must be complete CONNECTION_REQUEST_TIMEOUT_MS after its first byte (or
+ * after accept, for a connection that has sent nothing yet), and a
+ * connection between requests may idle for CONNECTION_IDLE_TIMEOUT_MS.
+ */
+uint64_t connection_deadline(struct conn *conn) {
+  if (conn->read_length > 0)
+    return conn->request_started + CONNECTION_REQUEST_TIMEOUT_MS;
+  if (conn->requests_served == 0)
+    return conn->accepted_at + CONNECTION_REQUEST_TIMEOUT_MS;
+  return conn->last_active + CONNECTION_IDLE_TIMEOUT_MS;
+}
+
+/*
+ * Hands CONN to the idle poller until its next request arrives or its
+ * deadline passes. Buffers are returned first unless they hold part of a
+ * request, so a parked connection costs no I/O memory. CONN must not be
+ * touched afterwards: the poller may already have queued or reaped it.
+ */
+void park_connection(struct conn *conn) {
+  uint64_t deadline = connection_deadline(conn);
+  if (deadline <= conn_now()) {
+    conn_close(conn);
+    return;
+  }
+
+  conn_release_buffers(conn);
+
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = conn;
+  int operation = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  conn->registered = 1;
 
   /*
-   * TODO: Your solution for Task 3 goes here! Feel free to delete/modify *
-   * any existing code.
+   * The timer is armed before the poller can see CONN and under its lock.
+   * Checking server_draining under the same lock means a connection is
+   * either parked before the poller's drain sweep or closed here.
    */
+  pthread_mutex_lock(&idle_timers_lock);
+  if (server_draining && conn->read_length == 0) {
+    pthread_mutex_unlock(&idle_timers_lock);
+    conn_close(conn);
+    return;
+  }
+  timer_add(&idle_timers, &conn->timer, deadline);
+  int result = epoll_ctl(idle_epoll_fd, operation, conn->fd, &event);
+  if (result < 0) timer_cancel(&idle_timers, &conn->timer);
+  pthread_mutex_unlock(&idle_timers_lock);
 
+  if (result < 0) {
+    perror("Failed to park connection");
+    conn_close(conn);
+  }
 }
 
+/*
+ * Request processing is split into three steps, which either run back to
+ * back on one worker or as separate pipeline stages (--stages):
+ *
+ *   read_request()    reads and parses the next request into an arena
+ *   handle_request()  runs the handler, buffering the response in CONN
+ *   send_response()   writes the buffered response and any held file
+ */
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Reads from CONN until a full request head is buffered and parses it into
+ * ARENA. Returns 1 with conn->request set (NULL if it is malformed), or 0
+ * if CONN was parked waiting for bytes, rejected or closed.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+int read_request(struct conn *conn, struct arena *arena) {
+  while (1) {
+    if (conn->read_length > 0) {
+      /* The first request's token was taken when the connection was accepted. */
+      if (conn->requests_served > 0 &&
+          !ratelimit_take(conn->address.sin_addr.s_addr, conn->last_active)) {
+        send_rejection(conn->fd, conn->tls, 429);
+        conn_close(conn);
+        return 0;
+      }
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+      struct http_request *request;
+      int consumed = http_request_parse_buffer(conn->read_buffer, conn->read_length,
+          arena, &request);
+      if (consumed != 0) {
+        /* The parsed request lives in ARENA, so its bytes can go. */
+        conn->request = consumed > 0 ? request : NULL;
+        conn_consume(conn, consumed > 0 ? consumed : conn->read_length);
+        return 1;
+      }
+    }
+
+    ssize_t bytes_read = conn_read(conn);
+    if (bytes_read > 0) continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      park_connection(conn);
+    else
+      conn_close(conn);
+    return 0;
+  }
+}
+
+/* Reads more of a request body into CONN's read buffer for libhttp. */
+ssize_t read_request_body(void *conn) {
+  return conn_read(conn);
+}
+
+/*
+ * Runs REQUEST_HANDLER for conn->request with the response buffered in
+ * CONN's output, a 400 if the request was malformed. The response is left
+ * for send_response().
+ */
+void handle_request(struct conn *conn,
+    void (*request_handler)(int, struct http_request *)) {
+  if (!conn->output.buffer) {
+    conn->output.buffer = bufpool_get();
+    conn->output.capacity = conn->output.buffer ? BUFPOOL_CHUNK_SIZE : 0;
+  }
+  http_output_attach(conn->fd, &conn->output, conn->request);
+  /* With kernel TLS the socket encrypts, so sendfile() still works. */
+  conn->output.write = conn->tls && !tls_kernel_send(conn->tls) ? tls_write : NULL;
+  conn->output.write_context = conn->tls;
+  if (__atomic_load_n(&server_draining, __ATOMIC_RELAXED) || !conn->request)
+    conn->output.keep_alive = 0;
+  if (conn->request) {
+    /* The body follows the head in the read buffer; the handler streams it. */
+    struct http_body body;
+    size_t consumed;
+    http_body_init(&body, conn->request, conn->fd, conn->read_buffer, &conn->read_length,
+        BUFPOOL_CHUNK_SIZE, read_request_body, conn, !conn->tls);
+    request_handler(conn->fd, conn->request);
+    if (http_body_finish(&body, &consumed) < 0) conn->output.keep_alive = 0;
+    conn_consume(conn, consumed);
+    conn->request->body = NULL;
+  } else {
+    send_html_response(conn->fd, 400, "<center><h1>400 Bad Request</h1></center>");
+  }
+  http_output_unbind(conn->fd);
+  conn->request = NULL;
+  conn->requests_served++;
+}
+
+/*
+ * Writes CONN's pending response. Returns 1 if the connection can carry
+ * another request; otherwise closes it and returns 0.
+ */
+int send_response(struct conn *conn) {
+  if (http_output_send(conn->fd, &conn->output) < 0 || !conn->output.keep_alive) {
+    conn_close(conn);
+    return 0;
+  }
+  return 1;
+}
+
+/* Answers an HTTP/2 stream that is over the client's rate limit. */
+void send_too_many_requests(int fd, struct http_request *request) {
+  http_start_response(fd, 429);
+  http_send_header(fd, "Retry-After", "1");
+  http_send_header(fd, "Content-Length", "0");
+  http_end_headers(fd);
+}
+
+/*
+ * Checks whether CONN, which has not been served yet, opens with the
+ * HTTP/2 preface, and starts its session if so. Reads only while the bytes
+ * so far could still be the preface. Returns 0 if CONN is ready to serve
+ * (conn->h2 says how), or -1 if it was parked or closed.
+ */
+int detect_http2(struct conn *conn) {
+  while (1) {
+    int preface = h2_match_preface(conn->read_buffer, conn->read_length);
+    if (preface < 0) return 0;
+    if (preface > 0) {
+      conn_consume(conn, H2_PREFACE_LENGTH);
+      int kernel_tls = conn->tls && tls_kernel_send(conn->tls);
+      conn->h2 = h2_session_new(conn->fd, conn->tls && !kernel_tls ? tls_write : NULL,
+          conn->tls);
+      if (conn->h2) return 0;
+      conn_close(conn);
+      return -1;
+    }
+
+    ssize_t bytes_read = conn_read(conn);
+    if (bytes_read > 0) continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      park_connection(conn);
+    else
+      conn_close(conn);
+    return -1;
+  }
+}
+
+/*
+ * Serves an HTTP/2 connection: feeds what arrives to its session, runs
+ * REQUEST_HANDLER for each stream whose request is complete and writes what
+ * flow control allows. Streams are handled one after another on this
+ * thread; they are multiplexed in how their responses share the wire. Every
+ * stream spends a rate limit token like a request would. Returns once the
+ * connection is parked, requeued or closed.
+ */
+void serve_http2_connection(struct conn *conn,
+    void (*request_handler)(int, struct http_request *)) {
+  struct h2_session *session = conn->h2;
+  int handled = 0;
+
+  while (1) {
+    if (__atomic_load_n(&server_draining, __ATOMIC_RELAXED))
+      h2_session_shutdown(session);
+    if (conn->read_length > 0) {
+      int result = h2_session_receive(session, conn->read_buffer, conn->read_length);
+      conn_consume(conn, conn->read_length);
+      if (result < 0) {
+        h2_session_send(session);
+        conn_close(conn);
+        return;
+      }
+    }
+
+    struct h2_stream *stream;
+    while ((stream = h2_session_next_request(session)) != NULL) {
+      /* The first request's token was taken when the connection was accepted. */
+      if (conn->requests_served++ > 0 &&
+          !ratelimit_take(conn->address.sin_addr.s_addr, conn->last_active))
+        h2_stream_handle(stream, send_too_many_requests);
+      else
+        h2_stream_handle(stream, request_handler);
+      handled++;
+    }
+
+    if (h2_session_send(session) < 0 || h2_session_done(session)) {
+      conn_close(conn);
+      return;
+    }
+    if (handled >= CONNECTION_MAX_REQUESTS_PER_TURN) {
+      dispatch_connection(conn);
+      return;
+    }
+
+    ssize_t bytes_read = conn_read(conn);
+    if (bytes_read > 0) continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      park_connection(conn);
+    else
+      conn_close(conn);
+    return;
+  }
+}
+
+/*
+ * Serves every request CONN has ready, running all three steps on this
+ * worker. Requests are parsed into ARENA, which is rewound with one O(1)
+ * arena_reset() before the next keep-alive request; it belongs to the
+ * connection only while this worker is serving it. Returns once the
+ * connection is closed, parked waiting for more bytes or requeued.
+ */
+void serve_connection(struct conn *conn, struct arena *arena,
+    void (*request_handler)(int, struct http_request *)) {
+  int served = 0;
+
+  if (!conn->h2 && conn->requests_served == 0 && detect_http2(conn) < 0) return;
+  if (conn->h2) {
+    serve_http2_connection(conn, request_handler);
+    return;
+  }
+
+  while (read_request(conn, arena)) {
+    handle_request(conn, request_handler);
+    arena_reset(arena);
+    if (!send_response(conn)) return;
+
+    /* Let other connections have this worker once in a while. Requests
+     * already buffered would never wake the poller, so requeue instead. */
+    if (++served == CONNECTION_MAX_REQUESTS_PER_TURN) {
+      dispatch_connection(conn);
+      return;
+    }
+  }
+}
+
+/*
+ * Places the calling worker according to PLACEMENT, then allocates its
+ * struct worker, deque and inbox locally and publishes it as workers[INDEX].
+ */
+struct worker *start_worker(int index, struct worker_placement *placement) {
+  if (server_pin_mode != PIN_NONE) {
+    if (cpu_pin_self(&placement->cpus) != 0)
+      fprintf(stderr, "Failed to pin worker %d, leaving it unpinned\n", index);
+    bufpool_set_node(placement->node);
+  }
+
+  struct worker *worker;
+  if (posix_memalign((void **) &worker, 64, sizeof(struct worker)) != 0 ||
+      deque_init(&worker->deque) < 0) {
+    perror("Failed to allocate worker");
+    exit(ENOMEM);
+  }
+  wq_init(&worker->inbox);
+  worker->index = index;
+  worker->random = index * 2654435761u + 1;
+  worker->cpus = placement->cpus;
+  worker->node = placement->node;
+  __atomic_store_n(&workers[index], worker, __ATOMIC_RELEASE);
+  return worker;
+}
+
+/* Wakes one sleeping worker, if any, to look for work. */
+void wake_idle_worker() {
+  __atomic_add_fetch(&work_epoch, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idle_workers_lock);
+    pthread_cond_signal(&idle_workers_cond);
+    pthread_mutex_unlock(&idle_workers_lock);
+  }
+}
+
+void stage_push(enum stage_id id, struct conn *conn);
+
+/*
+ * Queues CONN in the inbox of the worker that last served it (or was steered
+ * to), or for the parse stage when running as a pipeline.
+ */
+void dispatch_connection(struct conn *conn) {
+  if (server_use_stages) {
+    stage_push(STAGE_PARSE, conn);
+    return;
+  }
+  wq_push(&workers[conn->worker]->inbox, &conn->queue_item);
+  wake_idle_worker();
+}
+
+static unsigned next_random(unsigned *state) {
+  unsigned x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/*
+ * Returns the next connection for WORKER to serve: its newest deque entry,
+ * else the oldest connection in its inbox (moving the rest to the deque so
+ * they can be stolen), else one stolen from another worker's deque or
+ * inbox. Victims are tried once each from a random starting point: the
+ * worker woken for a connection queued elsewhere must not miss it, or it
+ * would go back to sleep while the connection waits. Returns NULL if
+ * nothing was found.
+ */
+struct conn *find_work(struct worker *worker) {
+  struct conn *conn = deque_pop(&worker->deque);
+  if (conn) return conn;
+
+  conn = (struct conn *) wq_try_pop(&worker->inbox);
+  if (conn) {
+    wq_item_t *item;
+    int moved = 0;
+    while ((item = wq_try_pop(&worker->inbox)) != NULL) {
+      if (deque_push(&worker->deque, item) < 0) {
+        wq_push(&worker->inbox, item);
+        break;
+      }
+      moved++;
+    }
+    if (moved) wake_idle_worker();
+    return conn;
+  }
+
+  unsigned start = next_random(&worker->random);
+  for (int attempt = 0; num_threads > 1 && attempt < num_threads; attempt++) {
+    struct worker *victim = __atomic_load_n(&workers[(start + attempt) % num_threads],
+        __ATOMIC_ACQUIRE);
+    if (!victim || victim == worker) continue;  /* Victims may still be starting. */
+    conn = deque_steal(&victim->deque);
+    if (!conn) conn = (struct conn *) wq_try_pop(&victim->inbox);
+    if (conn) return conn;
+  }
+  return NULL;
+}
+
+struct worker_start {
+  int index;
+  struct worker_placement placement;
+  void (*request_handler)(int, struct http_request *);
+};
+
+/*
+ * Worker thread body: serves connections forever, sleeping only when its
+ * own queues are empty and there is nothing to steal. Each worker keeps one
+ * arena and lends it to whichever connection it is serving, so steady state
+ * request handling never touches the shared malloc heap.
+ */
+void *handle_clients(void *void_start) {
+  struct worker_start *start = void_start;
+  void (*request_handler)(int, struct http_request *) = start->request_handler;
+  struct worker *worker = start_worker(start->index, &start->placement);
+  free(start);
 
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  struct arena arena;
+  arena_init(&arena, CONNECTION_ARENA_BLOCK_SIZE);
+
+  while (1) {
+    unsigned long epoch = __atomic_load_n(&work_epoch, __ATOMIC_SEQ_CST);
+    struct conn *conn = find_work(worker);
+    if (conn) {
+      conn->worker = worker->index;
+      serve_connection(conn, &arena, request_handler);
+      continue;
+    }
+
+    pthread_mutex_lock(&idle_workers_lock);
+    __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&work_epoch, __ATOMIC_SEQ_CST) == epoch)
+      pthread_cond_wait(&idle_workers_cond, &idle_workers_lock);
+    __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_workers_lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * Picks the worker for a connection just accepted on FD. Pinned workers get
+ * the connections whose packets their CPU processed (SO_INCOMING_CPU), else
+ * one on the same node does, else the next in turn. Unpinned, the less
+ * loaded of two random workers gets it.
+ */
+int steer_connection(int fd) {
+  static unsigned next_worker, random_state = 1;
+  if (server_pin_mode == PIN_NONE) {
+    struct worker *first = workers[next_random(&random_state) % num_threads];
+    struct worker *second = workers[next_random(&random_state) % num_threads];
+    long first_load = deque_size(&first->deque) + __atomic_load_n(&first->inbox.size, __ATOMIC_RELAXED);
+    long second_load = deque_size(&second->deque) + __atomic_load_n(&second->inbox.size, __ATOMIC_RELAXED);
+    return first_load <= second_load ? first->index : second->index;
+  }
+
+  int cpu;
+  socklen_t length = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == 0 &&
+      cpu >= 0 && cpu < CPU_SETSIZE) {
+    int node = cpu_node(cpu), same_node = -1;
+    for (int i = 0; i < num_threads; i++) {
+      int candidate = (next_worker + i) % num_threads;
+      if (CPU_ISSET(cpu, &workers[candidate]->cpus)) {
+        next_worker = candidate + 1;
+        return candidate;
+      }
+      if (same_node < 0 && workers[candidate]->node == node) same_node = candidate;
+    }
+    if (same_node >= 0) {
+      next_worker = same_node + 1;
+      return same_node;
+    }
+  }
+  return next_worker++ % num_threads;
+}
+
+void stage_push(enum stage_id id, struct conn *conn) {
+  struct stage *stage = &stages[id];
+  wq_push(&stage->queue, &conn->queue_item);
+  int depth = __atomic_load_n(&stage->queue.size, __ATOMIC_RELAXED);
+  if (depth > __atomic_load_n(&stage->max_depth, __ATOMIC_RELAXED))
+    __atomic_store_n(&stage->max_depth, depth, __ATOMIC_RELAXED);
+}
+
+static void stage_done(enum stage_id id, int count) {
+  __atomic_add_fetch(&stages[id].processed, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Arenas carry a parsed request from the parse stage to the handle stage,
+ * so they come from a shared free list rather than belonging to a thread.
+ */
+struct pooled_arena {
+  struct arena arena;           /* Must be first. */
+  struct pooled_arena *next;
+};
+
+struct pooled_arena *free_arenas;
+pthread_mutex_t free_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct arena *stage_arena_get() {
+  pthread_mutex_lock(&free_arenas_lock);
+  struct pooled_arena *pooled = free_arenas;
+  if (pooled) free_arenas = pooled->next;
+  pthread_mutex_unlock(&free_arenas_lock);
+
+  if (!pooled) {
+    pooled = malloc(sizeof(struct pooled_arena));
+    if (!pooled) {
+      perror("Failed to allocate arena");
+      exit(ENOMEM);
+    }
+    arena_init(&pooled->arena, CONNECTION_ARENA_BLOCK_SIZE);
+  }
+  return &pooled->arena;
+}
+
+void stage_arena_put(struct arena *arena) {
+  struct pooled_arena *pooled = (struct pooled_arena *) arena;
+  arena_reset(arena);
+  pthread_mutex_lock(&free_arenas_lock);
+  pooled->next = free_arenas;
+  free_arenas = pooled;
+  pthread_mutex_unlock(&free_arenas_lock);
+}
+
+/* Parse stage thread body: reads and parses the next request of each connection. */
+void *run_parse_stage(void *unused) {
+  struct arena *arena = NULL;
+  while (1) {
+    struct conn *conn = (struct conn *) wq_pop(&stages[STAGE_PARSE].queue);
+    if (!arena) arena = stage_arena_get();
+    if (!conn->h2 && conn->requests_served == 0 && detect_http2(conn) < 0) {
+      /* Parked or closed. */
+    } else if (conn->h2) {
+      /* A multiplexed connection has no single request to pass along, so
+       * the handle stage serves it whole. */
+      stage_push(STAGE_HANDLE, conn);
+    } else if (read_request(conn, arena)) {
+      conn->arena = arena;
+      arena = NULL;
+      stage_push(STAGE_HANDLE, conn);
+    }
+    stage_done(STAGE_PARSE, 1);
+  }
+  return NULL;
+}
+
+/* Handle stage thread body: runs the request handler into the connection's buffer. */
+void *run_handle_stage(void *void_request_handler) {
+  void (*request_handler)(int, struct http_request *) = void_request_handler;
+  while (1) {
+    struct conn *conn = (struct conn *) wq_pop(&stages[STAGE_HANDLE].queue);
+    if (conn->h2) {
+      serve_http2_connection(conn, request_handler);
+      stage_done(STAGE_HANDLE, 1);
+      continue;
+    }
+    handle_request(conn, request_handler);
+    stage_arena_put(conn->arena);
+    conn->arena = NULL;
+    stage_push(STAGE_SEND, conn);
+    stage_done(STAGE_HANDLE, 1);
+  }
+  return NULL;
+}
+
+/*
+ * Send stage thread body: takes finished responses off the queue a batch at
+ * a time, writes each with one writev (plus sendfile for a held file) and
+ * hands keep-alive connections back to the parse stage.
+ */
+void *run_send_stage(void *unused) {
+  wq_item_t *batch[STAGE_SEND_BATCH];
+  while (1) {
+    int count = wq_pop_many(&stages[STAGE_SEND].queue, batch, STAGE_SEND_BATCH);
+    for (int i = 0; i < count; i++) {
+      struct conn *conn = (struct conn *) batch[i];
+      if (send_response(conn)) stage_push(STAGE_PARSE, conn);
+    }
+    stage_done(STAGE_SEND, count);
+  }
+  return NULL;
+}
+
+/* Starts the threads of every pipeline stage. */
+void init_stages(void (*request_handler)(int, struct http_request *)) {
+  void *(*bodies[NUM_STAGES])(void *) = { run_parse_stage, run_handle_stage, run_send_stage };
+  pthread_t thread;
+
+  for (int id = 0; id < NUM_STAGES; id++) {
+    wq_init(&stages[id].queue);
+    for (int i = 0; i < stages[id].num_threads; i++) {
+      if (pthread_create(&thread, NULL, bodies[id], request_handler) != 0) {
+        perror("Failed to start stage thread");
+        exit(errno);
+      }
+      pthread_detach(thread);
+    }
+  }
+}
+
+/* Prints how much work is waiting where (on SIGUSR1). */
+void print_queue_depths() {
+  if (server_use_stages) {
+    for (int id = 0; id < NUM_STAGES; id++) {
+      struct stage *stage = &stages[id];
+      printf("stage %-6s %3d threads, depth %d (max %d), %lu processed\n", stage->name,
+          stage->num_threads, __atomic_load_n(&stage->queue.size, __ATOMIC_RELAXED),
+          __atomic_exchange_n(&stage->max_depth, 0, __ATOMIC_RELAXED),
+          __atomic_load_n(&stage->processed, __ATOMIC_RELAXED));
+    }
+  } else {
+    for (int i = 0; i < num_threads; i++) {
+      printf("worker %3d inbox %d, deque %ld\n", i,
+          __atomic_load_n(&workers[i]->inbox.size, __ATOMIC_RELAXED),
+          deque_size(&workers[i]->deque));
+    }
+  }
+  printf("%d open connections\n", conn_open_count());
+  fflush(stdout);
+}
+
+/*
+ * Idle poller thread body: waits for parked keep-alive connections to become
+ * readable (or hang up) and queues them for the workers. Wakes at least once
+ * a timer tick to reap the connections whose deadlines have passed.
+ */
+void *poll_idle_connections(void *unused) {
+  struct epoll_event events[IDLE_POLLER_MAX_EVENTS];
+  int swept = 0;
+
+  while (1) {
+    int num_events = epoll_wait(idle_epoll_fd, events, IDLE_POLLER_MAX_EVENTS,
+        TIMER_WHEEL_TICK_MS);
+    if (num_events < 0 && errno != EINTR) {
+      perror("Failed to poll idle connections");
+      exit(errno);
+    }
+
+    pthread_mutex_lock(&idle_timers_lock);
+    for (int i = 0; i < num_events; i++) {
+      struct conn *conn = events[i].data.ptr;
+      timer_cancel(&idle_timers, &conn->timer);
+    }
+    struct timer *expired = timer_wheel_advance(&idle_timers, conn_now());
+    if (!swept && __atomic_load_n(&server_draining, __ATOMIC_RELAXED)) {
+      /* Close every idle connection now; partial requests keep their deadline. */
+      struct timer *parked = timer_wheel_take_all(&idle_timers);
+      while (parked) {
+        struct conn *conn = (struct conn *) ((char *) parked - offsetof(struct conn, timer));
+        parked = parked->next;
+        if (conn->read_length > 0) {
+          timer_add(&idle_timers, &conn->timer, connection_deadline(conn));
+        } else {
+          conn->timer.next = expired;
+          expired = &conn->timer;
+        }
+      }
+      swept = 1;
+    }
+    pthread_mutex_unlock(&idle_timers_lock);
+
+    for (int i = 0; i < num_events; i++)
+      dispatch_connection(events[i].data.ptr);
+
+    /* Only this thread takes connections out of the epoll set, so nothing
+     * else can be holding an expired or swept one. */
+    while (expired) {
+      struct conn *conn = (struct conn *) ((char *) expired - offsetof(struct conn, timer));
+      expired = expired->next;
+      epoll_ctl(idle_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+      conn_close(conn);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Decides where each of NUM_THREADS workers runs. With --pin-threads cpu,
+ * worker i gets the i-th allowed CPU; with --pin-threads node, it gets every
+ * allowed CPU of the i-th node, so workers spread evenly across sockets.
+ */
+struct worker_placement *plan_workers(int num_threads) {
+  struct worker_placement *plan = calloc(num_threads, sizeof(struct worker_placement));
+  int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+  int *nodes = malloc(CPU_SETSIZE * sizeof(int));
+  if (!plan || !cpus || !nodes) {
+    perror("Failed to plan worker placement");
+    exit(ENOMEM);
+  }
+
+  int num_cpus = cpu_list_allowed(cpus, CPU_SETSIZE), num_nodes = 0;
+  for (int i = 0; i < num_cpus; i++) {
+    int node = cpu_node(cpus[i]), seen = 0;
+    for (int j = 0; j < num_nodes && !seen; j++) seen = nodes[j] == node;
+    if (!seen) nodes[num_nodes++] = node;
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    CPU_ZERO(&plan[i].cpus);
+    if (num_cpus == 0) continue;
+    if (server_pin_mode == PIN_CPU) {
+      int cpu = cpus[i % num_cpus];
+      CPU_SET(cpu, &plan[i].cpus);
+      plan[i].node = cpu_node(cpu);
+    } else if (server_pin_mode == PIN_NODE) {
+      plan[i].node = nodes[i % num_nodes];
+      for (int j = 0; j < num_cpus; j++)
+        if (cpu_node(cpus[j]) == plan[i].node) CPU_SET(cpus[j], &plan[i].cpus);
+    }
+  }
+
+  free(cpus);
+  free(nodes);
+  return plan;
+}
+
+/* Starts NUM_THREADS detached workers. */
+void init_workers(int num_threads,
+    void (*request_handler)(int, struct http_request *)) {
+  pthread_t thread;
+
+  workers = calloc(num_threads, sizeof(struct worker *));
+  struct worker_placement *plan = plan_workers(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    struct worker_start *start = malloc(sizeof(struct worker_start));
+    if (!workers || !start) {
+      perror("Failed to start worker thread");
+      exit(ENOMEM);
+    }
+    start->index = i;
+    start->placement = plan[i];
+    start->request_handler = request_handler;
+    if (pthread_create(&thread, NULL, handle_clients, start) != 0) {
+      perror("Failed to start worker thread");
+      exit(errno);
+    }
+    pthread_detach(thread);
+  }
+  free(plan);
+
+  /* Connections are steered by worker, so every worker must be published. */
+  for (int i = 0; i < num_threads; i++)
+    while (!__atomic_load_n(&workers[i], __ATOMIC_ACQUIRE))
+      sched_yield();
+}
+
+/*
+ * Starts the request threads, NUM_THREADS workers or the pipeline stages
+ * with --stages, and the idle poller.
+ */
+void init_thread_pool(int num_threads,
+    void (*request_handler)(int, struct http_request *)) {
+  pthread_t thread;
+
+  if (server_use_stages)
+    init_stages(request_handler);
+  else
+    init_workers(num_threads, request_handler);
+
+  timer_wheel_init(&idle_timers, conn_now());
+  idle_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (idle_epoll_fd < 0 || pthread_create(&thread, NULL, poll_idle_connections, NULL) != 0) {
+    perror("Failed to start idle poller");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO and
+ * saves the fd number of the server socket in *socket_number.
+ */
+void open_server_socket(int *socket_number) {
+
+  struct sockaddr_in server_address;
+
+  *socket_number = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (*socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
@@ -120,45 +1386,307 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
     exit(errno);
   }
 
+  /* Don't wake the accept loop until the client has sent something. */
+  socket_option = CONNECTION_DEFER_ACCEPT_SECONDS;
+  setsockopt(*socket_number, IPPROTO_TCP, TCP_DEFER_ACCEPT, &socket_option,
+      sizeof(socket_option));
+
   if (listen(*socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
   printf("Listening on port %d...\n", server_port);
+}
 
-  while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_socket_number < 0) {
-      perror("Error accepting socket");
-      continue;
-    }
+/*
+ * Hands the listening socket to a freshly exec'd copy of this binary: the
+ * child inherits one end of a Unix socket pair, named in SERVER_UPGRADE_ENV,
+ * and receives SERVER_SOCKET over it with SCM_RIGHTS. Both processes accept
+ * from the same socket until the child is serving and sends us SIGTERM, so
+ * no connection is ever refused. If the child fails to start we simply keep
+ * serving.
+ */
+void start_upgrade(int server_socket) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+    perror("Failed to create upgrade socket");
+    return;
+  }
+  fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+
+  char fd_string[16];
+  snprintf(fd_string, sizeof(fd_string), "%d", sockets[1]);
+  setenv(SERVER_UPGRADE_ENV, fd_string, 1);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(server_argv[0], server_argv);
+    perror("Failed to exec upgraded server");
+    _exit(EXIT_FAILURE);
+  }
+  unsetenv(SERVER_UPGRADE_ENV);
+  close(sockets[1]);
+  if (pid < 0) {
+    perror("Failed to fork upgraded server");
+    close(sockets[0]);
+    return;
+  }
+
+  char byte = 0;
+  struct iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &server_socket, sizeof(int));
+  if (sendmsg(sockets[0], &message, 0) < 0)
+    perror("Failed to send listening socket");
+  close(sockets[0]);
+
+  printf("Started upgraded server (pid %d)\n", pid);
+}
+
+/*
+ * Receives the listening socket from the server that exec'd us (see
+ * start_upgrade) on the inherited Unix socket UPGRADE_FD.
+ */
+int receive_upgrade_socket(int upgrade_fd) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  int server_socket = -1;
+  if (recvmsg(upgrade_fd, &message, MSG_CMSG_CLOEXEC) > 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&server_socket, CMSG_DATA(cmsg), sizeof(int));
+  }
+  close(upgrade_fd);
+  if (server_socket < 0) {
+    fprintf(stderr, "Failed to receive listening socket from previous server\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("Inherited listening socket %d\n", server_socket);
+  return server_socket;
+}
+
+/*
+ * Called by the accept loops on every wakeup to act on signals. Returns 0
+ * once the server should stop accepting and drain.
+ */
+int server_keep_accepting() {
+  if (server_upgrade_requested) {
+    server_upgrade_requested = 0;
+    start_upgrade(server_fd);
+  }
+  if (server_stats_requested) {
+    server_stats_requested = 0;
+    print_queue_depths();
+  }
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
+  return !server_stop_requested;
+}
+
+/* Tells the server we were upgraded from that we are serving now. */
+void finish_upgrade() {
+  if (server_inherited_socket) kill(getppid(), SIGTERM);
+}
+
+/*
+ * Marks the server as draining. Whatever is still open
+ * SERVER_DRAIN_TIMEOUT_SECONDS later is cut off by drain_timeout_handler().
+ */
+void start_drain() {
+  alarm(SERVER_DRAIN_TIMEOUT_SECONDS);
+  __atomic_store_n(&server_draining, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * server_keep_accepting() for the io_uring engine, which drains its own
+ * connections before returning, so the drain deadline has to start here.
+ */
+int uring_keep_accepting() {
+  if (server_keep_accepting()) return 1;
+  start_drain();
+  return 0;
+}
+
+/*
+ * Stops accepting, lets the workers finish every queued and in-flight
+ * connection and exits. Idle keep-alive connections are closed by the
+ * poller; responses in progress go out with Connection: close.
+ */
+void drain_and_exit(int server_socket) {
+  printf("Draining %d connections\n", conn_open_count());
+  if (!server_draining) start_drain();
+  close(server_socket);
+
+  sigset_t unblocked;
+  sigemptyset(&unblocked);
+  struct timespec interval = { 0, TIMER_WHEEL_TICK_MS * 1000000 };
+  while (conn_open_count() > 0)
+    ppoll(NULL, 0, &interval, &unblocked);
+
+  printf("Drained, exiting\n");
+  exit(EXIT_SUCCESS);
+}
+
+/*
+ * Decides whether to serve a connection just accepted from ADDRESS, before
+ * anything is read from it. Over-limit clients get a 429, and a server
+ * already at --max-connections a 503. Admitted connections are counted
+ * against the client's cap and spend the first request token.
+ */
+int admit_connection(int fd, struct sockaddr_in *address, int *limited) {
+  in_addr_t client = address->sin_addr.s_addr;
+  uint64_t now = conn_now();
+  *limited = 0;
+
+  if (server_max_connections > 0 && conn_open_count() >= server_max_connections) {
+    send_rejection(fd, NULL, 503);
+    return 0;
+  }
+  if (!ratelimit_connection_open(client, now)) {
+    send_rejection(fd, NULL, 429);
+    return 0;
+  }
+  *limited = 1;
+  if (!ratelimit_take(client, now)) {
+    ratelimit_connection_close(client);
+    send_rejection(fd, NULL, 429);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Opens the server socket (see open_server_socket) unless one was inherited
+ * from the server we are upgrading. Each accepted connection is wrapped in a
+ * struct conn and queued for the worker pool. With --io-uring, static files
+ * are served by the io_uring engine instead, unless the kernel cannot
+ * support it. Returns after draining once a stop has been requested.
+ */
+void serve_forever(int *socket_number,
+    void (*request_handler)(int, struct http_request *)) {
+
+  struct sockaddr_in client_address;
+  size_t client_address_length = sizeof(client_address);
+  int client_socket_number;
+
+  if (*socket_number < 0) open_server_socket(socket_number);
+
+  /* Signals are blocked everywhere except while the accept loop waits. */
+  sigset_t unblocked;
+  sigemptyset(&unblocked);
+  fcntl(*socket_number, F_SETFL, fcntl(*socket_number, F_GETFL) | O_NONBLOCK);
+
+  if (server_use_io_uring) {
+    finish_upgrade();
+    if (uring_serve_forever(*socket_number, server_files_directory,
+          uring_keep_accepting) == 0)
+      drain_and_exit(*socket_number);
+    fprintf(stderr, "io_uring unavailable, falling back to blocking accept loop\n");
+  }
+
+  init_thread_pool(num_threads, request_handler);
+  if (!server_use_io_uring) finish_upgrade();
+
+  while (server_keep_accepting()) {
+    struct pollfd listener = { *socket_number, POLLIN, 0 };
+    if (ppoll(&listener, 1, NULL, &unblocked) < 0) continue;
+
+    while (1) {
+      client_socket_number = accept4(*socket_number,
+          (struct sockaddr *) &client_address,
+          (socklen_t *) &client_address_length, SOCK_CLOEXEC);
+      if (client_socket_number < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          perror("Error accepting socket");
+        break;
+      }
+
+      printf("Accepted connection from %s on port %d\n",
+          inet_ntoa(client_address.sin_addr),
+          client_address.sin_port);
+
+      int socket_option = 1;
+      setsockopt(client_socket_number, IPPROTO_TCP, TCP_NODELAY, &socket_option,
+          sizeof(socket_option));
+
+      /* Responses are written with blocking sends; a stalled reader fails them. */
+      struct timeval write_timeout = {
+        CONNECTION_WRITE_TIMEOUT_MS / 1000, CONNECTION_WRITE_TIMEOUT_MS % 1000 * 1000
+      };
+      setsockopt(client_socket_number, SOL_SOCKET, SO_SNDTIMEO, &write_timeout,
+          sizeof(write_timeout));
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+      int limited;
+      if (!admit_connection(client_socket_number, &client_address, &limited)) {
+        close(client_socket_number);
+        continue;
+      }
 
-    request_handler(client_socket_number);
-    close(client_socket_number);
+      struct conn *conn = conn_alloc(client_socket_number, &client_address);
+      if (!conn) {
+        if (limited) ratelimit_connection_close(client_address.sin_addr.s_addr);
+        close(client_socket_number);
+        continue;
+      }
+      conn->limited = limited;
+      if (server_use_tls && !(conn->tls = tls_new(client_socket_number))) {
+        conn_close(conn);
+        continue;
+      }
+      if (!server_use_stages) conn->worker = steer_connection(client_socket_number);
+      dispatch_connection(conn);
+    }
   }
 
-  shutdown(*socket_number, SHUT_RDWR);
-  close(*socket_number);
+  drain_and_exit(*socket_number);
 }
 
-int server_fd;
+/*
+ * SIGTERM and SIGINT drain and exit; SIGUSR2 starts a hot upgrade; SIGUSR1
+ * prints queue depths.
+ */
 void signal_callback_handler(int signum) {
-  printf("Caught signal %d: %s\n", signum, strsignal(signum));
-  printf("Closing socket %d\n", server_fd);
-  if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
-  exit(0);
+  if (signum == SIGUSR2)
+    server_upgrade_requested = 1;
+  else if (signum == SIGUSR1)
+    server_stats_requested = 1;
+  else
+    server_stop_requested = 1;
+}
+
+void drain_timeout_handler(int signum) {
+  static const char message[] = "Drain timed out, exiting\n";
+  if (write(STDERR_FILENO, message, sizeof(message) - 1) < 0) {}
+  _exit(EXIT_FAILURE);
 }
 
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5] [--io-uring]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n"
+  "       ./httpserver --config routes.conf --port 8000 [--num-threads 5]\n"
+  "Limits: [--rate-limit REQUESTS_PER_SECOND] [--rate-burst REQUESTS]\n"
+  "        [--max-connections-per-ip 64] [--max-connections 10000]\n"
+  "Placement: [--pin-threads cpu|node] [--stages PARSE,HANDLE,SEND]\n"
+  "TLS: [--tls-cert cert.pem --tls-key key.pem] [--tls-ticket-key 80_byte_file]\n"
+  "Responses: [--gzip] [--chunk-coalesce BYTES] [--uploads]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -166,11 +1694,35 @@ void exit_with_usage() {
 }
 
 int main(int argc, char **argv) {
-  signal(SIGINT, signal_callback_handler);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = signal_callback_handler;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGUSR2, &action, NULL);
+  sigaction(SIGUSR1, &action, NULL);
+  action.sa_handler = drain_timeout_handler;
+  sigaction(SIGALRM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  /* Only the accept loop takes these; every thread inherits the mask. */
+  sigset_t handled;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGUSR2);
+  sigaddset(&handled, SIGUSR1);
+  sigaddset(&handled, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &handled, NULL);
+
+  server_argv = argv;
 
   /* Default settings */
   server_port = 8000;
-  void (*request_handler)(int) = NULL;
+  void (*request_handler)(int, struct http_request *) = NULL;
+  double rate_limit = 0, rate_burst = 0;
+  int max_connections_per_ip = 0;
+  char *tls_cert = NULL, *tls_key = NULL, *tls_ticket_key = NULL;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -191,15 +1743,22 @@ int main(int argc, char **argv) {
         exit_with_usage();
       }
 
+      /* argv is exec'd again on a hot upgrade, so copy the host out of it. */
       char *colon_pointer = strchr(proxy_target, ':');
       if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
+        server_proxy_hostname = strndup(proxy_target, colon_pointer - proxy_target);
         server_proxy_port = atoi(colon_pointer + 1);
       } else {
         server_proxy_hostname = proxy_target;
         server_proxy_port = 80;
       }
+    } else if (strcmp("--config", argv[i]) == 0) {
+      request_handler = handle_routed_request;
+      server_config_file = argv[++i];
+      if (!server_config_file) {
+        fprintf(stderr, "Expected argument after --config\n");
+        exit_with_usage();
+      }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
       if (!server_port_string) {
@@ -213,6 +1772,78 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_string = argv[++i];
+      if (!rate_string || (rate_limit = atof(rate_string)) <= 0) {
+        fprintf(stderr, "Expected positive number after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-burst", argv[i]) == 0) {
+      char *burst_string = argv[++i];
+      if (!burst_string || (rate_burst = atof(burst_string)) < 1) {
+        fprintf(stderr, "Expected number of at least 1 after --rate-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-connections-per-ip", argv[i]) == 0) {
+      char *max_string = argv[++i];
+      if (!max_string || (max_connections_per_ip = atoi(max_string)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-connections-per-ip\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-connections", argv[i]) == 0) {
+      char *max_string = argv[++i];
+      if (!max_string || (server_max_connections = atoi(max_string)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-connections\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--pin-threads", argv[i]) == 0) {
+      char *mode = argv[++i];
+      if (mode && strcmp(mode, "cpu") == 0) {
+        server_pin_mode = PIN_CPU;
+      } else if (mode && strcmp(mode, "node") == 0) {
+        server_pin_mode = PIN_NODE;
+      } else {
+        fprintf(stderr, "Expected cpu or node after --pin-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--stages", argv[i]) == 0) {
+      char *counts = argv[++i];
+      if (!counts || sscanf(counts, "%d,%d,%d", &stages[STAGE_PARSE].num_threads,
+            &stages[STAGE_HANDLE].num_threads, &stages[STAGE_SEND].num_threads) != 3 ||
+          stages[STAGE_PARSE].num_threads < 1 || stages[STAGE_HANDLE].num_threads < 1 ||
+          stages[STAGE_SEND].num_threads < 1) {
+        fprintf(stderr, "Expected three positive thread counts after --stages, e.g. 1,4,1\n");
+        exit_with_usage();
+      }
+      server_use_stages = 1;
+    } else if (strcmp("--tls-cert", argv[i]) == 0 ||
+               strcmp("--tls-key", argv[i]) == 0 ||
+               strcmp("--tls-ticket-key", argv[i]) == 0) {
+      char *option = argv[i], *path = argv[++i];
+      if (!path) {
+        fprintf(stderr, "Expected file after %s\n", option);
+        exit_with_usage();
+      }
+      if (strcmp("--tls-cert", option) == 0)
+        tls_cert = path;
+      else if (strcmp("--tls-key", option) == 0)
+        tls_key = path;
+      else
+        tls_ticket_key = path;
+    } else if (strcmp("--gzip", argv[i]) == 0) {
+      server_use_gzip = 1;
+    } else if (strcmp("--uploads", argv[i]) == 0) {
+      server_allow_uploads = 1;
+    } else if (strcmp("--chunk-coalesce", argv[i]) == 0) {
+      char *size_string = argv[++i];
+      int size;
+      if (!size_string || (size = atoi(size_string)) < 1) {
+        fprintf(stderr, "Expected positive number of bytes after --chunk-coalesce\n");
+        exit_with_usage();
+      }
+      http_set_chunk_coalescing(size);
+    } else if (strcmp("--io-uring", argv[i]) == 0) {
+      server_use_io_uring = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -221,12 +1852,68 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
-    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+  if (server_files_directory == NULL && server_proxy_hostname == NULL &&
+      server_config_file == NULL) {
+    fprintf(stderr, "Please specify either \"--files [DIRECTORY]\", \n"
+                    "                      \"--proxy [HOSTNAME:PORT]\" or\n"
+                    "                      \"--config [ROUTES_FILE]\"\n");
+    exit_with_usage();
+  }
+
+  if (server_use_io_uring && request_handler != handle_files_request) {
+    fprintf(stderr, "--io-uring only supports --files\n");
     exit_with_usage();
   }
 
+  if (server_use_stages && server_pin_mode != PIN_NONE) {
+    fprintf(stderr, "--pin-threads only applies to workers, not --stages\n");
+    exit_with_usage();
+  }
+
+  if (server_use_io_uring && (rate_limit > 0 || max_connections_per_ip > 0 ||
+        server_max_connections > 0)) {
+    fprintf(stderr, "--io-uring does not enforce connection limits\n");
+    exit_with_usage();
+  }
+
+  if (server_use_io_uring && (server_use_gzip || server_allow_uploads)) {
+    fprintf(stderr, "--io-uring does not support --gzip or --uploads\n");
+    exit_with_usage();
+  }
+
+  if (server_proxy_hostname) {
+    char target[512];
+    snprintf(target, sizeof(target), "%s:%d", server_proxy_hostname, server_proxy_port);
+    if (router_resolve_target(target, &server_proxy_target) < 0)
+      exit(EXIT_FAILURE);
+  }
+
+  if (server_config_file && router_load(server_config_file) < 0)
+    exit(EXIT_FAILURE);
+
+  if (tls_cert || tls_key || tls_ticket_key) {
+    if (!tls_cert || !tls_key) {
+      fprintf(stderr, "--tls-cert and --tls-key must be given together\n");
+      exit_with_usage();
+    }
+    if (server_use_io_uring) {
+      fprintf(stderr, "--io-uring does not support TLS\n");
+      exit_with_usage();
+    }
+    if (tls_init(tls_cert, tls_key, tls_ticket_key) < 0)
+      exit(EXIT_FAILURE);
+    server_use_tls = 1;
+  }
+
+  ratelimit_init(rate_limit, rate_burst, max_connections_per_ip);
+
+  char *upgrade_fd = getenv(SERVER_UPGRADE_ENV);
+  if (upgrade_fd) {
+    unsetenv(SERVER_UPGRADE_ENV);
+    server_fd = receive_upgrade_socket(atoi(upgrade_fd));
+    server_inherited_socket = 1;
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
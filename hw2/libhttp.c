@@ -1,70 +1,431 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "h2.h"
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_LINE_MAX_SIZE 4096
+#define LIBHTTP_MAX_OUTPUTS (1 << 20)
+
+/*
+ * A chunk's size line is reserved before its data is known, so it is written
+ * as eight zero-padded hex digits; the two bytes of its trailing CRLF are
+ * kept free in the buffer while it is open.
+ */
+#define LIBHTTP_CHUNK_HEADER_SIZE 10
+#define LIBHTTP_CHUNK_OVERHEAD (LIBHTTP_CHUNK_HEADER_SIZE + 2)
+
+static size_t http_chunk_coalescing = LIBHTTP_CHUNK_COALESCE_SIZE;
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
+struct http_request *http_request_parse(int fd, struct arena *arena) {
+  char *read_buffer = arena_alloc(arena, LIBHTTP_REQUEST_MAX_SIZE);
   if (!read_buffer) http_fatal_error("Malloc failed");
 
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  struct http_request *request;
+  size_t read_length = 0;
+  while (read_length < LIBHTTP_REQUEST_MAX_SIZE) {
+    ssize_t bytes_read = read(fd, read_buffer + read_length,
+        LIBHTTP_REQUEST_MAX_SIZE - read_length);
+    if (bytes_read <= 0) break;
+    read_length += bytes_read;
+    if (http_request_parse_buffer(read_buffer, read_length, arena, &request) != 0)
+      return request;
+  }
+  return NULL;
+}
+
+/* Returns the length of the request head (through the blank line), or 0. */
+static size_t http_find_head_end(char *buffer, size_t length) {
+  for (size_t i = 0; i + 1 < length; i++) {
+    if (buffer[i] != '\n') continue;
+    if (buffer[i + 1] == '\n') return i + 2;
+    if (buffer[i + 1] == '\r' && i + 2 < length && buffer[i + 2] == '\n') return i + 3;
+  }
+  return 0;
+}
 
+/* Copies [START, END) into ARENA with surrounding whitespace removed. */
+static char *http_strip_dup(struct arena *arena, char *start, char *end) {
+  while (start < end && (*start == ' ' || *start == '\t')) start++;
+  while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+  char *copy = arena_strndup(arena, start, end - start);
+  if (!copy) http_fatal_error("Malloc failed");
+  return copy;
+}
+
+/*
+ * Parses the "Key: value" lines from CURSOR up to the blank line that ends
+ * the head at HEAD_END. Returns -1 if a line is malformed.
+ */
+static int http_parse_headers(struct arena *arena, char *cursor, char *head_end,
+    struct http_header **headers_out, int *num_headers_out) {
+  int max_headers = 0;
+  for (char *scan = cursor; scan < head_end; scan++)
+    if (*scan == '\n') max_headers++;
+  struct http_header *headers = arena_alloc(arena, max_headers * sizeof(struct http_header) + 1);
+  if (!headers) http_fatal_error("Malloc failed");
+
+  int num_headers = 0;
+  while (cursor < head_end) {
+    char *line_end = memchr(cursor, '\n', head_end - cursor);
+    if (line_end == cursor || (line_end == cursor + 1 && *cursor == '\r'))
+      break;
+    char *colon = memchr(cursor, ':', line_end - cursor);
+    if (!colon || colon == cursor) return -1;
+    struct http_header *header = &headers[num_headers++];
+    header->key = http_strip_dup(arena, cursor, colon);
+    header->value = http_strip_dup(arena, colon + 1, line_end);
+    cursor = line_end + 1;
+  }
+  *headers_out = headers;
+  *num_headers_out = num_headers;
+  return 0;
+}
+
+int http_request_parse_buffer(char *buffer, size_t length, struct arena *arena,
+    struct http_request **request_out) {
+  *request_out = NULL;
+  size_t head_length = http_find_head_end(buffer, length);
+  if (head_length == 0)
+    return length >= LIBHTTP_REQUEST_MAX_SIZE ? -1 : 0;
+
+  struct http_request *request = arena_alloc(arena, sizeof(struct http_request));
+  if (!request) http_fatal_error("Malloc failed");
+  memset(request, 0, sizeof(*request));
+
+  char *head_end = buffer + head_length;
   char *read_start, *read_end;
   size_t read_size;
 
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+  /* Read in the HTTP method: "[A-Z]*" */
+  read_start = read_end = buffer;
+  while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
+  read_size = read_end - read_start;
+  if (read_size == 0) return -1;
+  request->method = arena_strndup(arena, read_start, read_size);
+  if (!request->method) http_fatal_error("Malloc failed");
+
+  /* Read in a space character. */
+  if (*read_end != ' ') return -1;
+  read_end++;
+
+  /* Read in the path: "[^ \r\n]*" */
+  read_start = read_end;
+  while (*read_end != ' ' && *read_end != '\r' && *read_end != '\n') read_end++;
+  read_size = read_end - read_start;
+  if (read_size == 0) return -1;
+  request->path = arena_strndup(arena, read_start, read_size);
+  if (!request->path) http_fatal_error("Malloc failed");
+
+  /* Read in the HTTP version and the rest of the request line: ".*" */
+  request->minor_version = 0;
+  if (*read_end == ' ' && strncmp(read_end + 1, "HTTP/1.", 7) == 0 &&
+      read_end[8] >= '0' && read_end[8] <= '9')
+    request->minor_version = read_end[8] - '0';
+  while (*read_end != '\n') read_end++;
+  read_end++;
+
+  if (http_parse_headers(arena, read_end, head_end, &request->headers,
+        &request->num_headers) < 0)
+    return -1;
+
+  /*
+   * A body is framed by chunked transfer-coding or by Content-Length. Any
+   * other coding, or both framings at once, could be read differently by a
+   * proxy in front of us, so such requests are refused. So are repeated
+   * Content-Length headers that disagree (RFC 9112 section 6.3).
+   */
+  char *transfer_encoding = http_request_header(request, "Transfer-Encoding");
+  char *content_length = http_request_header(request, "Content-Length");
+  for (int i = 0; content_length && i < request->num_headers; i++)
+    if (strcasecmp(request->headers[i].key, "Content-Length") == 0 &&
+        strcmp(request->headers[i].value, content_length) != 0)
+      return -1;
+  request->content_length = -1;
+  if (transfer_encoding) {
+    if (strcasecmp(transfer_encoding, "chunked") != 0 || content_length) return -1;
+    request->chunked = 1;
+  } else if (content_length) {
+    char *end;
+    if (*content_length < '0' || *content_length > '9') return -1;
+    errno = 0;
+    request->content_length = strtoll(content_length, &end, 10);
+    if (*end != '\0' || errno == ERANGE) return -1;
+  }
+
+  /* HTTP/1.1 connections persist unless closed; HTTP/1.0 ones must opt in. */
+  char *connection = http_request_header(request, "Connection");
+  if (request->minor_version >= 1)
+    request->keep_alive = !connection || strcasecmp(connection, "close") != 0;
+  else
+    request->keep_alive = connection && strcasecmp(connection, "keep-alive") == 0;
+
+  *request_out = request;
+  return head_length;
+}
+
+char *http_request_header(struct http_request *request, char *key) {
+  return http_find_header(request->headers, request->num_headers, key);
+}
+
+char *http_find_header(struct http_header *headers, int num_headers, char *key) {
+  for (int i = 0; i < num_headers; i++)
+    if (strcasecmp(headers[i].key, key) == 0)
+      return headers[i].value;
   return NULL;
+}
+
+int http_response_parse_buffer(char *buffer, size_t length, struct arena *arena,
+    struct http_response **response_out) {
+  *response_out = NULL;
+  size_t head_length = http_find_head_end(buffer, length);
+  if (head_length == 0)
+    return length >= LIBHTTP_REQUEST_MAX_SIZE ? -1 : 0;
+
+  struct http_response *response = arena_alloc(arena, sizeof(struct http_response));
+  if (!response) http_fatal_error("Malloc failed");
+  memset(response, 0, sizeof(*response));
+
+  /* Read in the status line: "HTTP/1.x NNN reason" */
+  if (head_length < 13 || strncmp(buffer, "HTTP/1.", 7) != 0 ||
+      buffer[7] < '0' || buffer[7] > '9' || buffer[8] != ' ')
+    return -1;
+  response->minor_version = buffer[7] - '0';
+  for (int i = 9; i < 12; i++) {
+    if (buffer[i] < '0' || buffer[i] > '9') return -1;
+    response->status_code = response->status_code * 10 + buffer[i] - '0';
+  }
+  if (buffer[12] != ' ' && buffer[12] != '\r' && buffer[12] != '\n') return -1;
+
+  char *head_end = buffer + head_length;
+  char *read_end = memchr(buffer, '\n', head_length) + 1;
+  if (http_parse_headers(arena, read_end, head_end, &response->headers,
+        &response->num_headers) < 0)
+    return -1;
+
+  *response_out = response;
+  return head_length;
+}
+
+/*
+ * Response buffering. Outputs are looked up by fd in a table sized to the
+ * process's descriptor limit; fds outside it are simply written unbuffered.
+ */
+static struct http_output **http_outputs;
+static int http_outputs_size;
+static pthread_once_t http_outputs_once = PTHREAD_ONCE_INIT;
+
+static void http_outputs_init() {
+  struct rlimit limit;
+  http_outputs_size = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    http_outputs_size = limit.rlim_cur;
+  if (http_outputs_size > LIBHTTP_MAX_OUTPUTS) http_outputs_size = LIBHTTP_MAX_OUTPUTS;
+  http_outputs = calloc(http_outputs_size, sizeof(struct http_output *));
+  if (!http_outputs) http_fatal_error("Malloc failed");
+}
+
+static struct http_output *http_output_get(int fd) {
+  if (!http_outputs || fd < 0 || fd >= http_outputs_size) return NULL;
+  return http_outputs[fd];
+}
+
+void http_output_attach(int fd, struct http_output *output, struct http_request *request) {
+  pthread_once(&http_outputs_once, http_outputs_init);
+  output->length = 0;
+  output->minor_version = request ? request->minor_version : 0;
+  output->keep_alive = request ? request->keep_alive : 0;
+  output->has_length = 0;
+  output->sent_connection = 0;
+  output->failed = 0;
+  output->has_file = 0;
+  output->chunked = 0;
+  output->chunk_open = 0;
+  if (fd >= 0 && fd < http_outputs_size)
+    http_outputs[fd] = output;
+}
+
+void http_output_unbind(int fd) {
+  if (http_outputs && fd >= 0 && fd < http_outputs_size)
+    http_outputs[fd] = NULL;
+}
+
+void http_output_detach(int fd) {
+  http_flush(fd);
+  http_output_unbind(fd);
+}
+
+static int http_write_all(int fd, char *data, size_t size) {
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = write(fd, data, size);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    size -= bytes_sent;
+    data += bytes_sent;
+  }
+  return 0;
+}
+
+/* Passes all of DATA to OUTPUT's write hook. */
+static int http_hook_write_all(struct http_output *output, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes_sent = output->write(output->write_context, data, size);
+    if (bytes_sent <= 0) return -1;
+    size -= bytes_sent;
+    data += bytes_sent;
+  }
+  return 0;
+}
+
+/* Fills in the size line of OUTPUT's open chunk and ends its data. */
+static void http_close_chunk(struct http_output *output) {
+  char header[LIBHTTP_CHUNK_HEADER_SIZE + 1];
+  size_t size = output->length - output->chunk_start - LIBHTTP_CHUNK_HEADER_SIZE;
+  snprintf(header, sizeof(header), "%08zx\r\n", size);
+  memcpy(output->buffer + output->chunk_start, header, LIBHTTP_CHUNK_HEADER_SIZE);
+  memcpy(output->buffer + output->length, "\r\n", 2);
+  output->length += 2;
+  output->chunk_open = 0;
+}
+
+/* Writes the buffered bytes of OUTPUT followed by DATA with one writev. */
+static int http_output_write(int fd, struct http_output *output, char *data, size_t size) {
+  if (output->chunk_open) http_close_chunk(output);
+  if (output->write) {
+    if (http_hook_write_all(output, output->buffer, output->length) < 0 ||
+        http_hook_write_all(output, data, size) < 0)
+      output->failed = 1;
+    output->length = 0;
+    return output->failed ? -1 : 0;
+  }
+
+  struct iovec iov[2] = {
+    { output->buffer, output->length },
+    { data, size }
+  };
+  int iovcnt = 2;
+  struct iovec *vector = iov;
+  while (iovcnt > 0) {
+    if (vector->iov_len == 0) {
+      vector++;
+      iovcnt--;
+      continue;
+    }
+    ssize_t bytes_sent = writev(fd, vector, iovcnt);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) continue;
+      output->failed = 1;
+      output->length = 0;
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) bytes_sent >= vector->iov_len) {
+      bytes_sent -= vector->iov_len;
+      vector++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      vector->iov_base = (char *) vector->iov_base + bytes_sent;
+      vector->iov_len -= bytes_sent;
+    }
+  }
+  output->length = 0;
+  return 0;
+}
+
+/*
+ * Sends SIZE bytes of FILE_FD with sendfile, or through OUTPUT's write hook
+ * in LIBHTTP_FILE_CHUNK_SIZE reads if it has one.
+ */
+static int http_sendfile_all(int fd, struct http_output *output, int file_fd, off_t size) {
+  off_t offset = 0;
+  if (output && output->write) {
+    char chunk[LIBHTTP_FILE_CHUNK_SIZE];
+    while (offset < size) {
+      size_t length = size - offset < (off_t) sizeof(chunk) ? size - offset : sizeof(chunk);
+      ssize_t bytes_read = pread(file_fd, chunk, length, offset);
+      if (bytes_read <= 0 || http_hook_write_all(output, chunk, bytes_read) < 0) return -1;
+      offset += bytes_read;
+    }
+    return 0;
+  }
+  while (offset < size) {
+    ssize_t bytes_sent = sendfile(fd, file_fd, &offset, size - offset);
+    if (bytes_sent <= 0) {
+      if (bytes_sent < 0 && errno == EINTR) continue;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int http_output_send(int fd, struct http_output *output) {
+  if (output->length > 0)
+    http_output_write(fd, output, NULL, 0);
+  if (output->has_file) {
+    if (!output->failed && http_sendfile_all(fd, output, output->file_fd, output->file_size) < 0)
+      output->failed = 1;
+    close(output->file_fd);
+    output->has_file = 0;
+  }
+  return output->failed ? -1 : 0;
+}
+
+int http_flush(int fd) {
+  struct http_output *output = http_output_get(fd);
+  if (!output) return 0;
+  return http_output_send(fd, output);
+}
 
+static void http_output_append(int fd, struct http_output *output, char *data, size_t size) {
+  /* Anything after a held file has to wait for it. */
+  if (output->has_file) http_output_send(fd, output);
+  if (size <= output->capacity - output->length) {
+    memcpy(output->buffer + output->length, data, size);
+    output->length += size;
+  } else {
+    http_output_write(fd, output, data, size);
+  }
+}
+
+/* Formats into the output buffer of FD, or straight to FD if it has none. */
+static void http_printf(int fd, const char *format, ...) {
+  char line[LIBHTTP_LINE_MAX_SIZE];
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(line, sizeof(line), format, arguments);
+  va_end(arguments);
+  if (length < 0) return;
+  if (length >= (int) sizeof(line)) length = sizeof(line) - 1;
+
+  struct http_output *output = http_output_get(fd);
+  if (output)
+    http_output_append(fd, output, line, length);
+  else
+    http_write_all(fd, line, length);
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +434,12 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 201:
+      return "Created";
+    case 204:
+      return "No Content";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +456,73 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 413:
+      return "Payload Too Large";
+    case 429:
+      return "Too Many Requests";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+    case 507:
+      return "Insufficient Storage";
     default:
       return "Internal Server Error";
   }
 }
 
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  struct http_output *output = http_output_get(fd);
+  if (output && output->stream) {
+    h2_stream_start_response(output->stream, status_code);
+    return;
+  }
+  if (output) {
+    output->has_length = status_code / 100 == 1 || status_code == 204 || status_code == 304;
+    output->sent_connection = 0;
+  }
+  http_printf(fd, "HTTP/1.%d %d %s\r\n", output ? output->minor_version : 0,
+      status_code, http_get_response_message(status_code));
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  struct http_output *output = http_output_get(fd);
+  if (output && output->stream) {
+    h2_stream_send_header(output->stream, key, value);
+    return;
+  }
+  if (output) {
+    if (strcasecmp(key, "Content-Length") == 0) {
+      output->has_length = 1;
+    } else if (strcasecmp(key, "Connection") == 0) {
+      output->sent_connection = 1;
+      if (strcasecmp(value, "close") == 0) output->keep_alive = 0;
+    } else if (strcasecmp(key, "Transfer-Encoding") == 0) {
+      /* Only a body whose last coding is chunked ends on its own. */
+      size_t length = strlen(value);
+      if (length >= 7 && strcasecmp(value + length - 7, "chunked") == 0)
+        output->has_length = 1;
+    }
+  }
+  http_printf(fd, "%s: %s\r\n", key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  struct http_output *output = http_output_get(fd);
+  if (output && output->stream) return;
+  if (output) {
+    /* A body without a length can only be delimited by closing. */
+    if (!output->has_length) output->keep_alive = 0;
+    if (!output->sent_connection) {
+      if (output->keep_alive && output->minor_version == 0)
+        http_printf(fd, "Connection: keep-alive\r\n");
+      else if (!output->keep_alive && output->minor_version >= 1)
+        http_printf(fd, "Connection: close\r\n");
+    }
+  }
+  http_printf(fd, "\r\n");
 }
 
 void http_send_string(int fd, char *data) {
@@ -112,14 +530,371 @@ void http_send_string(int fd, char *data) {
 }
 
 void http_send_data(int fd, char *data, size_t size) {
-  ssize_t bytes_sent;
-  while (size > 0) {
-    bytes_sent = write(fd, data, size);
-    if (bytes_sent < 0)
+  struct http_output *output = http_output_get(fd);
+  if (output)
+    http_output_append(fd, output, data, size);
+  else
+    http_write_all(fd, data, size);
+}
+
+void http_send_file(int fd, int file_fd, off_t size) {
+  struct http_output *output = http_output_get(fd);
+  if (output) {
+    /* Small files ride along with the headers in a single write. */
+    if (!output->has_file && size <= (off_t) (output->capacity - output->length) &&
+        pread(file_fd, output->buffer + output->length, size, 0) == size) {
+      output->length += size;
       return;
-    size -= bytes_sent;
-    data += bytes_sent;
+    }
+    if (output->has_file) http_output_send(fd, output);
+    output->file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+    if (output->file_fd >= 0) {
+      output->has_file = 1;
+      output->file_size = size;
+      return;
+    }
+    if (http_output_send(fd, output) < 0) return;
+  }
+  if (http_sendfile_all(fd, output, file_fd, size) < 0 && output)
+    output->failed = 1;
+}
+
+void http_set_chunk_coalescing(size_t size) {
+  http_chunk_coalescing = size > 0 ? size : 1;
+}
+
+void http_start_chunked(int fd) {
+  struct http_output *output = http_output_get(fd);
+  if (!output || output->stream || output->minor_version == 0) return;
+  http_send_header(fd, "Transfer-Encoding", "chunked");
+  output->chunked = 1;
+}
+
+void http_send_chunk(int fd, char *data, size_t size) {
+  struct http_output *output = http_output_get(fd);
+  if (!output || !output->chunked) {
+    http_send_data(fd, data, size);
+    return;
+  }
+  if (output->has_file) http_output_send(fd, output);
+
+  /* A buffer with no room for a chunk at all gets each piece as its own. */
+  if (output->capacity < LIBHTTP_CHUNK_OVERHEAD + 1) {
+    char header[32];
+    if (size == 0) return;
+    int length = snprintf(header, sizeof(header), "%zx\r\n", size);
+    if (http_output_write(fd, output, header, length) == 0 &&
+        http_output_write(fd, output, data, size) == 0)
+      http_output_write(fd, output, "\r\n", 2);
+    return;
+  }
+
+  while (size > 0 && !output->failed) {
+    if (!output->chunk_open) {
+      if (output->capacity - output->length < LIBHTTP_CHUNK_OVERHEAD + 1 &&
+          http_output_send(fd, output) < 0)
+        return;
+      output->chunk_start = output->length;
+      output->length += LIBHTTP_CHUNK_HEADER_SIZE;
+      output->chunk_open = 1;
+    }
+    size_t room = output->capacity - output->length - 2;
+    size_t length = size < room ? size : room;
+    memcpy(output->buffer + output->length, data, length);
+    output->length += length;
+    data += length;
+    size -= length;
+    if (length == room || output->length - output->chunk_start -
+        LIBHTTP_CHUNK_HEADER_SIZE >= http_chunk_coalescing)
+      http_output_send(fd, output);
+  }
+}
+
+void http_end_chunked(int fd) {
+  struct http_output *output = http_output_get(fd);
+  if (!output || !output->chunked) return;
+  if (output->chunk_open) http_close_chunk(output);
+  output->chunked = 0;
+  http_output_append(fd, output, "0\r\n\r\n", 5);
+}
+
+void http_abort_response(int fd) {
+  struct http_output *output = http_output_get(fd);
+  if (!output) return;
+  output->failed = 1;
+  output->keep_alive = 0;
+  output->chunked = 0;
+}
+
+/*
+ * Request bodies. The body's bytes are taken from the front of the
+ * connection's read buffer while it has any; bytes past the body stay there
+ * for the next request. Only a raw socket is read from directly, and never
+ * for more than the body (or the current chunk) still holds.
+ */
+static __thread int http_pipe[2] = { -1, -1 };
+static __thread size_t http_pipe_size;
+
+/* Larger pipes let one splice() pair move more of an upload. */
+#define LIBHTTP_PIPE_SIZE (1024 * 1024)
+
+void http_body_init(struct http_body *body, struct http_request *request, int fd,
+    char *buffer, size_t *length, size_t capacity,
+    ssize_t (*fill)(void *context), void *fill_context, int raw) {
+  body->fd = fd;
+  body->buffer = buffer;
+  body->length = length;
+  body->capacity = capacity;
+  body->start = 0;
+  body->fill = fill;
+  body->fill_context = fill_context;
+  body->raw = raw;
+  char *expect = http_request_header(request, "Expect");
+  body->expect_continue = request->minor_version >= 1 && expect &&
+      strcasecmp(expect, "100-continue") == 0;
+  if (request->chunked) {
+    body->state = HTTP_BODY_CHUNK_SIZE;
+    body->remaining = 0;
+  } else {
+    body->state = request->content_length > 0 ? HTTP_BODY_LENGTH : HTTP_BODY_DONE;
+    body->remaining = request->content_length > 0 ? request->content_length : 0;
+  }
+  request->body = body->state == HTTP_BODY_DONE ? NULL : body;
+}
+
+static size_t http_body_buffered(struct http_body *body) {
+  return *body->length - body->start;
+}
+
+/*
+ * Waits until the client's socket is readable, first sending the 100
+ * Continue it may be holding the body back for. Returns -1 on timeout.
+ */
+static int http_body_wait(struct http_body *body) {
+  if (body->expect_continue) {
+    static char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    struct http_output *output = http_output_get(body->fd);
+    body->expect_continue = 0;
+    /* Too late once the final response has started. */
+    if (output && output->length == 0)
+      http_output_write(body->fd, output, interim, sizeof(interim) - 1);
+    else if (!output)
+      http_write_all(body->fd, interim, sizeof(interim) - 1);
+  }
+  struct pollfd readable = { body->fd, POLLIN, 0 };
+  int ready;
+  do {
+    ready = poll(&readable, 1, LIBHTTP_BODY_TIMEOUT_MS);
+  } while (ready < 0 && errno == EINTR);
+  if (ready == 0) errno = ETIMEDOUT;
+  return ready > 0 ? 0 : -1;
+}
+
+/* Reads more of the connection into the buffer. Returns -1 if none came. */
+static int http_body_fill(struct http_body *body) {
+  if (body->start == *body->length) {
+    body->start = 0;
+    *body->length = 0;
+  } else if (*body->length == body->capacity) {
+    if (body->start == 0) return -1;    /* A chunk line longer than the buffer. */
+    memmove(body->buffer, body->buffer + body->start, *body->length - body->start);
+    *body->length -= body->start;
+    body->start = 0;
+  }
+  while (body->fill) {
+    ssize_t bytes_read = body->fill(body->fill_context);
+    if (bytes_read > 0) return 0;
+    if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+        http_body_wait(body) < 0)
+      break;
+  }
+  return -1;
+}
+
+/*
+ * Returns the next line in the buffer (without its line ending) and consumes
+ * it, reading more as needed, or NULL if the connection ended first.
+ */
+static char *http_body_line(struct http_body *body) {
+  while (1) {
+    char *line = body->buffer + body->start;
+    char *end = memchr(line, '\n', http_body_buffered(body));
+    if (end) {
+      body->start = end + 1 - body->buffer;
+      if (end > line && end[-1] == '\r') end--;
+      *end = '\0';
+      return line;
+    }
+    if (http_body_fill(body) < 0) return NULL;
+  }
+}
+
+/*
+ * Steps over chunk framing until BODY is at data or at its end. Returns -1
+ * if the framing is malformed or the connection ended.
+ */
+static int http_body_advance(struct http_body *body) {
+  while (body->state != HTTP_BODY_DONE && body->state != HTTP_BODY_FAILED &&
+      !((body->state == HTTP_BODY_LENGTH || body->state == HTTP_BODY_CHUNK_DATA) &&
+        body->remaining > 0)) {
+    char *line = NULL;
+    if (body->state != HTTP_BODY_LENGTH && !(line = http_body_line(body))) {
+      body->state = HTTP_BODY_FAILED;
+      break;
+    }
+    switch (body->state) {
+      case HTTP_BODY_CHUNK_SIZE: {
+        /* "1a2b;extension=value": at most 15 hex digits, so no overflow. */
+        off_t size = 0;
+        int digits = 0;
+        for (; isxdigit((unsigned char) *line) && digits < 16; line++, digits++)
+          size = size * 16 + (isdigit((unsigned char) *line) ? *line - '0'
+              : tolower((unsigned char) *line) - 'a' + 10);
+        if (digits == 0 || digits > 15 || (*line && *line != ';' && *line != ' ' &&
+              *line != '\t')) {
+          body->state = HTTP_BODY_FAILED;
+          break;
+        }
+        body->remaining = size;
+        body->state = size > 0 ? HTTP_BODY_CHUNK_DATA : HTTP_BODY_TRAILERS;
+        break;
+      }
+      case HTTP_BODY_CHUNK_DATA:        /* All of this chunk has been read. */
+      case HTTP_BODY_CHUNK_END:
+        body->state = *line == '\0' ? HTTP_BODY_CHUNK_SIZE : HTTP_BODY_FAILED;
+        break;
+      case HTTP_BODY_TRAILERS:
+        if (*line == '\0') body->state = HTTP_BODY_DONE;
+        break;
+      default:                          /* HTTP_BODY_LENGTH with nothing left. */
+        body->state = HTTP_BODY_DONE;
+        break;
+    }
+  }
+  return body->state == HTTP_BODY_FAILED ? -1 : 0;
+}
+
+/* Counts LENGTH bytes of data as read. */
+static void http_body_consumed(struct http_body *body, size_t length) {
+  body->remaining -= length;
+  if (body->remaining == 0 && body->state == HTTP_BODY_CHUNK_DATA)
+    body->state = HTTP_BODY_CHUNK_END;
+}
+
+/* Reads up to SIZE bytes straight from BODY's raw socket. */
+static ssize_t http_body_recv(struct http_body *body, char *buffer, size_t size) {
+  while (1) {
+    ssize_t bytes_read = recv(body->fd, buffer, size, MSG_DONTWAIT);
+    if (bytes_read > 0) return bytes_read;
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+        http_body_wait(body) < 0)
+      return -1;
+  }
+}
+
+ssize_t http_read_body(struct http_request *request, char *buffer, size_t size) {
+  struct http_body *body = request->body;
+  if (!body || http_body_advance(body) < 0) return body ? -1 : 0;
+  if (body->state == HTTP_BODY_DONE || size == 0) return 0;
+
+  if (size > (size_t) body->remaining) size = body->remaining;
+  ssize_t length;
+  if (http_body_buffered(body) == 0 && body->raw) {
+    length = http_body_recv(body, buffer, size);
+  } else {
+    if (http_body_buffered(body) == 0 && http_body_fill(body) < 0) {
+      length = -1;
+    } else {
+      length = http_body_buffered(body) < size ? http_body_buffered(body) : size;
+      memcpy(buffer, body->buffer + body->start, length);
+      body->start += length;
+    }
+  }
+  if (length < 0) {
+    body->state = HTTP_BODY_FAILED;
+    return -1;
+  }
+  http_body_consumed(body, length);
+  return length;
+}
+
+/* Sets up this thread's pipe for splicing uploads. Returns -1 if it cannot. */
+static int http_pipe_open() {
+  if (http_pipe[0] >= 0) return 0;
+  if (pipe2(http_pipe, O_CLOEXEC) < 0) return -1;
+  fcntl(http_pipe[1], F_SETPIPE_SZ, LIBHTTP_PIPE_SIZE);
+  int size = fcntl(http_pipe[1], F_GETPIPE_SZ);
+  http_pipe_size = size > 0 ? size : 64 * 1024;
+  return 0;
+}
+
+/* Drops the pipe after a failure that may have left bytes in it. */
+static void http_pipe_close() {
+  close(http_pipe[0]);
+  close(http_pipe[1]);
+  http_pipe[0] = http_pipe[1] = -1;
+}
+
+ssize_t http_splice_body(struct http_request *request, int file_fd, size_t size) {
+  struct http_body *body = request->body;
+  if (!body || http_body_advance(body) < 0) return body ? -1 : 0;
+  if (body->state == HTTP_BODY_DONE || size == 0) return 0;
+
+  /* Buffered bytes, and connections that are not raw, are copied. */
+  if (http_body_buffered(body) > 0 || !body->raw || http_pipe_open() < 0) {
+    char chunk[LIBHTTP_FILE_CHUNK_SIZE];
+    if (size > sizeof(chunk)) size = sizeof(chunk);
+    ssize_t length = http_read_body(request, chunk, size);
+    if (length <= 0) return length;
+    return http_write_all(file_fd, chunk, length) < 0 ? -1 : length;
+  }
+
+  if (size > (size_t) body->remaining) size = body->remaining;
+  if (size > http_pipe_size) size = http_pipe_size;
+  /*
+   * SPLICE_F_NONBLOCK does not stop a blocking socket from blocking, so the
+   * socket is polled first; splice() then takes what has arrived.
+   */
+  ssize_t spliced;
+  do {
+    spliced = http_body_wait(body) < 0 ? -1 : splice(body->fd, NULL, http_pipe[1], NULL,
+        size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  } while (spliced < 0 && (errno == EINTR || errno == EAGAIN));
+  if (spliced <= 0) {
+    body->state = HTTP_BODY_FAILED;
+    return -1;
+  }
+  http_body_consumed(body, spliced);
+
+  for (ssize_t left = spliced; left > 0; ) {
+    ssize_t written = splice(http_pipe[0], NULL, file_fd, NULL, left, SPLICE_F_MOVE);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) {
+      http_pipe_close();
+      body->state = HTTP_BODY_FAILED;
+      return -1;
+    }
+    left -= written;
+  }
+  return spliced;
+}
+
+int http_body_finish(struct http_body *body, size_t *consumed) {
+  /* A client still waiting for 100 Continue never sent the body. */
+  if (body->state != HTTP_BODY_DONE && !body->expect_continue &&
+      !(body->state == HTTP_BODY_LENGTH && body->remaining > LIBHTTP_BODY_DRAIN_SIZE)) {
+    struct http_request request = { .body = body };
+    char scratch[LIBHTTP_FILE_CHUNK_SIZE];
+    size_t drained = 0;
+    ssize_t length;
+    while (drained < LIBHTTP_BODY_DRAIN_SIZE &&
+        (length = http_read_body(&request, scratch, sizeof(scratch))) > 0)
+      drained += length;
+    if (body->state != HTTP_BODY_DONE) http_body_advance(body);
   }
+  *consumed = body->start;
+  return body->state == HTTP_BODY_DONE ? 0 : -1;
 }
 
 char *http_get_mime_type(char *file_name) {
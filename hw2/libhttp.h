@@ -3,8 +3,9 @@
  *
  * Usage example:
  *
- *     // Returns NULL if an error was encountered.
- *     struct http_request *request = http_request_parse(fd);
+ *     // Returns NULL if an error was encountered. The request lives in the
+ *     // connection's arena until the next arena_reset().
+ *     struct http_request *request = http_request_parse(fd, arena);
  *
  *     ...
  *
@@ -20,15 +21,119 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <sys/types.h>
+
+#include "arena.h"
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_FILE_CHUNK_SIZE (16 * 1024)
+#define LIBHTTP_CHUNK_COALESCE_SIZE (8 * 1024)
+
 /*
- * Functions for parsing an HTTP request.
+ * Functions for parsing an HTTP request. Everything they allocate, including
+ * the request itself, comes from ARENA.
  */
+struct http_header {
+  char *key;
+  char *value;
+};
+
 struct http_request {
   char *method;
   char *path;
+  int minor_version;            /* 0 for HTTP/1.0, 1 for HTTP/1.1. */
+  int keep_alive;               /* Client allows another request on the connection. */
+  struct http_header *headers;
+  int num_headers;
+  off_t content_length;         /* -1 if the request did not give one. */
+  int chunked;                  /* The body uses chunked transfer-coding. */
+  struct http_body *body;       /* Set while a handler may read the body. */
 };
 
-struct http_request *http_request_parse(int fd);
+struct http_request *http_request_parse(int fd, struct arena *arena);
+
+/*
+ * Parses one request head from the LENGTH bytes at BUFFER without doing any
+ * I/O. Returns the number of bytes the head occupied and stores the request
+ * in *REQUEST, 0 if BUFFER does not hold a complete head yet, or -1 if the
+ * request is malformed or longer than LIBHTTP_REQUEST_MAX_SIZE.
+ */
+int http_request_parse_buffer(char *buffer, size_t length, struct arena *arena,
+    struct http_request **request);
+
+/*
+ * Request bodies. A handler reads the body of its request as a stream, so
+ * an upload of any size passes through a bounded amount of memory: bytes
+ * that arrived with the head come out of the connection's read buffer, and
+ * the rest is read (or spliced) straight from the socket. Both
+ * Content-Length and chunked bodies are supported, and a client waiting on
+ * "Expect: 100-continue" is told to go ahead once the handler first asks
+ * for bytes that have not arrived.
+ *
+ * http_read_body() copies up to SIZE bytes into BUFFER. http_splice_body()
+ * moves up to SIZE bytes to FILE_FD at its current offset, through a pipe
+ * with splice() where the connection allows it. Both return the number of
+ * bytes, 0 at the end of the body, or -1 if it is malformed or the client
+ * went away or stalled for LIBHTTP_BODY_TIMEOUT_MS.
+ */
+#define LIBHTTP_BODY_TIMEOUT_MS 10000
+#define LIBHTTP_BODY_DRAIN_SIZE (64 * 1024)
+
+ssize_t http_read_body(struct http_request *request, char *buffer, size_t size);
+ssize_t http_splice_body(struct http_request *request, int file_fd, size_t size);
+
+/*
+ * Used by servers to hand a request's body to its handler. The body starts
+ * at BUFFER, which holds *LENGTH bytes of CAPACITY and is the connection's
+ * read buffer: FILL appends more to it without blocking, returning like
+ * read() with EAGAIN when nothing is there. RAW says the socket FD carries
+ * the body as it is (no TLS), so it can also be read from directly.
+ * Consumed body bytes are left at the front of the buffer; http_body_finish()
+ * reports how many, after draining a small unread remainder so the next
+ * request can follow. It returns -1 if the body could not be finished, in
+ * which case the connection has to be closed.
+ */
+enum http_body_state {
+  HTTP_BODY_LENGTH, HTTP_BODY_CHUNK_SIZE, HTTP_BODY_CHUNK_DATA, HTTP_BODY_CHUNK_END,
+  HTTP_BODY_TRAILERS, HTTP_BODY_DONE, HTTP_BODY_FAILED
+};
+
+struct http_body {
+  int fd;
+  char *buffer;
+  size_t *length;
+  size_t capacity;
+  size_t start;                 /* Bytes of buffer already consumed. */
+  ssize_t (*fill)(void *context);
+  void *fill_context;
+  int raw;
+  int expect_continue;          /* 100 Continue is still owed to the client. */
+  enum http_body_state state;
+  off_t remaining;              /* In the body, or in the current chunk. */
+};
+
+void http_body_init(struct http_body *body, struct http_request *request, int fd,
+    char *buffer, size_t *length, size_t capacity,
+    ssize_t (*fill)(void *context), void *fill_context, int raw);
+int http_body_finish(struct http_body *body, size_t *consumed);
+
+/* Returns the value of header KEY (case-insensitive), or NULL. */
+char *http_request_header(struct http_request *request, char *key);
+char *http_find_header(struct http_header *headers, int num_headers, char *key);
+
+/*
+ * Parses the head of a response received from an upstream server, the same
+ * way http_request_parse_buffer() parses a request head.
+ */
+struct http_response {
+  int minor_version;
+  int status_code;
+  struct http_header *headers;
+  int num_headers;
+};
+
+int http_response_parse_buffer(char *buffer, size_t length, struct arena *arena,
+    struct http_response **response);
 
 /*
  * Functions for sending an HTTP response.
@@ -38,6 +143,89 @@ void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+void http_send_file(int fd, int file_fd, off_t size);
+
+/*
+ * Functions for sending a body whose length is not known up front. Call
+ * http_start_chunked() among the headers, then http_send_chunk() as the body
+ * is produced and http_end_chunked() once it is complete. The body goes out
+ * with chunked transfer-coding, so the connection stays open afterwards.
+ * HTTP/1.0 clients get the bare body delimited by closing the connection,
+ * and HTTP/2 streams frame it themselves.
+ *
+ * Small pieces are coalesced: a chunk is only closed and written once it
+ * holds the coalescing size (or fills the output buffer), so a listing
+ * produced a line at a time costs neither a chunk header nor a write per
+ * line. http_set_chunk_coalescing() sets that size for the whole process;
+ * http_flush() closes and writes the open chunk early, for a body that should
+ * reach the client as soon as each piece exists.
+ */
+void http_start_chunked(int fd);
+void http_send_chunk(int fd, char *data, size_t size);
+void http_end_chunked(int fd);
+void http_set_chunk_coalescing(size_t size);
+
+/*
+ * Gives up on the response being sent on FD when its body cannot be
+ * completed, so the client does not take a truncated body for a whole one:
+ * the connection is closed after what was already written, or the HTTP/2
+ * stream is reset.
+ */
+void http_abort_response(int fd);
+
+/*
+ * Response buffering. While an output is attached to fd, the functions above
+ * append to its buffer instead of issuing a write per call, so the status
+ * line, headers and a small body leave in one syscall on http_flush(). A file
+ * too large for the buffer is not sent by http_send_file() but held (as a
+ * dup of its fd) and sendfile()d after the buffer on the next flush. The
+ * output also decides whether the connection survives the response: it
+ * starts from REQUEST's keep-alive flag and drops it when the response is not
+ * self-delimiting.
+ *
+ * http_output_detach() flushes. http_output_unbind() leaves the response
+ * pending in OUTPUT, so another thread can send it with http_output_send().
+ *
+ * If WRITE is set, every byte goes through it instead of the fd (files are
+ * read in chunks rather than sendfile()d); it returns the number of bytes
+ * taken or -1, like write(). TLS connections without kernel offload use it.
+ *
+ * An output with STREAM set belongs to an HTTP/2 stream (see h2.h): the
+ * status and headers are handed to the stream instead of being formatted.
+ */
+struct http_output {
+  char *buffer;
+  size_t capacity;
+  size_t length;
+  int minor_version;
+  int keep_alive;
+  int has_length;
+  int sent_connection;
+  int failed;                   /* A write failed; the connection is unusable. */
+  int has_file;                 /* file_fd holds a body to send after buffer. */
+  int file_fd;
+  off_t file_size;
+  int chunked;                  /* The body uses chunked transfer-coding. */
+  int chunk_open;               /* A chunk is being coalesced in buffer. */
+  size_t chunk_start;           /* Offset of the open chunk's size line. */
+  ssize_t (*write)(void *context, char *data, size_t size);
+  void *write_context;
+  struct h2_stream *stream;
+};
+
+void http_output_attach(int fd, struct http_output *output, struct http_request *request);
+void http_output_detach(int fd);
+void http_output_unbind(int fd);
+int http_output_send(int fd, struct http_output *output);
+int http_flush(int fd);
+
+/* Prints MESSAGE and exits; for allocations the server cannot do without. */
+void http_fatal_error(char *message);
+
+/*
+ * Helper function: gets the reason phrase for an HTTP status code.
+ */
+char *http_get_response_message(int status_code);
 
 /*
  * Helper function: gets the Content-Type based on a file name.
@@ -0,0 +1,134 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+#define RATELIMIT_STRIPES 64
+#define RATELIMIT_SETS_PER_STRIPE 64
+#define RATELIMIT_WAYS 4
+
+struct ratelimit_client {
+  in_addr_t address;
+  int in_use;
+  int connections;
+  double tokens;
+  uint64_t refilled_at;         /* Also when the client was last seen. */
+};
+
+struct ratelimit_stripe {
+  pthread_mutex_t lock;
+  struct ratelimit_client clients[RATELIMIT_SETS_PER_STRIPE][RATELIMIT_WAYS];
+} __attribute__((aligned(64)));
+
+static struct ratelimit_stripe ratelimit_stripes[RATELIMIT_STRIPES];
+static double ratelimit_rate;
+static double ratelimit_burst;
+static int ratelimit_max_connections;
+
+void ratelimit_init(double rate, double burst, int max_connections) {
+  ratelimit_rate = rate;
+  ratelimit_burst = burst > 0 ? burst : rate;
+  ratelimit_max_connections = max_connections;
+  for (int i = 0; i < RATELIMIT_STRIPES; i++) {
+    pthread_mutex_init(&ratelimit_stripes[i].lock, NULL);
+    memset(ratelimit_stripes[i].clients, 0, sizeof(ratelimit_stripes[i].clients));
+  }
+}
+
+static uint32_t ratelimit_hash(in_addr_t address) {
+  uint32_t hash = address * 0x9e3779b1u;
+  return hash ^ (hash >> 16);
+}
+
+/*
+ * Finds or claims the slot for ADDRESS in STRIPE, whose lock must be held.
+ * Returns NULL if every slot in the set belongs to a client with open
+ * connections.
+ */
+static struct ratelimit_client *ratelimit_find(struct ratelimit_stripe *stripe,
+    uint32_t hash, in_addr_t address, uint64_t now_ms) {
+  struct ratelimit_client *set = stripe->clients[(hash / RATELIMIT_STRIPES) % RATELIMIT_SETS_PER_STRIPE];
+  struct ratelimit_client *victim = NULL;
+
+  for (int way = 0; way < RATELIMIT_WAYS; way++) {
+    struct ratelimit_client *client = &set[way];
+    if (client->in_use && client->address == address)
+      return client;
+    if (!client->in_use) {
+      if (!victim || victim->in_use) victim = client;
+    } else if (client->connections == 0 && (!victim ||
+          (victim->in_use && client->refilled_at < victim->refilled_at))) {
+      victim = client;
+    }
+  }
+
+  if (victim) {
+    victim->address = address;
+    victim->in_use = 1;
+    victim->connections = 0;
+    victim->tokens = ratelimit_burst;
+    victim->refilled_at = now_ms;
+  }
+  return victim;
+}
+
+static struct ratelimit_stripe *ratelimit_lock(in_addr_t address, uint32_t *hash) {
+  *hash = ratelimit_hash(address);
+  struct ratelimit_stripe *stripe = &ratelimit_stripes[*hash % RATELIMIT_STRIPES];
+  pthread_mutex_lock(&stripe->lock);
+  return stripe;
+}
+
+int ratelimit_connection_open(in_addr_t address, uint64_t now_ms) {
+  if (ratelimit_max_connections <= 0) return 1;
+
+  uint32_t hash;
+  struct ratelimit_stripe *stripe = ratelimit_lock(address, &hash);
+  struct ratelimit_client *client = ratelimit_find(stripe, hash, address, now_ms);
+  int admitted = 1;
+  if (client) {
+    if (client->connections >= ratelimit_max_connections)
+      admitted = 0;
+    else
+      client->connections++;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return admitted;
+}
+
+void ratelimit_connection_close(in_addr_t address) {
+  if (ratelimit_max_connections <= 0) return;
+
+  uint32_t hash;
+  struct ratelimit_stripe *stripe = ratelimit_lock(address, &hash);
+  struct ratelimit_client *set = stripe->clients[(hash / RATELIMIT_STRIPES) % RATELIMIT_SETS_PER_STRIPE];
+  for (int way = 0; way < RATELIMIT_WAYS; way++) {
+    if (set[way].in_use && set[way].address == address && set[way].connections > 0) {
+      set[way].connections--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+int ratelimit_take(in_addr_t address, uint64_t now_ms) {
+  if (ratelimit_rate <= 0) return 1;
+
+  uint32_t hash;
+  struct ratelimit_stripe *stripe = ratelimit_lock(address, &hash);
+  struct ratelimit_client *client = ratelimit_find(stripe, hash, address, now_ms);
+  int admitted = 1;
+  if (client) {
+    if (now_ms > client->refilled_at) {
+      client->tokens += (now_ms - client->refilled_at) * ratelimit_rate / 1000;
+      if (client->tokens > ratelimit_burst) client->tokens = ratelimit_burst;
+      client->refilled_at = now_ms;
+    }
+    if (client->tokens >= 1)
+      client->tokens--;
+    else
+      admitted = 0;
+  }
+  pthread_mutex_unlock(&stripe->lock);
+  return admitted;
+}
@@ -0,0 +1,35 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/*
+ * Per-client admission control: a token bucket of requests and a count of
+ * open connections for each client address.
+ *
+ * Clients live in a fixed-size, lock-striped table: an address hashes to one
+ * stripe (and its mutex) and to a small set of slots within it. When a set
+ * is full the least recently seen client without open connections is
+ * evicted and starts over with a full bucket, so the table is approximate
+ * under address floods but never grows. Clients that cannot be tracked at
+ * all are admitted.
+ */
+
+/*
+ * Sets the limits: RATE requests per second with bursts of up to BURST, and
+ * at most MAX_CONNECTIONS open connections per client. Zero disables a limit.
+ */
+void ratelimit_init(double rate, double burst, int max_connections);
+
+/*
+ * Counts a new connection from ADDRESS. Returns 0 if the client is already at
+ * its connection cap, in which case nothing is counted.
+ */
+int ratelimit_connection_open(in_addr_t address, uint64_t now_ms);
+void ratelimit_connection_close(in_addr_t address);
+
+/* Takes one request token for ADDRESS. Returns 0 if the bucket is empty. */
+int ratelimit_take(in_addr_t address, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,269 @@
+#include <ctype.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+/*
+ * A compressed radix trie over route keys. A route limited to a host is
+ * keyed "host/prefix" and any other route "/prefix"; since hosts never start
+ * with '/', one trie holds both. Edges carry whole label strings, so a
+ * lookup compares a handful of labels rather than walking a node per byte,
+ * and children are kept sorted by their first byte for binary search.
+ */
+struct router_node {
+  char *label;                  /* Edge from the parent. */
+  size_t label_length;
+  struct route *route;          /* Route whose key ends here, or NULL. */
+  struct router_node **children;
+  int num_children;
+};
+
+static struct router_node router_root;
+static int router_has_hosts;
+
+static void *router_alloc(size_t size) {
+  void *pointer = calloc(1, size);
+  if (!pointer) http_fatal_error("Malloc failed");
+  return pointer;
+}
+
+static char *router_strndup(char *string, size_t length) {
+  char *copy = strndup(string, length);
+  if (!copy) http_fatal_error("Malloc failed");
+  return copy;
+}
+
+/* Returns the index of the child of NODE starting with BYTE, or where it would go. */
+static int router_child_index(struct router_node *node, char byte, int *found) {
+  int low = 0, high = node->num_children;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    char first = node->children[middle]->label[0];
+    if (first == byte) {
+      *found = 1;
+      return middle;
+    }
+    if ((unsigned char) first < (unsigned char) byte)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  *found = 0;
+  return low;
+}
+
+static void router_add_child(struct router_node *node, int index, struct router_node *child) {
+  struct router_node **children = realloc(node->children,
+      (node->num_children + 1) * sizeof(struct router_node *));
+  if (!children) http_fatal_error("Malloc failed");
+  memmove(children + index + 1, children + index,
+      (node->num_children - index) * sizeof(struct router_node *));
+  children[index] = child;
+  node->children = children;
+  node->num_children++;
+}
+
+/* Adds ROUTE under KEY. Returns -1 if KEY already has a route. */
+static int router_insert(char *key, struct route *route) {
+  struct router_node *node = &router_root;
+  while (*key) {
+    int found;
+    int index = router_child_index(node, *key, &found);
+    if (!found) {
+      struct router_node *leaf = router_alloc(sizeof(struct router_node));
+      leaf->label_length = strlen(key);
+      leaf->label = router_strndup(key, leaf->label_length);
+      leaf->route = route;
+      router_add_child(node, index, leaf);
+      return 0;
+    }
+
+    struct router_node *child = node->children[index];
+    size_t common = 0;
+    while (common < child->label_length && key[common] == child->label[common]) common++;
+    if (common < child->label_length) {
+      /* Split the edge where KEY leaves it. */
+      struct router_node *middle = router_alloc(sizeof(struct router_node));
+      middle->label = router_strndup(child->label, common);
+      middle->label_length = common;
+      char *rest = router_strndup(child->label + common, child->label_length - common);
+      free(child->label);
+      child->label = rest;
+      child->label_length -= common;
+      router_add_child(middle, 0, child);
+      node->children[index] = middle;
+      child = middle;
+    }
+    node = child;
+    key += common;
+  }
+  if (node->route) return -1;
+  node->route = route;
+  return 0;
+}
+
+/*
+ * Returns the route with the longest key that is a prefix of KEY ending on
+ * a path segment boundary, or NULL.
+ */
+static struct route *router_lookup(char *key) {
+  struct router_node *node = &router_root;
+  struct route *best = NULL;
+  size_t matched = 0;
+  while (1) {
+    if (node->route) {
+      char next = key[matched];
+      if ((matched > 0 && key[matched - 1] == '/') || next == '\0' || next == '/' || next == '?')
+        best = node->route;
+    }
+    int found;
+    int index = key[matched] ? router_child_index(node, key[matched], &found) : 0;
+    if (!key[matched] || !found) break;
+    struct router_node *child = node->children[index];
+    if (strncmp(key + matched, child->label, child->label_length) != 0) break;
+    matched += child->label_length;
+    node = child;
+  }
+  return best;
+}
+
+int router_resolve_target(char *host_port, struct route_target *target) {
+  char host[256];
+  char *colon = strrchr(host_port, ':');
+  size_t host_length = colon ? (size_t) (colon - host_port) : strlen(host_port);
+  if (host_length == 0 || host_length >= sizeof(host)) {
+    fprintf(stderr, "Invalid proxy target: %s\n", host_port);
+    return -1;
+  }
+  memcpy(host, host_port, host_length);
+  host[host_length] = '\0';
+
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int error = getaddrinfo(host, colon ? colon + 1 : "80", &hints, &result);
+  if (error != 0) {
+    fprintf(stderr, "Cannot resolve %s: %s\n", host_port, gai_strerror(error));
+    return -1;
+  }
+  memcpy(&target->address, result->ai_addr, result->ai_addrlen);
+  target->address_length = result->ai_addrlen;
+  freeaddrinfo(result);
+  return 0;
+}
+
+/*
+ * Parses one config line's fields into ROUTE. Returns -1 if they are
+ * malformed, or -2 if the proxy backend cannot be resolved (already printed).
+ */
+static int router_parse_route(char **fields, int num_fields, struct route *route) {
+  static struct {
+    char *name;
+    enum route_kind kind;
+    int has_argument;
+  } actions[] = {
+    { "files", ROUTE_FILES, 1 }, { "proxy", ROUTE_PROXY, 1 }, { "health", ROUTE_HEALTH, 0 },
+    { "stats", ROUTE_STATS, 0 }, { "redirect", ROUTE_REDIRECT, 1 }
+  };
+  for (size_t i = 0; i < sizeof(actions) / sizeof(actions[0]); i++) {
+    if (strcmp(fields[1], actions[i].name) != 0) continue;
+    if (num_fields != 2 + actions[i].has_argument) return -1;
+    route->kind = actions[i].kind;
+    switch (route->kind) {
+      case ROUTE_FILES:
+        route->root = router_strndup(fields[2], strlen(fields[2]));
+        return 0;
+      case ROUTE_PROXY:
+        return router_resolve_target(fields[2], &route->target) < 0 ? -2 : 0;
+      case ROUTE_REDIRECT:
+        route->location = router_strndup(fields[2], strlen(fields[2]));
+        return 0;
+      default:
+        return 0;
+    }
+  }
+  return -1;
+}
+
+int router_load(char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+
+  char line[1024];
+  int line_number = 0, num_routes = 0;
+  while (fgets(line, sizeof(line), file)) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+
+    char *fields[4], *saved;
+    int num_fields = 0;
+    for (char *field = strtok_r(line, " \t\r\n", &saved); field;
+        field = strtok_r(NULL, " \t\r\n", &saved))
+      if (num_fields++ < 4) fields[num_fields - 1] = field;
+    if (num_fields == 0) continue;
+
+    struct route *route = router_alloc(sizeof(struct route));
+    char *slash = num_fields >= 2 ? strchr(fields[0], '/') : NULL;
+    int status = slash && num_fields <= 3 ? router_parse_route(fields, num_fields, route) : -1;
+    if (status < 0) {
+      if (status == -1)
+        fprintf(stderr, "%s:%d: expected \"[HOST]/PREFIX ACTION [ARGUMENT]\"\n", path,
+            line_number);
+      else
+        fprintf(stderr, "%s:%d: bad proxy backend\n", path, line_number);
+      fclose(file);
+      return -1;
+    }
+
+    /* Hosts compare case-insensitively, so they are keyed in lowercase. */
+    for (char *c = fields[0]; c < slash; c++) *c = tolower((unsigned char) *c);
+    if (slash > fields[0]) router_has_hosts = 1;
+    route->prefix = router_strndup(slash, strlen(slash));
+    route->prefix_length = strlen(slash);
+    if (router_insert(fields[0], route) < 0) {
+      fprintf(stderr, "%s:%d: duplicate route %s\n", path, line_number, fields[0]);
+      fclose(file);
+      return -1;
+    }
+    num_routes++;
+  }
+  fclose(file);
+
+  if (num_routes == 0) {
+    fprintf(stderr, "%s: no routes\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+struct route *router_match(struct http_request *request) {
+  char key[LIBHTTP_REQUEST_MAX_SIZE + 256];
+  size_t path_length = strlen(request->path);
+  if (request->path[0] != '/' || path_length >= LIBHTTP_REQUEST_MAX_SIZE) return NULL;
+
+  char *host = router_has_hosts ? http_request_header(request, "Host") : NULL;
+  if (host) {
+    size_t host_length = strcspn(host, ":");
+    if (host_length > 0 && host_length < 256) {
+      for (size_t i = 0; i < host_length; i++) key[i] = tolower((unsigned char) host[i]);
+      memcpy(key + host_length, request->path, path_length + 1);
+      struct route *route = router_lookup(key);
+      if (route) return route;
+    }
+  }
+  return router_lookup(request->path);
+}
+
+char *router_local_path(struct route *route, char *path) {
+  size_t skip = route->prefix_length;
+  if (route->prefix[skip - 1] == '/') skip--;
+  return path[skip] ? path + skip : "/";
+}
@@ -0,0 +1,75 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#include "libhttp.h"
+
+/*
+ * Routes requests by host and path prefix (--config), so one server can
+ * serve static roots, front proxy backends and answer built-in endpoints
+ * side by side.
+ *
+ * The config file has one route per line; blank lines and text after '#'
+ * are ignored:
+ *
+ *   # route                 action     argument
+ *   /                       files      /srv/www
+ *   /static/                files      /srv/static
+ *   /api/                   proxy      127.0.0.1:9000
+ *   /healthz                health
+ *   /server-stats           stats
+ *   /old/                   redirect   /new/
+ *   docs.example.com/       files      /srv/docs
+ *
+ * A route is a path prefix, optionally preceded by the host it is limited
+ * to. A request takes the longest matching prefix, preferring routes for
+ * its Host, and a prefix only matches whole path segments: /healthz matches
+ * /healthz and /healthz/ready but not /healthzz. A files route serves the
+ * rest of the path under its root, so /static/app.css above is
+ * /srv/static/app.css; a proxy route forwards the path unchanged.
+ *
+ * Routes are compiled into a radix trie once at startup and never change
+ * afterwards, so lookups take no locks.
+ */
+
+enum route_kind {
+  ROUTE_FILES,
+  ROUTE_PROXY,
+  ROUTE_HEALTH,
+  ROUTE_STATS,
+  ROUTE_REDIRECT
+};
+
+/* A resolved proxy backend. */
+struct route_target {
+  struct sockaddr_storage address;
+  socklen_t address_length;
+};
+
+struct route {
+  enum route_kind kind;
+  char *prefix;                 /* Path part of the route. */
+  size_t prefix_length;
+  char *root;                   /* ROUTE_FILES */
+  struct route_target target;   /* ROUTE_PROXY */
+  char *location;               /* ROUTE_REDIRECT */
+};
+
+/*
+ * Resolves HOST_PORT ("host:port", port 80 if omitted) into TARGET. Prints
+ * the reason and returns -1 if it cannot be resolved.
+ */
+int router_resolve_target(char *host_port, struct route_target *target);
+
+/* Reads the routes in PATH. Prints the offending line and returns -1 on error. */
+int router_load(char *path);
+
+/* Returns the route for REQUEST, or NULL if none matches. */
+struct route *router_match(struct http_request *request);
+
+/* Returns the part of PATH below ROUTE's prefix, as an absolute path. */
+char *router_local_path(struct route *route, char *path);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* Furthest a timer can be scheduled, in ticks; later deadlines are clamped. */
+#define TIMER_WHEEL_MAX_DELTA (((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static void timer_list_init(struct timer *head) {
+  head->next = head->prev = head;
+}
+
+static void timer_list_append(struct timer *head, struct timer *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+static void timer_list_unlink(struct timer *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms) {
+  wheel->now = now_ms / TIMER_WHEEL_TICK_MS;
+  wheel->count = 0;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+      timer_list_init(&wheel->slots[level][slot]);
+}
+
+/* Files TIMER in the slot of the innermost wheel whose range covers it. */
+static void timer_wheel_insert(struct timer_wheel *wheel, struct timer *timer) {
+  uint64_t delta = timer->expires - wheel->now;
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+      delta >= (uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)))
+    level++;
+  int slot = (timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  timer_list_append(&wheel->slots[level][slot], timer);
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms) {
+  if (timer_pending(timer))
+    timer_cancel(wheel, timer);
+
+  uint64_t expires = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  if (expires <= wheel->now)
+    expires = wheel->now + 1;
+  else if (expires - wheel->now > TIMER_WHEEL_MAX_DELTA)
+    expires = wheel->now + TIMER_WHEEL_MAX_DELTA;
+  timer->expires = expires;
+
+  timer_wheel_insert(wheel, timer);
+  wheel->count++;
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+  if (!timer_pending(timer)) return;
+  timer_list_unlink(timer);
+  wheel->count--;
+}
+
+/* Redistributes the slot of LEVEL that TICK has reached into inner wheels. */
+static void timer_wheel_cascade(struct timer_wheel *wheel, int level, uint64_t tick) {
+  struct timer *head = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+  struct timer pending;
+  if (head->next == head) return;
+
+  /* Detach the whole slot first: re-inserted timers may land back in it. */
+  pending.next = head->next;
+  pending.prev = head->prev;
+  pending.next->prev = pending.prev->next = &pending;
+  timer_list_init(head);
+
+  while (pending.next != &pending) {
+    struct timer *timer = pending.next;
+    timer_list_unlink(timer);
+    timer_wheel_insert(wheel, timer);
+  }
+}
+
+struct timer *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms) {
+  uint64_t target = now_ms / TIMER_WHEEL_TICK_MS;
+  struct timer *expired = NULL, **tail = &expired;
+
+  while (wheel->now < target) {
+    if (wheel->count == 0) {
+      wheel->now = target;
+      break;
+    }
+    uint64_t tick = ++wheel->now;
+
+    /* Cascade outer wheels whose slot boundary this tick crosses. */
+    int level = 1;
+    while (level < TIMER_WHEEL_LEVELS &&
+        (tick & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+      level++;
+    while (--level > 0)
+      timer_wheel_cascade(wheel, level, tick);
+
+    struct timer *head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+    while (head->next != head) {
+      struct timer *timer = head->next;
+      timer_list_unlink(timer);
+      wheel->count--;
+      *tail = timer;
+      tail = &timer->next;
+    }
+  }
+
+  *tail = NULL;
+  return expired;
+}
+
+struct timer *timer_wheel_take_all(struct timer_wheel *wheel) {
+  struct timer *taken = NULL;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      struct timer *head = &wheel->slots[level][slot];
+      while (head->next != head) {
+        struct timer *timer = head->next;
+        timer_list_unlink(timer);
+        timer->next = taken;
+        taken = timer;
+      }
+    }
+  }
+  wheel->count = 0;
+  return taken;
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timing wheel.
+ *
+ * Timers are intrusive list nodes hashed into one of TIMER_WHEEL_LEVELS
+ * wheels of TIMER_WHEEL_SLOTS slots each, by how far away they expire: the
+ * first wheel has one slot per tick, the next one slot per full turn of the
+ * first, and so on. Adding and cancelling a timer is O(1). Advancing the
+ * wheel only visits the slots that came due, moving timers from an outer
+ * wheel down a level when its slot comes round, so the cost of reaping never
+ * depends on how many timers are pending.
+ *
+ * Times are milliseconds on any monotonic clock; they are rounded up to
+ * TIMER_WHEEL_TICK_MS. The wheel does no locking.
+ */
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer {
+  struct timer *next;
+  struct timer *prev;           /* NULL while the timer is not pending. */
+  uint64_t expires;             /* In ticks. */
+};
+
+struct timer_wheel {
+  uint64_t now;                 /* Last tick processed. */
+  int count;
+  struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  /* List heads. */
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ms);
+
+/*
+ * Arms TIMER to expire at EXPIRES_MS, re-arming it if it is already pending.
+ * A deadline in the past expires on the next tick.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires_ms);
+
+/* Disarms TIMER if it is pending. */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+static inline int timer_pending(struct timer *timer) {
+  return timer->prev != NULL;
+}
+
+/*
+ * Advances WHEEL to NOW_MS and returns the timers that expired on the way as
+ * a list linked through next. Returned timers are no longer pending.
+ */
+struct timer *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ms);
+
+/* Disarms and returns every pending timer, linked through next. */
+struct timer *timer_wheel_take_all(struct timer_wheel *wheel);
+
+#endif
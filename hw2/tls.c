@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "tls.h"
+
+/* Sessions kept in the server-side cache (TLS 1.2 session IDs). */
+#define TLS_SESSION_CACHE_SIZE 20000
+
+/* Ciphertext read from the socket at a time. */
+#define TLS_READ_CHUNK_SIZE (16 * 1024 + 512)
+
+struct tls {
+  SSL *ssl;
+  BIO *rbio;                    /* Memory BIO we fill from the socket. */
+  int fd;
+};
+
+static SSL_CTX *tls_context;
+
+static void tls_print_errors(const char *message) {
+  fprintf(stderr, "%s\n", message);
+  ERR_print_errors_fp(stderr);
+}
+
+static int tls_load_ticket_keys(char *ticket_key_file) {
+  unsigned char keys[TLS_TICKET_KEY_SIZE];
+  FILE *file = fopen(ticket_key_file, "rb");
+  if (!file) {
+    perror("Failed to open TLS ticket key file");
+    return -1;
+  }
+  size_t length = fread(keys, 1, sizeof(keys), file);
+  fclose(file);
+  if (length != sizeof(keys)) {
+    fprintf(stderr, "TLS ticket key file must hold %d bytes\n", TLS_TICKET_KEY_SIZE);
+    return -1;
+  }
+  if (SSL_CTX_set_tlsext_ticket_keys(tls_context, keys, sizeof(keys)) != 1) {
+    tls_print_errors("Failed to set TLS ticket keys");
+    return -1;
+  }
+  return 0;
+}
+
+/* Picks HTTP/2 when the client offers it, else HTTP/1.1. */
+static int tls_select_alpn(SSL *ssl, const unsigned char **selected,
+    unsigned char *selected_length, const unsigned char *offered,
+    unsigned int offered_length, void *unused) {
+  static const unsigned char supported[] = "\x02h2\x08http/1.1";
+  if (SSL_select_next_proto((unsigned char **) selected, selected_length, supported,
+        sizeof(supported) - 1, offered, offered_length) != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(char *cert_file, char *key_file, char *ticket_key_file) {
+  tls_context = SSL_CTX_new(TLS_server_method());
+  if (!tls_context) {
+    tls_print_errors("Failed to create TLS context");
+    return -1;
+  }
+  SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+  SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+  SSL_CTX_set_mode(tls_context, SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(tls_context, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_session_id_context(tls_context, (unsigned char *) "httpserver", 10);
+  SSL_CTX_set_alpn_select_cb(tls_context, tls_select_alpn, NULL);
+
+  if (SSL_CTX_use_certificate_chain_file(tls_context, cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(tls_context, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(tls_context) != 1) {
+    tls_print_errors("Failed to load TLS certificate or key");
+    return -1;
+  }
+  if (ticket_key_file && tls_load_ticket_keys(ticket_key_file) < 0)
+    return -1;
+  return 0;
+}
+
+struct tls *tls_new(int fd) {
+  struct tls *tls = malloc(sizeof(struct tls));
+  if (!tls) return NULL;
+  tls->fd = fd;
+  tls->ssl = SSL_new(tls_context);
+  tls->rbio = BIO_new(BIO_s_mem());
+  BIO *wbio = BIO_new_socket(fd, BIO_NOCLOSE);
+  if (!tls->ssl || !tls->rbio || !wbio) {
+    SSL_free(tls->ssl);
+    BIO_free(tls->rbio);
+    BIO_free(wbio);
+    free(tls);
+    return NULL;
+  }
+  /* Reads come from memory; writes (and kTLS) use the socket itself. */
+  BIO_set_mem_eof_return(tls->rbio, -1);
+  SSL_set_bio(tls->ssl, tls->rbio, wbio);
+  SSL_set_accept_state(tls->ssl);
+  return tls;
+}
+
+ssize_t tls_read(struct tls *tls, char *buffer, size_t size) {
+  char ciphertext[TLS_READ_CHUNK_SIZE];
+
+  while (1) {
+    ERR_clear_error();
+    int bytes_read = SSL_read(tls->ssl, buffer, size);
+    if (bytes_read > 0) return bytes_read;
+
+    switch (SSL_get_error(tls->ssl, bytes_read)) {
+      case SSL_ERROR_ZERO_RETURN:
+        return 0;
+      case SSL_ERROR_WANT_READ:
+        break;
+      default:
+        errno = EIO;
+        return -1;
+    }
+
+    /* OpenSSL has used up everything we gave it; fetch more. */
+    ssize_t received = recv(tls->fd, ciphertext, sizeof(ciphertext), MSG_DONTWAIT);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return received;
+    BIO_write(tls->rbio, ciphertext, received);
+  }
+}
+
+ssize_t tls_write(void *void_tls, char *data, size_t size) {
+  struct tls *tls = void_tls;
+  if (size == 0) return 0;
+  ERR_clear_error();
+  int bytes_written = SSL_write(tls->ssl, data, size > INT_MAX ? INT_MAX : (int) size);
+  return bytes_written > 0 ? bytes_written : -1;
+}
+
+int tls_kernel_send(struct tls *tls) {
+  return BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+}
+
+void tls_free(struct tls *tls) {
+  if (SSL_is_init_finished(tls->ssl)) SSL_shutdown(tls->ssl);
+  SSL_free(tls->ssl);
+  free(tls);
+}
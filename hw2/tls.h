@@ -0,0 +1,55 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+/*
+ * TLS termination for client connections, on top of OpenSSL.
+ *
+ * Ciphertext is read by the caller's non-blocking recv and fed to OpenSSL
+ * through a memory BIO, so a TLS connection parks and wakes exactly like a
+ * plaintext one while its handshake or a request is incomplete. Writes go
+ * straight to the (blocking) socket. Where the kernel supports it, the
+ * send direction is handed to kernel TLS after the handshake; plain
+ * write()/writev()/sendfile() on the socket are then encrypted by the
+ * kernel, so static files stay zero-copy over HTTPS.
+ *
+ * Session resumption is supported with tickets and a server-side session
+ * cache. Ticket keys are random per process unless a key file is given, in
+ * which case every server sharing the file (including an upgraded binary)
+ * accepts the others' tickets.
+ *
+ * ALPN offers "h2" ahead of "http/1.1"; a client that picks it opens with
+ * the HTTP/2 preface, which the server detects as it does for cleartext.
+ */
+
+struct tls;
+
+/*
+ * Loads the certificate chain and private key and sets up the shared
+ * context. TICKET_KEY_FILE may be NULL; otherwise it must hold
+ * TLS_TICKET_KEY_SIZE bytes. Returns -1 after printing an error.
+ */
+#define TLS_TICKET_KEY_SIZE 80
+int tls_init(char *cert_file, char *key_file, char *ticket_key_file);
+
+/* Starts a server-side TLS session on the accepted socket FD. */
+struct tls *tls_new(int fd);
+
+/*
+ * Reads decrypted bytes without blocking, driving the handshake as needed.
+ * Returns like recv(): the number of bytes, 0 at end of stream, or -1 with
+ * errno set (EAGAIN when more ciphertext is needed, EIO on TLS errors).
+ */
+ssize_t tls_read(struct tls *tls, char *buffer, size_t size);
+
+/* Encrypts and writes DATA (blocking). A struct http_output write hook. */
+ssize_t tls_write(void *tls, char *data, size_t size);
+
+/* Returns whether the kernel encrypts what is written to the socket. */
+int tls_kernel_send(struct tls *tls);
+
+/* Sends close_notify if possible and frees the session. */
+void tls_free(struct tls *tls);
+
+#endif
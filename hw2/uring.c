@@ -0,0 +1,701 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "files.h"
+#include "libhttp.h"
+#include "timer.h"
+#include "uring.h"
+#include "utlist.h"
+
+#define URING_ENTRIES 1024
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE 4096
+#define URING_SPLICE_CHUNK (64 * 1024)
+#define URING_ARENA_BLOCK_SIZE 1024
+
+/* Operation tags, stored in the low bits of each SQE's user_data. */
+enum uring_op {
+  URING_OP_ACCEPT,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_SPLICE_IN,
+  URING_OP_SPLICE_OUT,
+  URING_OP_CANCEL,
+  URING_OP_TICK
+};
+#define URING_OP_MASK 7
+
+struct uring {
+  int ring_fd;
+  unsigned sqe_tail;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* Provided buffer ring that receives are completed into. */
+  struct io_uring_buf_ring *buffer_ring;
+  char *buffers;
+  unsigned short buffer_tail;
+};
+
+struct uring_conn {
+  int fd;
+  int pending;        /* SQEs in flight for this connection. */
+  int failed;
+  int receiving;      /* A receive is in flight. */
+  struct uring_conn *prev;
+  struct uring_conn *next;
+
+  /* Read, idle or write deadline; see uring_conn_wait(). */
+  struct timer timer;
+  uint64_t request_started;   /* First byte of the request being read. */
+  int requests_served;
+
+  char request[LIBHTTP_REQUEST_MAX_SIZE];  /* Unparsed bytes, including pipelined requests. */
+  size_t request_length;
+  size_t head_length;   /* Bytes of request taken by the head being answered. */
+  struct arena arena;   /* Owns the parsed request. */
+  int minor_version;
+  int keep_alive;       /* Another request may follow this response. */
+  int overflowed;       /* Bytes were dropped, so no request may follow. */
+
+  char header[512];
+  char *response;     /* Either header or a malloc'ed header + body. */
+  size_t response_length;
+  size_t response_offset;
+
+  int file_fd;
+  off_t file_offset;
+  off_t file_size;
+  int pipe_fds[2];
+  size_t pipe_bytes;
+};
+
+static char *uring_files_directory;
+static struct uring_conn *uring_conns;
+static int uring_live_conns;
+static int uring_draining;
+
+/* Deadlines of every connection, advanced by a tick of IORING_OP_TIMEOUT. */
+static struct timer_wheel uring_timers;
+static struct __kernel_timespec uring_tick = { 0, TIMER_WHEEL_TICK_MS * 1000000LL };
+static uint64_t uring_now;
+
+/* Signal mask while waiting for completions: nothing blocked. */
+static sigset_t uring_wait_mask;
+
+static int uring_setup(struct uring *ring) {
+  struct io_uring_params params;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring->ring_fd < 0 && errno == EINVAL) {
+    /* Older kernels: none of the task-run optimisations. */
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  }
+  if (ring->ring_fd < 0) {
+    perror("io_uring_setup");
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP)) {
+    fprintf(stderr, "io_uring: kernel is too old for this engine\n");
+    close(ring->ring_fd);
+    return -1;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+  char *ring_memory = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+  if (ring_memory == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    perror("io_uring mmap");
+    close(ring->ring_fd);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *) (ring_memory + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (ring_memory + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (ring_memory + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned *) (ring_memory + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (ring_memory + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (ring_memory + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (ring_memory + params.cq_off.cqes);
+  ring->sqe_tail = *ring->sq_tail;
+
+  /* SQE slots are always submitted in order, so the index array is fixed. */
+  unsigned *sq_array = (unsigned *) (ring_memory + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    sq_array[i] = i;
+
+  return 0;
+}
+
+static void uring_buffer_return(struct uring *ring, unsigned short bid) {
+  struct io_uring_buf *buffer =
+      &ring->buffer_ring->bufs[ring->buffer_tail & (URING_BUFFER_COUNT - 1)];
+  buffer->addr = (uintptr_t) (ring->buffers + (size_t) bid * URING_BUFFER_SIZE);
+  buffer->len = URING_BUFFER_SIZE;
+  buffer->bid = bid;
+  ring->buffer_tail++;
+  __atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup_buffers(struct uring *ring) {
+  ring->buffer_ring = mmap(NULL, URING_BUFFER_COUNT * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->buffers = malloc((size_t) URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+  if (ring->buffer_ring == MAP_FAILED || !ring->buffers) {
+    fprintf(stderr, "io_uring: failed to allocate receive buffers\n");
+    return -1;
+  }
+
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (uintptr_t) ring->buffer_ring;
+  registration.ring_entries = URING_BUFFER_COUNT;
+  registration.bgid = URING_BUFFER_GROUP;
+  if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING,
+        &registration, 1) < 0) {
+    perror("io_uring: failed to register buffer ring");
+    return -1;
+  }
+
+  ring->buffer_tail = 0;
+  for (unsigned short bid = 0; bid < URING_BUFFER_COUNT; bid++)
+    uring_buffer_return(ring, bid);
+  return 0;
+}
+
+/* Hands every queued SQE to the kernel and optionally waits for completions. */
+static int uring_submit(struct uring *ring, unsigned wait_for) {
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned flags = wait_for ? IORING_ENTER_GETEVENTS : 0;
+  if (to_submit == 0 && wait_for == 0) return 0;
+  int ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_for, flags,
+      wait_for ? &uring_wait_mask : NULL, _NSIG / 8);
+  if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    perror("io_uring_enter");
+    return -1;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    uring_submit(ring, 0);
+  if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+    fprintf(stderr, "io_uring: submission queue overflow\n");
+    exit(ENOBUFS);
+  }
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_set_data(struct io_uring_sqe *sqe, struct uring_conn *conn, enum uring_op op) {
+  sqe->user_data = (uintptr_t) conn | op;
+  if (conn) conn->pending++;
+}
+
+static void uring_prep_accept(struct uring *ring, int server_socket) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = server_socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  uring_set_data(sqe, NULL, URING_OP_ACCEPT);
+}
+
+/* Cancels the multishot accept, whose user_data is always 0. */
+static void uring_prep_cancel_accept(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = URING_OP_ACCEPT;
+  uring_set_data(sqe, NULL, URING_OP_CANCEL);
+}
+
+/* Wakes the engine once a tick, with a URING_OP_TICK completion. */
+static void uring_prep_tick(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t) &uring_tick;
+  sqe->len = 1;
+  uring_set_data(sqe, NULL, URING_OP_TICK);
+}
+
+static void uring_prep_recv(struct uring *ring, struct uring_conn *conn) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->len = URING_BUFFER_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  uring_set_data(sqe, conn, URING_OP_RECV);
+  conn->receiving = 1;
+}
+
+/*
+ * Sets CONN's deadline before it waits for the client: a request head must
+ * be complete CONNECTION_REQUEST_TIMEOUT_MS after its first byte (or after
+ * accept, for a connection that has sent nothing yet), and a connection
+ * between requests may idle for CONNECTION_IDLE_TIMEOUT_MS. The same rules
+ * as connection_deadline() in the thread pool.
+ */
+static void uring_conn_wait(struct uring_conn *conn) {
+  uint64_t deadline = uring_now + CONNECTION_IDLE_TIMEOUT_MS;
+  if (conn->request_length > 0 || conn->requests_served == 0)
+    deadline = conn->request_started + CONNECTION_REQUEST_TIMEOUT_MS;
+  timer_add(&uring_timers, &conn->timer, deadline);
+}
+
+/* Gives CONN another CONNECTION_WRITE_TIMEOUT_MS to make progress on its response. */
+static void uring_conn_writing(struct uring_conn *conn) {
+  timer_add(&uring_timers, &conn->timer, uring_now + CONNECTION_WRITE_TIMEOUT_MS);
+}
+
+/* A linked send must go out whole, or what follows it would overtake the rest. */
+static void uring_prep_send(struct uring *ring, struct uring_conn *conn, int link) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = conn->fd;
+  sqe->addr = (uintptr_t) (conn->response + conn->response_offset);
+  sqe->len = conn->response_length - conn->response_offset;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  if (link) {
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->msg_flags |= MSG_WAITALL;
+  }
+  uring_set_data(sqe, conn, URING_OP_SEND);
+}
+
+static void uring_prep_splice(struct uring *ring, struct uring_conn *conn, enum uring_op op,
+    int fd_in, int64_t off_in, int fd_out, unsigned length, int link) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_off_in = off_in;
+  sqe->fd = fd_out;
+  sqe->off = (uint64_t) -1;
+  sqe->len = length;
+  sqe->splice_flags = SPLICE_F_MOVE;
+  if (link) sqe->flags = IOSQE_IO_LINK;
+  uring_set_data(sqe, conn, op);
+}
+
+static void uring_conn_close(struct uring_conn *conn) {
+  if (conn->file_fd >= 0) close(conn->file_fd);
+  if (conn->pipe_fds[0] >= 0) close(conn->pipe_fds[0]);
+  if (conn->pipe_fds[1] >= 0) close(conn->pipe_fds[1]);
+  if (conn->response && conn->response != conn->header) free(conn->response);
+  arena_destroy(&conn->arena);
+  timer_cancel(&uring_timers, &conn->timer);
+  close(conn->fd);
+  DL_DELETE(uring_conns, conn);
+  free(conn);
+  uring_live_conns--;
+}
+
+static void uring_conn_next(struct uring *ring, struct uring_conn *conn);
+
+/* Opens the pipe file bodies are spliced through, unless CONN has one. */
+static int uring_conn_pipe(struct uring_conn *conn) {
+  if (conn->pipe_fds[0] >= 0) return 0;
+  if (pipe2(conn->pipe_fds, O_CLOEXEC) < 0) return -1;
+  fcntl(conn->pipe_fds[1], F_SETPIPE_SZ, URING_SPLICE_CHUNK);
+  return 0;
+}
+
+/*
+ * Queues the next step of the file body: drain whatever is still sitting in
+ * the pipe, or move another chunk file -> pipe -> socket with a linked pair.
+ */
+static void uring_conn_splice(struct uring *ring, struct uring_conn *conn) {
+  if (conn->pipe_bytes > 0) {
+    uring_prep_splice(ring, conn, URING_OP_SPLICE_OUT, conn->pipe_fds[0], -1,
+        conn->fd, conn->pipe_bytes, 0);
+    return;
+  }
+  if (conn->file_offset >= conn->file_size) {
+    uring_conn_next(ring, conn);
+    return;
+  }
+  if (uring_conn_pipe(conn) < 0) {
+    uring_conn_close(conn);
+    return;
+  }
+  off_t remaining = conn->file_size - conn->file_offset;
+  unsigned chunk = remaining < URING_SPLICE_CHUNK ? remaining : URING_SPLICE_CHUNK;
+  uring_prep_splice(ring, conn, URING_OP_SPLICE_IN, conn->file_fd, conn->file_offset,
+      conn->pipe_fds[1], chunk, 1);
+  uring_prep_splice(ring, conn, URING_OP_SPLICE_OUT, conn->pipe_fds[0], -1,
+      conn->fd, chunk, 0);
+}
+
+/*
+ * Writes the response head into conn->header and returns its length. The
+ * Connection header follows the same rules as http_end_headers().
+ */
+static int uring_conn_head(struct uring_conn *conn, int status_code, char *content_type,
+    long long content_length) {
+  char *connection = "";
+  if (conn->keep_alive && conn->minor_version == 0)
+    connection = "Connection: keep-alive\r\n";
+  else if (!conn->keep_alive && conn->minor_version >= 1)
+    connection = "Connection: close\r\n";
+  return snprintf(conn->header, sizeof(conn->header),
+      "HTTP/1.%d %d %s\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%s\r\n",
+      conn->minor_version, status_code, http_get_response_message(status_code),
+      content_type, content_length, connection);
+}
+
+static void uring_conn_respond_string(struct uring *ring, struct uring_conn *conn,
+    int status_code, char *body) {
+  int header_length = uring_conn_head(conn, status_code, "text/html", strlen(body));
+  conn->response_length = header_length + snprintf(conn->header + header_length,
+      sizeof(conn->header) - header_length, "%s", body);
+  conn->response = conn->header;
+  uring_prep_send(ring, conn, 0);
+}
+
+/* Builds the response for REQUEST. */
+static void uring_conn_respond(struct uring *ring, struct uring_conn *conn,
+    struct http_request *request) {
+  conn->minor_version = request->minor_version;
+  /* Request bodies are never read here, so a request with one ends the connection. */
+  conn->keep_alive = request->keep_alive && !uring_draining && !conn->overflowed &&
+      request->content_length <= 0 && !request->chunked;
+
+  struct files_entry entry;
+  switch (files_lookup(uring_files_directory, request->path, &entry)) {
+    case FILES_REGULAR:
+      conn->file_fd = entry.fd;
+      conn->file_size = entry.size;
+      conn->response_length = uring_conn_head(conn, 200, entry.mime_type, entry.size);
+      conn->response = conn->header;
+      /* The head is linked ahead of the first chunk of the body: one submission for both. */
+      if (entry.size > 0 && uring_conn_pipe(conn) == 0) {
+        uring_prep_send(ring, conn, 1);
+        uring_conn_splice(ring, conn);
+      } else {
+        uring_prep_send(ring, conn, 0);
+      }
+      break;
+
+    case FILES_DIRECTORY: {
+      size_t body_length;
+      char *body = files_render_listing(&entry, request->path, &body_length);
+      int header_length = uring_conn_head(conn, 200, "text/html", body_length);
+      conn->response = body ? malloc(header_length + body_length) : NULL;
+      if (!conn->response) {
+        free(body);
+        conn->keep_alive = 0;
+        uring_conn_respond_string(ring, conn, 500, "");
+        break;
+      }
+      memcpy(conn->response, conn->header, header_length);
+      memcpy(conn->response + header_length, body, body_length);
+      conn->response_length = header_length + body_length;
+      free(body);
+      uring_prep_send(ring, conn, 0);
+      break;
+    }
+
+    default:
+      uring_conn_respond_string(ring, conn, 404, "<center><h1>404 Not Found</h1></center>");
+      break;
+  }
+}
+
+/* Answers the request at the start of conn->request, or receives more of it. */
+static void uring_conn_process(struct uring *ring, struct uring_conn *conn) {
+  struct http_request *request;
+  int parsed = http_request_parse_buffer(conn->request, conn->request_length,
+      &conn->arena, &request);
+  if (parsed > 0) {
+    conn->head_length = parsed;
+    uring_conn_writing(conn);
+    uring_conn_respond(ring, conn, request);
+  } else if (parsed < 0) {
+    conn->minor_version = 1;
+    conn->keep_alive = 0;
+    uring_conn_writing(conn);
+    uring_conn_respond_string(ring, conn, 400, "<center><h1>400 Bad Request</h1></center>");
+  } else {
+    uring_conn_wait(conn);
+    uring_prep_recv(ring, conn);
+  }
+}
+
+/*
+ * Called once a response has gone out in full. Closes CONN unless it may
+ * carry another request; otherwise answers the next pipelined request, or
+ * waits for one.
+ */
+static void uring_conn_next(struct uring *ring, struct uring_conn *conn) {
+  if (!conn->keep_alive || uring_draining) {
+    uring_conn_close(conn);
+    return;
+  }
+  if (conn->file_fd >= 0) close(conn->file_fd);
+  if (conn->response != conn->header) free(conn->response);
+  conn->file_fd = -1;
+  conn->file_offset = conn->file_size = 0;
+  conn->response = NULL;
+  conn->response_length = conn->response_offset = 0;
+
+  conn->request_length -= conn->head_length;
+  memmove(conn->request, conn->request + conn->head_length, conn->request_length);
+  conn->head_length = 0;
+  conn->request_started = uring_now;
+  conn->requests_served++;
+  arena_reset(&conn->arena);
+  uring_conn_process(ring, conn);
+}
+
+/*
+ * Closes the connections waiting for a request once the engine starts to
+ * drain; the rest close after their current response. Shutting down the
+ * read side completes their receives with end of stream.
+ */
+static void uring_drain_idle() {
+  struct uring_conn *conn;
+  DL_FOREACH(uring_conns, conn) {
+    if (conn->receiving && conn->request_length == 0)
+      shutdown(conn->fd, SHUT_RD);
+  }
+}
+
+static void uring_handle_accept(struct uring *ring, struct io_uring_cqe *cqe,
+    int server_socket) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    if (cqe->res == -EINVAL) {
+      fprintf(stderr, "io_uring: multishot accept is not supported by this kernel\n");
+      exit(EXIT_FAILURE);
+    }
+    if (!uring_draining) uring_prep_accept(ring, server_socket);
+  }
+  if (cqe->res == -ECANCELED) return;
+  if (cqe->res < 0) {
+    errno = -cqe->res;
+    perror("Error accepting socket");
+    return;
+  }
+
+  struct uring_conn *conn = malloc(sizeof(struct uring_conn));
+  if (!conn) {
+    close(cqe->res);
+    return;
+  }
+  uring_live_conns++;
+  conn->fd = cqe->res;
+  /* The head and the body go out in separate sends. */
+  int socket_option = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &socket_option, sizeof(socket_option));
+  conn->pending = 0;
+  conn->failed = 0;
+  conn->receiving = 0;
+  conn->request_length = conn->head_length = 0;
+  conn->minor_version = 0;
+  conn->keep_alive = conn->overflowed = 0;
+  conn->timer.next = conn->timer.prev = NULL;
+  conn->request_started = uring_now;
+  conn->requests_served = 0;
+  arena_init(&conn->arena, URING_ARENA_BLOCK_SIZE);
+  conn->response = NULL;
+  conn->response_length = conn->response_offset = 0;
+  conn->file_fd = -1;
+  conn->file_offset = conn->file_size = 0;
+  conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+  conn->pipe_bytes = 0;
+  DL_APPEND(uring_conns, conn);
+  uring_conn_wait(conn);
+  uring_prep_recv(ring, conn);
+}
+
+static void uring_handle_recv(struct uring *ring, struct uring_conn *conn,
+    struct io_uring_cqe *cqe) {
+  conn->receiving = 0;
+  if (cqe->res == -ENOBUFS) {
+    /* Every buffer is momentarily in use; try again on the next batch. */
+    uring_prep_recv(ring, conn);
+    return;
+  }
+  if (cqe->res <= 0) {
+    uring_conn_close(conn);
+    return;
+  }
+
+  unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  size_t available = LIBHTTP_REQUEST_MAX_SIZE - conn->request_length;
+  size_t length = (size_t) cqe->res < available ? (size_t) cqe->res : available;
+  if (conn->request_length == 0) conn->request_started = uring_now;
+  memcpy(conn->request + conn->request_length,
+      ring->buffers + (size_t) bid * URING_BUFFER_SIZE, length);
+  conn->request_length += length;
+  if (length < (size_t) cqe->res) conn->overflowed = 1;
+  uring_buffer_return(ring, bid);
+  uring_conn_process(ring, conn);
+}
+
+static void uring_handle_send(struct uring *ring, struct uring_conn *conn,
+    struct io_uring_cqe *cqe) {
+  if (cqe->res < 0) {
+    conn->failed = 1;
+  } else {
+    conn->response_offset += cqe->res;
+    uring_conn_writing(conn);
+  }
+  /* A linked body chunk, or its cancellation, is still to complete. */
+  if (conn->pending > 0) return;
+  if (conn->failed) {
+    uring_conn_close(conn);
+    return;
+  }
+  if (conn->response_offset < conn->response_length) {
+    uring_prep_send(ring, conn, 0);
+    return;
+  }
+  if (conn->file_fd >= 0)
+    uring_conn_splice(ring, conn);
+  else
+    uring_conn_next(ring, conn);
+}
+
+static void uring_handle_splice(struct uring *ring, struct uring_conn *conn,
+    struct io_uring_cqe *cqe, enum uring_op op) {
+  if (op == URING_OP_SPLICE_IN) {
+    if (cqe->res > 0) {
+      conn->file_offset += cqe->res;
+      conn->pipe_bytes += cqe->res;
+    } else {
+      conn->failed = 1;
+    }
+  } else if (cqe->res > 0) {
+    conn->pipe_bytes -= cqe->res;
+    uring_conn_writing(conn);
+  } else if (cqe->res != -ECANCELED) {
+    /* A short SPLICE_IN cancels its linked SPLICE_OUT; anything else is fatal. */
+    conn->failed = 1;
+  }
+
+  if (conn->pending > 0) return;
+  if (conn->failed)
+    uring_conn_close(conn);
+  else
+    uring_conn_splice(ring, conn);
+}
+
+/*
+ * Advances the deadlines and cuts off the connections that missed theirs:
+ * shutting the socket down fails whatever is in flight on it, and the
+ * connection closes once that completes.
+ */
+static void uring_handle_tick(struct uring *ring) {
+  struct timer *expired = timer_wheel_advance(&uring_timers, uring_now);
+  while (expired) {
+    struct uring_conn *conn = (struct uring_conn *)
+        ((char *) expired - offsetof(struct uring_conn, timer));
+    expired = expired->next;
+    conn->failed = 1;
+    shutdown(conn->fd, SHUT_RDWR);
+  }
+  uring_prep_tick(ring);
+}
+
+int uring_serve_forever(int server_socket, char *files_directory,
+    int (*keep_accepting)(void)) {
+  struct uring ring;
+
+  uring_files_directory = files_directory;
+  sigemptyset(&uring_wait_mask);
+  if (uring_setup(&ring) < 0 || uring_setup_buffers(&ring) < 0)
+    return -1;
+
+  printf("Serving with io_uring\n");
+  uring_now = conn_now();
+  timer_wheel_init(&uring_timers, uring_now);
+  uring_prep_tick(&ring);
+  uring_prep_accept(&ring, server_socket);
+
+  while (1) {
+    if (!uring_draining && !keep_accepting()) {
+      uring_draining = 1;
+      uring_prep_cancel_accept(&ring);
+      uring_drain_idle();
+    }
+    if (uring_draining && uring_live_conns == 0)
+      break;
+
+    if (uring_submit(&ring, 1) < 0)
+      exit(EXIT_FAILURE);
+    uring_now = conn_now();
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      enum uring_op op = cqe->user_data & URING_OP_MASK;
+      struct uring_conn *conn = (struct uring_conn *) (uintptr_t)
+          (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+      if (conn) conn->pending--;
+
+      switch (op) {
+        case URING_OP_ACCEPT:
+          uring_handle_accept(&ring, cqe, server_socket);
+          break;
+        case URING_OP_RECV:
+          uring_handle_recv(&ring, conn, cqe);
+          break;
+        case URING_OP_SEND:
+          uring_handle_send(&ring, conn, cqe);
+          break;
+        case URING_OP_SPLICE_IN:
+        case URING_OP_SPLICE_OUT:
+          uring_handle_splice(&ring, conn, cqe, op);
+          break;
+        case URING_OP_TICK:
+          uring_handle_tick(&ring);
+          break;
+        case URING_OP_CANCEL:
+          break;
+      }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  close(ring.ring_fd);
+  return 0;
+}
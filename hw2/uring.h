@@ -0,0 +1,25 @@
+#ifndef URING_H
+#define URING_H
+
+/*
+ * io_uring engine for serving static files.
+ *
+ * Accepts (multishot), reads (into a provided buffer ring), response writes
+ * and splice-based file sends are all submitted as batched SQEs from a single
+ * thread, so a request costs a handful of io_uring_enter() calls instead of
+ * one syscall per operation. Connections are kept alive between requests
+ * unless the client asks to close or sends a request body, and pipelined
+ * requests are answered in order.
+ *
+ * Serves files from FILES_DIRECTORY on the listening socket SERVER_SOCKET.
+ * KEEP_ACCEPTING is called after every wakeup; signals are unblocked while
+ * the engine waits for completions, so a signal handler can make it return
+ * 0. The engine then stops accepting, closes idle connections, finishes
+ * the responses in progress and returns 0. Returns -1 straight away if the
+ * kernel does not support the features the engine needs, so the caller can
+ * fall back to the thread pool.
+ */
+int uring_serve_forever(int server_socket, char *files_directory,
+    int (*keep_accepting)(void));
+
+#endif
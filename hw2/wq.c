@@ -4,35 +4,66 @@
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
-
-  /* TODO: Make me thread-safe! */
-
   wq->size = 0;
   wq->head = NULL;
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->not_empty, NULL);
 }
 
 /* Remove an item from the WQ. This function should block until there
  * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
-
-  /* TODO: Make me blocking and thread-safe! */
+wq_item_t *wq_pop(wq_t *wq) {
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->not_empty, &wq->lock);
 
   wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
   wq->size--;
   DL_DELETE(wq->head, wq->head);
+  pthread_mutex_unlock(&wq->lock);
 
-  free(wq_item);
-  return client_socket_fd;
+  return wq_item;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Removes up to MAX items from the front of WQ into ITEMS, blocking until
+ * there is at least one. Returns the number removed. */
+int wq_pop_many(wq_t *wq, wq_item_t **items, int max) {
+  int count = 0;
+  pthread_mutex_lock(&wq->lock);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->not_empty, &wq->lock);
+
+  while (count < max && wq->size > 0) {
+    items[count++] = wq->head;
+    wq->size--;
+    DL_DELETE(wq->head, wq->head);
+  }
+  pthread_mutex_unlock(&wq->lock);
+
+  return count;
+}
+
+/* Removes the item at the front of WQ, or returns NULL if it is empty. */
+wq_item_t *wq_try_pop(wq_t *wq) {
+  if (__atomic_load_n(&wq->size, __ATOMIC_RELAXED) == 0)
+    return NULL;
+
+  pthread_mutex_lock(&wq->lock);
+  wq_item_t *wq_item = wq->head;
+  if (wq_item) {
+    wq->size--;
+    DL_DELETE(wq->head, wq->head);
+  }
+  pthread_mutex_unlock(&wq->lock);
 
-  /* TODO: Make me thread-safe! */
+  return wq_item;
+}
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
+/* Add ITEM to WQ. */
+void wq_push(wq_t *wq, wq_item_t *wq_item) {
+  pthread_mutex_lock(&wq->lock);
   DL_APPEND(wq->head, wq_item);
   wq->size++;
+  pthread_cond_signal(&wq->not_empty);
+  pthread_mutex_unlock(&wq->lock);
 }
@@ -3,11 +3,11 @@
 
 #include <pthread.h>
 
-/* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+/* WQ defines a work queue which will be used to store accepted connections
+ * waiting to be served. Items are embedded in the queued objects (see
+ * struct conn), so queueing a connection never allocates. */
 
 typedef struct wq_item {
-  int client_socket_fd; // Client socket to be served.
   struct wq_item *next;
   struct wq_item *prev;
 } wq_item_t;
@@ -15,11 +15,14 @@ typedef struct wq_item {
 typedef struct wq {
   int size;
   wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty; // Signalled whenever an item is pushed.
 } wq_t;
 
 void wq_init(wq_t *wq);
-void wq_push(wq_t *wq, int client_socket_fd);
-int wq_pop(wq_t *wq);
+void wq_push(wq_t *wq, wq_item_t *wq_item);
+wq_item_t *wq_pop(wq_t *wq);
+wq_item_t *wq_try_pop(wq_t *wq);
+int wq_pop_many(wq_t *wq, wq_item_t **items, int max);
 
 #endif
@@ -1,22 +1,1356 @@
 /*
  * mm_alloc.c
  *
- * Stub implementations of the mm_* routines.
+ * A segregated-fit allocator with per-CPU arenas.
+ *
+ * Every block is a chunk: a 16-byte header followed by the payload that
+ * mm_malloc() returns. The header holds the chunk's size and flags, and a
+ * copy of the size of the chunk before it, so the heap can be walked in
+ * address order.
+ *
+ * Requests of up to SMALL_MAX_CHUNK bytes (header included) are rounded up
+ * to one of NUM_CLASSES size classes, two per power of two: 32, 48, 64, 96,
+ * 128, ... 4096. Each class keeps its own list of free chunks, so a small
+ * allocation or free is a list push or pop. An empty class is refilled by
+ * carving a run of about MM_RUN_SIZE bytes into chunks of that class, and
+ * freed small chunks only ever go back to their own class. The payloads of
+ * classes that are multiples of a cache line start on one, so blocks of
+ * different threads do not share lines. A run counts its chunks in use,
+ * and once none are, it is freed as a whole unless it is all its class has
+ * left.
+ *
+ * Larger requests take a separate path. The size copied into the next
+ * chunk's header works as a boundary tag, so a freed chunk merges with a
+ * free neighbour on either side in constant time and no two free chunks
+ * are ever adjacent. Free chunks sit on doubly linked lists, binned with
+ * the same spacing as the size classes; a bitmap of the non-empty bins
+ * finds the next bin up that is certain to fit without looking at the
+ * empty ones. An allocation takes the first fit in its own bin, or else
+ * any chunk of a larger bin, and splits off what it does not need. Only
+ * when no chunk fits does the heap grow. mm_realloc() resizes a chunk where
+ * it stands when it can, by splitting off its tail or taking in the free
+ * chunk after it, and copies only when the neighbour is in the way.
+ *
+ * Requests of mmap_threshold bytes or more get a mapping of their own,
+ * which mm_free() unmaps and mm_realloc() resizes with mremap(). Free
+ * memory goes back to the kernel once it is part of a free chunk larger
+ * than trim_threshold, all but the first heap_increment bytes of that
+ * chunk. At the top of an arena's heap the heap shrinks: the main arena
+ * lowers the break with sbrk(), the others stop short of the rest of their
+ * reservation. Elsewhere the pages are released with madvise(). Both
+ * thresholds can be set through the environment (see mm_alloc.h), as can
+ * backing the heaps with transparent huge pages, which grows them and
+ * keeps them resident MM_HUGE_PAGE_SIZE bytes at a time instead.
+ *
+ * The heap is split into arenas, one per CPU, each with its own lock, size
+ * classes and memory. The main arena grows with sbrk(); the others each
+ * reserve an ARENA_HEAP_SIZE region with mmap(), aligned to its size, so a
+ * chunk's arena is found by masking its address. A thread allocates from
+ * the arena of the CPU it first ran on, and moves to its current CPU's
+ * arena when it finds its own locked. Freeing a chunk that belongs to
+ * another arena does not take that arena's lock: the chunk is pushed onto
+ * the arena's lock-free remote list, which its owner empties the next time
+ * it locks the arena.
+ *
+ * Most small requests take no lock at all: each thread caches a few free
+ * chunks per class, and mm_malloc()/mm_free() pop and push them. A thread
+ * only goes to its arena to move half a cache's worth of chunks at once,
+ * when a class runs dry or overflows, and gives everything back when it
+ * exits.
  */
 
+#define _GNU_SOURCE
+
 #include "mm_alloc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+typedef struct mm_chunk {
+    size_t prev_size;           /* Size of the chunk before this one, or 0. */
+    size_t head;                /* Size of this chunk | CHUNK_* flags. */
+    struct mm_chunk *next;      /* Free or remotely freed chunks; the payload starts here. */
+    struct mm_chunk *prev;      /* Free chunks in a bin or class list. */
+    size_t dirty;               /* Free chunks that are heap_purgeable(): see heap_release(). */
+} mm_chunk;
+
+/*
+ * A run is a general-path chunk, flagged CHUNK_SMALL, carved into the
+ * chunks of one size class. This header follows the run's chunk header.
+ * Small chunks never merge, so instead of a boundary tag their prev_size
+ * holds their distance from the run.
+ */
+typedef struct mm_run {
+    unsigned count;             /* Chunks in the run. */
+    unsigned live;              /* Chunks not on the arena's class list. */
+    unsigned first;             /* Offset of the first chunk. */
+} mm_run;
+
+#define MM_ALIGNMENT 16
+#define CHUNK_HEADER_SIZE offsetof(mm_chunk, next)
+#define MIN_CHUNK_SIZE 32
+
+#define CHUNK_INUSE 1           /* Allocated, or owned by a size class. */
+#define CHUNK_SMALL 2           /* Part of a run carved for a size class. */
+#define CHUNK_MMAPPED 4         /* Has a mapping of its own. */
+#define CHUNK_NON_MAIN 8        /* In an mmap()ed arena heap rather than the main arena. */
+#define CHUNK_FLAGS (MM_ALIGNMENT - 1)
+
+#define NUM_CLASSES MM_NUM_CLASSES
+#define SMALL_MAX_CHUNK 4096
+#define NUM_BINS 128            /* Enough for class_floor() of any size. */
+#define MM_RUN_SIZE 16384
+#define MM_RUN_MIN_CHUNKS 4
+#define RUN_FIRST_CHUNK (CHUNK_HEADER_SIZE + MM_ALIGNMENT)
+#define MM_CACHE_LINE 64
+
+#define TCACHE_BYTES 16384      /* Roughly what a thread keeps per class... */
+#define TCACHE_MIN_CHUNKS 4     /* ...within these bounds. */
+#define TCACHE_MAX_CHUNKS 64
+
+#define MM_MAX_ARENAS 64
+#define ARENA_HEAP_SIZE ((size_t) 64 << 20)
+
+#define MM_HEAP_INCREMENT (128 * 1024)
+#define MM_HUGE_PAGE_SIZE ((size_t) 2 << 20)
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#define MM_MAX_REQUEST (SIZE_MAX / 2)
+
+/*
+ * An arena's memory is kept as a list of segments, since the break can
+ * move under the main arena if someone else calls sbrk(). A segment is this
+ * header, its chunks and an epilogue: a chunk header of size 0 marked in
+ * use.
+ */
+typedef struct mm_segment {
+    struct mm_segment *next;
+    char *end;                  /* Break at the end of the segment. */
+} mm_segment;
+
+typedef struct mm_arena {
+    pthread_mutex_t lock;
+    mm_chunk *class_free[NUM_CLASSES];
+    size_t class_count[NUM_CLASSES];
+    mm_chunk *bins[NUM_BINS];   /* Free chunks of the general path. */
+    uint64_t bin_map[NUM_BINS / 64];
+    mm_segment *first_segment;
+    mm_segment *last_segment;
+    mm_chunk *remote_free;      /* Pushed by other threads without the lock. */
+    size_t chunk_flags;         /* CHUNK_NON_MAIN for every arena but the main one. */
+    char *top;                  /* Break of an mmap()ed heap. */
+
+    /* For mm_stats(). */
+    size_t free_bytes;          /* In the bins. */
+    size_t run_bytes;           /* In runs. */
+    size_t class_chunks[NUM_CLASSES];   /* Carved into runs, whether free or not. */
+    unsigned long long locks;
+    unsigned long long contended;       /* Updated without the lock. */
+} mm_arena;
+
+static mm_arena main_arena = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static mm_arena *arenas[MM_MAX_ARENAS] = { &main_arena };
+static unsigned num_arenas = 1;
+static unsigned next_arena;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mm_init_once = PTHREAD_ONCE_INIT;
+
+static size_t page_size = 4096;
+static size_t mmap_threshold = MM_MMAP_THRESHOLD;
+static size_t trim_threshold = MM_TRIM_THRESHOLD;
+static size_t huge_pages;       /* Back the heaps with transparent huge pages. */
+static size_t heap_increment = MM_HEAP_INCREMENT;
+
+static size_t mmap_bytes;       /* In large allocations' own mappings. */
+static size_t mmap_count;
+
+/*
+ * A thread's cache. mm_stats() reads the counts and counters from other
+ * threads, so the owner stores them with relaxed atomics.
+ */
+typedef struct mm_tcache {
+    mm_chunk *chunks[NUM_CLASSES];
+    unsigned counts[NUM_CLASSES];
+    unsigned long long hits;    /* Small allocations the cache served... */
+    unsigned long long misses;  /* ...and those it had to refill for. */
+    mm_arena *arena;            /* Where the thread allocates, once it has needed to. */
+    int registered;             /* On tcache_list, and emptied when the thread exits. */
+    int disabled;               /* The thread is exiting; bypass the cache. */
+    struct mm_tcache *next;     /* On tcache_list. */
+    struct mm_tcache *prev;
+} mm_tcache;
+
+static __thread mm_tcache tcache;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/* Registered caches, and the counters of threads that have exited. */
+static mm_tcache *tcache_list;
+static unsigned long long retired_hits, retired_misses;
+static pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t align_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static inline size_t chunk_size(mm_chunk *chunk) {
+    return chunk->head & ~(size_t) CHUNK_FLAGS;
+}
+
+static inline mm_chunk *chunk_at(void *address, size_t offset) {
+    return (mm_chunk *) ((char *) address + offset);
+}
+
+static inline mm_chunk *chunk_next(mm_chunk *chunk) {
+    return chunk_at(chunk, chunk_size(chunk));
+}
+
+static inline mm_chunk *chunk_prev(mm_chunk *chunk) {
+    return (mm_chunk *) ((char *) chunk - chunk->prev_size);
+}
+
+static inline void *chunk_payload(mm_chunk *chunk) {
+    return (char *) chunk + CHUNK_HEADER_SIZE;
+}
+
+static inline mm_chunk *payload_chunk(void *ptr) {
+    return (mm_chunk *) ((char *) ptr - CHUNK_HEADER_SIZE);
+}
+
+static inline mm_arena *chunk_arena(mm_chunk *chunk) {
+    if (!(chunk->head & CHUNK_NON_MAIN))
+        return &main_arena;
+    return (mm_arena *) ((uintptr_t) chunk & ~(uintptr_t) (ARENA_HEAP_SIZE - 1));
+}
+
+/* Sets CHUNK's size and flags, and the copy of its size in the next chunk. */
+static void chunk_set(mm_chunk *chunk, size_t size, size_t flags) {
+    chunk->head = size | flags;
+    chunk_at(chunk, size)->prev_size = size;
+}
+
+/* Returns the chunk size needed to hold SIZE bytes of payload. */
+static inline size_t request_size(size_t size) {
+    size = align_up(size, MM_ALIGNMENT) + CHUNK_HEADER_SIZE;
+    return size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size;
+}
+
+/* Returns the smallest class whose chunks are at least SIZE bytes. */
+static inline int class_ceil(size_t size) {
+    if (size <= MIN_CHUNK_SIZE)
+        return 0;
+    int log = 63 - __builtin_clzl(size - 1);
+    return 2 * (log - 5) + 1 + (int) (((size - 1) >> (log - 1)) & 1);
+}
+
+/* Returns the largest class whose chunks are at most SIZE bytes. */
+static inline int class_floor(size_t size) {
+    int log = 63 - __builtin_clzl(size);
+    return 2 * (log - 5) + (int) ((size >> (log - 1)) & 1);
+}
+
+/* Returns the size of the chunks in class CLASS. */
+static inline size_t class_size(int class) {
+    return (size_t) (2 + (class & 1)) << (4 + class / 2);
+}
+
+static inline mm_chunk *segment_first_chunk(mm_segment *segment) {
+    return (mm_chunk *) (segment + 1);
+}
+
+static inline mm_chunk *segment_epilogue(mm_segment *segment) {
+    return (mm_chunk *) (((uintptr_t) segment->end & ~(uintptr_t) CHUNK_FLAGS) -
+        CHUNK_HEADER_SIZE);
+}
+
+/*
+ * Moves ARENA's break up by INCREMENT bytes, like sbrk(): the main arena's
+ * is the program break, the others' the top of their mmap()ed heap.
+ */
+static char *arena_morecore(mm_arena *arena, size_t increment) {
+    if (arena == &main_arena) {
+        char *brk = sbrk((intptr_t) increment);
+        if (huge_pages && brk != (void *) -1) {
+            uintptr_t start = align_up((uintptr_t) brk, page_size);
+            madvise((void *) start, (uintptr_t) brk + increment - start, MADV_HUGEPAGE);
+        }
+        return brk;
+    }
+    if (increment > ARENA_HEAP_SIZE - (size_t) (arena->top - (char *) arena))
+        return (void *) -1;
+    char *brk = arena->top;
+    arena->top += increment;
+    return brk;
+}
+
+static inline size_t chunk_dirty(mm_chunk *chunk);
+static inline int heap_purgeable(size_t size);
+static void bin_insert(mm_arena *arena, mm_chunk *chunk);
+static void bin_remove(mm_arena *arena, mm_chunk *chunk);
+
+/*
+ * Gets at least SIZE bytes more for ARENA and frees them, merged with the
+ * last chunk if that was free too. Returns the resulting free chunk, or
+ * NULL if there is no memory to be had.
+ */
+static mm_chunk *heap_grow(mm_arena *arena, size_t size) {
+    size_t increment = align_up(size + sizeof(mm_segment) + CHUNK_HEADER_SIZE + MM_ALIGNMENT,
+        heap_increment);
+    if (increment < size || increment > INTPTR_MAX)
+        return NULL;
+    char *brk = arena_morecore(arena, increment);
+    if (brk == (void *) -1)
+        return NULL;
+
+    mm_chunk *chunk;
+    if (arena->last_segment && brk == arena->last_segment->end) {
+        /* Nobody else moved the break: the old epilogue becomes the new chunk. */
+        chunk = segment_epilogue(arena->last_segment);
+        arena->last_segment->end = brk + increment;
+    } else {
+        mm_segment *segment = (mm_segment *) align_up((uintptr_t) brk, MM_ALIGNMENT);
+        segment->next = NULL;
+        segment->end = brk + increment;
+        if (arena->last_segment)
+            arena->last_segment->next = segment;
+        else
+            arena->first_segment = segment;
+        arena->last_segment = segment;
+        chunk = segment_first_chunk(segment);
+        chunk->prev_size = 0;
+    }
+
+    mm_chunk *epilogue = segment_epilogue(arena->last_segment);
+    size_t chunk_bytes = (char *) epilogue - (char *) chunk, dirty = 0;
+    epilogue->head = CHUNK_INUSE;
+    if (chunk->prev_size && !(chunk_prev(chunk)->head & CHUNK_INUSE)) {
+        chunk = chunk_prev(chunk);
+        dirty = chunk_dirty(chunk);
+        bin_remove(arena, chunk);
+        chunk_bytes += chunk_size(chunk);
+    }
+    chunk_set(chunk, chunk_bytes, arena->chunk_flags);
+    if (heap_purgeable(chunk_bytes))
+        chunk->dirty = dirty;
+    bin_insert(arena, chunk);
+    return chunk;
+}
+
+/* Free chunks are binned with the same spacing as the size classes. */
+static inline int bin_index(size_t size) {
+    return class_floor(size);
+}
+
+static void list_push(mm_chunk **list, mm_chunk *chunk) {
+    chunk->prev = NULL;
+    chunk->next = *list;
+    if (chunk->next)
+        chunk->next->prev = chunk;
+    *list = chunk;
+}
+
+static void list_remove(mm_chunk **list, mm_chunk *chunk) {
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        *list = chunk->next;
+}
+
+static void bin_insert(mm_arena *arena, mm_chunk *chunk) {
+    int bin = bin_index(chunk_size(chunk));
+    list_push(&arena->bins[bin], chunk);
+    arena->bin_map[bin / 64] |= (uint64_t) 1 << (bin % 64);
+    arena->free_bytes += chunk_size(chunk);
+}
+
+static void bin_remove(mm_arena *arena, mm_chunk *chunk) {
+    int bin = bin_index(chunk_size(chunk));
+    list_remove(&arena->bins[bin], chunk);
+    if (!arena->bins[bin])
+        arena->bin_map[bin / 64] &= ~((uint64_t) 1 << (bin % 64));
+    arena->free_bytes -= chunk_size(chunk);
+}
+
+/* Returns the first non-empty bin from FIRST on, or -1. */
+static int bin_next(mm_arena *arena, int first) {
+    for (int word = first / 64; word < NUM_BINS / 64; word++) {
+        uint64_t bits = arena->bin_map[word];
+        if (word == first / 64)
+            bits &= ~(uint64_t) 0 << (first % 64);
+        if (bits)
+            return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+/*
+ * Returns whether a free chunk of SIZE bytes is large enough to give all
+ * but its first heap_increment bytes back to the kernel.
+ */
+static inline int heap_purgeable(size_t size) {
+    return size > trim_threshold && size > heap_increment;
+}
+
+/* Returns how many bytes at the start of the free CHUNK may be resident. */
+static inline size_t chunk_dirty(mm_chunk *chunk) {
+    return heap_purgeable(chunk_size(chunk)) ? chunk->dirty : chunk_size(chunk);
+}
+
+/*
+ * Shrinks ARENA's heap so that the free chunk TOP at its top ends
+ * heap_increment bytes in. Returns -1 if the main arena's break cannot
+ * move because someone else's memory is above it.
+ */
+static int heap_trim(mm_arena *arena, mm_chunk *top) {
+    mm_segment *segment = arena->last_segment;
+    char *end = (char *) align_up((uintptr_t) top + heap_increment, page_size);
+    if (end >= segment->end)
+        return 0;
+    size_t release = segment->end - end;
+    if (arena != &main_arena) {
+        madvise(end, release, MADV_DONTNEED);
+        arena->top = end;
+    } else if (sbrk(0) != segment->end || sbrk(-(intptr_t) release) == (void *) -1) {
+        return -1;
+    }
+
+    segment->end = end;
+    mm_chunk *epilogue = segment_epilogue(segment);
+    chunk_set(top, (char *) epilogue - (char *) top, top->head & CHUNK_FLAGS);
+    epilogue->head = CHUNK_INUSE;
+    return 0;
+}
+
+/*
+ * Releases every page that holds part of START..END, within the free
+ * CHUNK past its first heap_increment bytes. The range is widened to
+ * whole pages, since those it shares with neighbours that were merged into
+ * CHUNK are free now too.
+ */
+static void heap_purge(mm_chunk *chunk, char *start, char *end) {
+    uintptr_t first = align_up((uintptr_t) chunk + heap_increment, page_size);
+    uintptr_t last = (uintptr_t) chunk_next(chunk) & ~(uintptr_t) (page_size - 1);
+    uintptr_t from = (uintptr_t) start & ~(uintptr_t) (page_size - 1);
+    uintptr_t to = align_up((uintptr_t) end, page_size);
+    if (from < first)
+        from = first;
+    if (to > last)
+        to = last;
+    if (from < to)
+        madvise((void *) from, to - from, MADV_DONTNEED);
+}
+
+/*
+ * Frees CHUNK on the general path, merging it with whichever neighbours
+ * are free, and returns the merged chunk. Only the first DIRTY bytes of
+ * CHUNK may be resident.
+ *
+ * A free chunk that is heap_purgeable() keeps nothing resident past its
+ * first heap_increment bytes: at the top of the heap the heap shrinks,
+ * elsewhere the pages that may still be resident are released.
+ * Allocations are carved from the start of a free chunk, so memory that is
+ * about to be reused stays, and a chunk freed again next to where it was
+ * carved from costs no system call.
+ */
+static mm_chunk *heap_release(mm_arena *arena, mm_chunk *chunk, size_t dirty) {
+    char *chunk_start = (char *) chunk;
+    size_t size = chunk_size(chunk), prev_dirty = 0, next_dirty = 0;
+    mm_chunk *next = chunk_at(chunk, size);
+    if (!(next->head & CHUNK_INUSE)) {
+        next_dirty = chunk_dirty(next);
+        bin_remove(arena, next);
+        size += chunk_size(next);
+    }
+    if (chunk->prev_size) {
+        mm_chunk *prev = chunk_prev(chunk);
+        if (!(prev->head & CHUNK_INUSE)) {
+            prev_dirty = chunk_dirty(prev);
+            bin_remove(arena, prev);
+            size += chunk_size(prev);
+            chunk = prev;
+        }
+    }
+    chunk_set(chunk, size, arena->chunk_flags);
+
+    if (heap_purgeable(size)) {
+        if (chunk_next(chunk) != segment_epilogue(arena->last_segment) ||
+                heap_trim(arena, chunk) < 0) {
+            /* The three parts may be resident in up to three pieces; merge the ones that touch. */
+            char *start = prev_dirty ? (char *) chunk : chunk_start;
+            char *end = prev_dirty ? (char *) chunk + prev_dirty : chunk_start + dirty;
+            if (prev_dirty && end == chunk_start) {
+                end = chunk_start + dirty;
+            } else if (prev_dirty) {
+                heap_purge(chunk, start, end);
+                start = chunk_start;
+                end = chunk_start + dirty;
+            }
+            if (next_dirty && end == (char *) next) {
+                end += next_dirty;
+            } else if (next_dirty) {
+                heap_purge(chunk, start, end);
+                start = (char *) next;
+                end = start + next_dirty;
+            }
+            heap_purge(chunk, start, end);
+        }
+        if (heap_purgeable(chunk_size(chunk)))
+            chunk->dirty = heap_increment;
+    }
+    bin_insert(arena, chunk);
+    return chunk;
+}
+
+/*
+ * Shrinks the allocated CHUNK to SIZE bytes if what is left over can stand
+ * as a free chunk, of which only the first DIRTY bytes may be resident.
+ */
+static void chunk_split(mm_arena *arena, mm_chunk *chunk, size_t size, size_t dirty) {
+    size_t total = chunk_size(chunk);
+    if (total - size < MIN_CHUNK_SIZE)
+        return;
+    chunk_set(chunk, size, chunk->head & CHUNK_FLAGS);
+    mm_chunk *rest = chunk_at(chunk, size);
+    chunk_set(rest, total - size, CHUNK_INUSE | arena->chunk_flags);
+    heap_release(arena, rest, dirty);
+}
+
+/*
+ * Returns a free chunk of at least SIZE bytes in ARENA, or NULL: the first
+ * that fits in SIZE's own bin, or else the first of the next bin up, all of
+ * whose chunks fit.
+ */
+static mm_chunk *heap_find_fit(mm_arena *arena, size_t size) {
+    int bin = bin_index(size);
+    for (mm_chunk *chunk = arena->bins[bin]; chunk; chunk = chunk->next) {
+        if (chunk_size(chunk) >= size)
+            return chunk;
+    }
+    bin = bin_next(arena, bin + 1);
+    return bin < 0 ? NULL : arena->bins[bin];
+}
+
+/* Allocates a chunk of SIZE bytes on ARENA's general path. */
+static mm_chunk *heap_alloc(mm_arena *arena, size_t size) {
+    mm_chunk *chunk = heap_find_fit(arena, size);
+    if (!chunk && !(chunk = heap_grow(arena, size)))
+        return NULL;
+    size_t dirty = chunk_dirty(chunk);
+    bin_remove(arena, chunk);
+    chunk->head |= CHUNK_INUSE;
+    chunk_split(arena, chunk, size, dirty > size ? dirty - size : 0);
+    return chunk;
+}
+
+static void heap_free(mm_arena *arena, mm_chunk *chunk) {
+    heap_release(arena, chunk, chunk_size(chunk));
+}
+
+/*
+ * Resizes CHUNK, allocated on ARENA's general path, to SIZE bytes where it
+ * stands: shrinking splits off the tail, growing takes what it needs of a
+ * free next chunk, first growing the heap if CHUNK is the last one in it.
+ * Returns -1 if CHUNK would have to move.
+ */
+static int heap_resize(mm_arena *arena, mm_chunk *chunk, size_t size) {
+    size_t total = chunk_size(chunk);
+    if (size <= total) {
+        chunk_split(arena, chunk, size, total - size);
+        return 0;
+    }
+
+    mm_chunk *next = chunk_next(chunk);
+    if (next == segment_epilogue(arena->last_segment)) {
+        heap_grow(arena, size - total);
+        next = chunk_next(chunk);
+    }
+    if ((next->head & CHUNK_INUSE) || total + chunk_size(next) < size)
+        return -1;
+
+    /* The part of NEXT that is left over starts SIZE - TOTAL bytes into it. */
+    size_t dirty = chunk_dirty(next);
+    dirty = dirty > size - total ? dirty - (size - total) : 0;
+    bin_remove(arena, next);
+    chunk_set(chunk, total + chunk_size(next), chunk->head & CHUNK_FLAGS);
+    chunk_split(arena, chunk, size, dirty);
+    return 0;
+}
+
+/*
+ * Frees the start of CHUNK, allocated on ARENA's general path, so that
+ * the rest has its payload on an ALIGNMENT boundary, then shrinks that to
+ * SIZE bytes. CHUNK must be large enough to leave a chunk in front.
+ * Returns the aligned chunk.
+ */
+static mm_chunk *heap_align(mm_arena *arena, mm_chunk *chunk, size_t alignment, size_t size) {
+    mm_chunk *aligned = payload_chunk((void *) align_up((uintptr_t) chunk_payload(chunk),
+        alignment));
+    if (aligned != chunk) {
+        while ((size_t) ((char *) aligned - (char *) chunk) < MIN_CHUNK_SIZE)
+            aligned = chunk_at(aligned, alignment);
+        size_t lead = (char *) aligned - (char *) chunk, total = chunk_size(chunk);
+        size_t flags = chunk->head & CHUNK_FLAGS;
+        chunk_set(chunk, lead, flags);
+        chunk_set(aligned, total - lead, flags);
+        heap_free(arena, chunk);
+    }
+    chunk_split(arena, aligned, size, chunk_size(aligned) - size);
+    return aligned;
+}
+
+/* Allocates a chunk of SIZE bytes in a mapping of its own, or returns NULL. */
+static mm_chunk *mmap_alloc(size_t size) {
+    size = align_up(size, page_size);
+    mm_chunk *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+        -1, 0);
+    if (chunk == MAP_FAILED)
+        return NULL;
+    chunk->prev_size = 0;
+    chunk->head = size | CHUNK_MMAPPED | CHUNK_INUSE;
+    __atomic_fetch_add(&mmap_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mmap_count, 1, __ATOMIC_RELAXED);
+    return chunk;
+}
+
+static void mmap_free(mm_chunk *chunk) {
+    size_t size = chunk->prev_size + chunk_size(chunk);
+    munmap((char *) chunk - chunk->prev_size, size);
+    __atomic_fetch_sub(&mmap_bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&mmap_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Resizes the mapping of CHUNK so it holds SIZE bytes, moving it if the
+ * kernel has to. Returns the chunk, or NULL if the mapping cannot change.
+ */
+static mm_chunk *mmap_resize(mm_chunk *chunk, size_t size) {
+    size_t offset = chunk->prev_size, old_size = offset + chunk_size(chunk);
+    size = align_up(offset + size, page_size);
+    char *map = mremap((char *) chunk - offset, old_size, size, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return NULL;
+    __atomic_fetch_add(&mmap_bytes, size - old_size, __ATOMIC_RELAXED);
+    chunk = chunk_at(map, offset);
+    chunk->head = (size - offset) | CHUNK_MMAPPED | CHUNK_INUSE;
+    return chunk;
+}
+
+/*
+ * Moves the start of the mmap()ed CHUNK up so its payload is on an
+ * ALIGNMENT boundary. The skipped bytes stay mapped, counted by prev_size.
+ */
+static mm_chunk *mmap_align(mm_chunk *chunk, size_t alignment) {
+    mm_chunk *aligned = payload_chunk((void *) align_up((uintptr_t) chunk_payload(chunk),
+        alignment));
+    size_t lead = (char *) aligned - (char *) chunk;
+    if (lead) {
+        aligned->prev_size = chunk->prev_size + lead;
+        aligned->head = (chunk_size(chunk) - lead) | CHUNK_MMAPPED | CHUNK_INUSE;
+    }
+    return aligned;
+}
+
+static inline mm_run *run_header(mm_chunk *run) {
+    return chunk_payload(run);
+}
+
+/* Returns the run the small CHUNK was carved from. */
+static inline mm_chunk *chunk_run(mm_chunk *chunk) {
+    return chunk_prev(chunk);
+}
+
+/*
+ * Returns whether the chunks of CLASS have their payloads on cache-line
+ * boundaries: those of every class that is a multiple of the line do, so
+ * their blocks never share a line with another block, which two threads
+ * might be writing.
+ */
+static inline int class_aligned(int class) {
+    return class_size(class) % MM_CACHE_LINE == 0;
+}
+
+/* Carves a run into chunks of CLASS and puts them on its free list. */
+static void class_refill(mm_arena *arena, int class) {
+    size_t size = class_size(class);
+    size_t slack = class_aligned(class) ? MM_CACHE_LINE - MM_ALIGNMENT : 0;
+    size_t count = (MM_RUN_SIZE - RUN_FIRST_CHUNK - slack) / size;
+    if (count < MM_RUN_MIN_CHUNKS)
+        count = MM_RUN_MIN_CHUNKS;
+
+    mm_chunk *run = heap_alloc(arena, RUN_FIRST_CHUNK + slack + count * size);
+    if (!run)
+        return;
+    size_t first = RUN_FIRST_CHUNK;
+    if (slack)
+        first = align_up((uintptr_t) run + first + CHUNK_HEADER_SIZE, MM_CACHE_LINE) -
+            CHUNK_HEADER_SIZE - (uintptr_t) run;
+    run->head |= CHUNK_SMALL;
+    run_header(run)->count = count;
+    run_header(run)->live = 0;
+    run_header(run)->first = first;
+    for (size_t i = count; i-- > 0;) {
+        mm_chunk *chunk = chunk_at(run, first + i * size);
+        chunk->prev_size = first + i * size;
+        chunk->head = size | CHUNK_INUSE | CHUNK_SMALL | arena->chunk_flags;
+        list_push(&arena->class_free[class], chunk);
+    }
+    arena->class_count[class] += count;
+    arena->class_chunks[class] += count;
+    arena->run_bytes += chunk_size(run);
+}
+
+/* Takes the chunks of RUN, none of which are in use, off CLASS and frees it. */
+static void run_release(mm_arena *arena, int class, mm_chunk *run) {
+    size_t size = class_size(class), count = run_header(run)->count;
+    size_t first = run_header(run)->first;
+    for (size_t i = 0; i < count; i++)
+        list_remove(&arena->class_free[class], chunk_at(run, first + i * size));
+    arena->class_count[class] -= count;
+    arena->class_chunks[class] -= count;
+    arena->run_bytes -= chunk_size(run);
+    run->head &= ~(size_t) CHUNK_SMALL;
+    heap_free(arena, run);
+}
+
+static mm_chunk *class_alloc(mm_arena *arena, int class) {
+    if (!arena->class_free[class])
+        class_refill(arena, class);
+    mm_chunk *chunk = arena->class_free[class];
+    if (chunk) {
+        list_remove(&arena->class_free[class], chunk);
+        arena->class_count[class]--;
+        run_header(chunk_run(chunk))->live++;
+    }
+    return chunk;
+}
+
+static void class_free_chunk(mm_arena *arena, mm_chunk *chunk) {
+    int class = class_floor(chunk_size(chunk));
+    list_push(&arena->class_free[class], chunk);
+    arena->class_count[class]++;
+
+    mm_chunk *run = chunk_run(chunk);
+    mm_run *header = run_header(run);
+    if (--header->live == 0 && arena->class_count[class] > header->count)
+        run_release(arena, class, run);
+}
+
+/* Frees CHUNK into ARENA, whose lock is held. */
+static void arena_free_locked(mm_arena *arena, mm_chunk *chunk) {
+    if (chunk->head & CHUNK_SMALL)
+        class_free_chunk(arena, chunk);
+    else
+        heap_free(arena, chunk);
+}
+
+/* Hands CHUNK back to ARENA, which another thread may hold locked. */
+static void arena_remote_free(mm_arena *arena, mm_chunk *chunk) {
+    mm_chunk *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+    do {
+        chunk->next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, chunk, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Frees the chunks other threads handed back to ARENA, whose lock is held. */
+static void arena_drain_remote(mm_arena *arena) {
+    if (!__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED))
+        return;
+    mm_chunk *chunk = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while (chunk) {
+        mm_chunk *next = chunk->next;
+        arena_free_locked(arena, chunk);
+        chunk = next;
+    }
+}
+
+/* Counts an acquisition of ARENA's lock, now held, and empties its remote list. */
+static void arena_locked(mm_arena *arena) {
+    arena->locks++;
+    arena_drain_remote(arena);
+}
+
+static void arena_lock(mm_arena *arena) {
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        __atomic_fetch_add(&arena->contended, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&arena->lock);
+    }
+    arena_locked(arena);
+}
+
+/* Creates an arena at the start of a fresh, suitably aligned heap reservation. */
+static mm_arena *arena_create(void) {
+    char *map = mmap(NULL, 2 * ARENA_HEAP_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    char *base = (char *) align_up((uintptr_t) map, ARENA_HEAP_SIZE);
+    if (base > map)
+        munmap(map, base - map);
+    munmap(base + ARENA_HEAP_SIZE, map + ARENA_HEAP_SIZE - base);
+
+    if (huge_pages)
+        madvise(base, ARENA_HEAP_SIZE, MADV_HUGEPAGE);
+
+    mm_arena *arena = (mm_arena *) base;
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->chunk_flags = CHUNK_NON_MAIN;
+    arena->top = base + align_up(sizeof(mm_arena), MM_ALIGNMENT);
+    return arena;
+}
+
+/* Reads a size from the environment variable NAME into VALUE, if it is set. */
+static void mm_getenv_size(char *name, size_t *value) {
+    char *string = getenv(name), *end;
+    if (!string || !*string)
+        return;
+    unsigned long long number = strtoull(string, &end, 10);
+    if (*end == '\0')
+        *value = number;
+}
+
+static void mm_stats_at_exit(void);
+
+static void mm_init(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page > 0)
+        page_size = page;
+    mm_getenv_size("MM_MMAP_THRESHOLD", &mmap_threshold);
+    mm_getenv_size("MM_TRIM_THRESHOLD", &trim_threshold);
+    mm_getenv_size("MM_HUGE_PAGES", &huge_pages);
+    if (huge_pages)
+        heap_increment = MM_HUGE_PAGE_SIZE;
+    char *stats = getenv("MM_STATS");
+    if (stats && *stats)
+        atexit(mm_stats_at_exit);
+
+    cpu_set_t cpus;
+    unsigned count = 1;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+        count = CPU_COUNT(&cpus);
+    num_arenas = count < 1 ? 1 : count > MM_MAX_ARENAS ? MM_MAX_ARENAS : count;
+}
+
+/* Returns the arena for the CPU the calling thread is running on. */
+static mm_arena *arena_pick(void) {
+    pthread_once(&mm_init_once, mm_init);
+    int cpu = sched_getcpu();
+    unsigned index = cpu >= 0 ? (unsigned) cpu :
+        __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+    index %= num_arenas;
+
+    mm_arena *arena = __atomic_load_n(&arenas[index], __ATOMIC_ACQUIRE);
+    if (arena)
+        return arena;
+    pthread_mutex_lock(&arenas_lock);
+    arena = arenas[index];
+    if (!arena) {
+        arena = arena_create();
+        if (arena)
+            __atomic_store_n(&arenas[index], arena, __ATOMIC_RELEASE);
+        else
+            arena = &main_arena;
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    return arena;
+}
+
+/*
+ * Locks and returns the arena CACHE's thread allocates from. A thread whose
+ * arena is busy moves to its current CPU's arena, if that is another one.
+ */
+static mm_arena *arena_lock_own(mm_tcache *cache) {
+    mm_arena *arena = cache->arena;
+    if (!arena)
+        arena = cache->arena = arena_pick();
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        __atomic_fetch_add(&arena->contended, 1, __ATOMIC_RELAXED);
+        mm_arena *here = arena_pick();
+        if (here != arena) {
+            arena = cache->arena = here;
+            arena_lock(arena);
+            return arena;
+        }
+        pthread_mutex_lock(&arena->lock);
+    }
+    arena_locked(arena);
+    return arena;
+}
+
+/*
+ * Allocates a chunk of SIZE bytes from CACHE's arena, or from the main arena
+ * if that one has run out of room.
+ */
+static mm_chunk *arena_alloc(mm_tcache *cache, size_t size) {
+    mm_arena *arena = arena_lock_own(cache);
+    for (;;) {
+        mm_chunk *chunk = size <= SMALL_MAX_CHUNK ? class_alloc(arena, class_ceil(size)) :
+            heap_alloc(arena, size);
+        pthread_mutex_unlock(&arena->lock);
+        if (chunk || arena == &main_arena)
+            return chunk;
+        arena = &main_arena;
+        arena_lock(arena);
+    }
+}
+
+/* Returns how many chunks of CLASS a thread may cache. */
+static inline unsigned tcache_limit(int class) {
+    size_t limit = TCACHE_BYTES / class_size(class);
+    if (limit < TCACHE_MIN_CHUNKS)
+        return TCACHE_MIN_CHUNKS;
+    return limit > TCACHE_MAX_CHUNKS ? TCACHE_MAX_CHUNKS : (unsigned) limit;
+}
+
+static inline void tcache_push(mm_tcache *cache, int class, mm_chunk *chunk) {
+    chunk->next = cache->chunks[class];
+    cache->chunks[class] = chunk;
+    __atomic_store_n(&cache->counts[class], cache->counts[class] + 1, __ATOMIC_RELAXED);
+}
+
+static inline mm_chunk *tcache_pop(mm_tcache *cache, int class) {
+    mm_chunk *chunk = cache->chunks[class];
+    if (chunk) {
+        cache->chunks[class] = chunk->next;
+        __atomic_store_n(&cache->counts[class], cache->counts[class] - 1, __ATOMIC_RELAXED);
+    }
+    return chunk;
+}
+
+/* Adds one to a counter of the calling thread's cache. */
+static inline void tcache_count(unsigned long long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Moves up to COUNT chunks of CLASS from CACHE back to their arenas: its
+ * own thread's arena directly, any other through its remote list.
+ */
+static void tcache_flush(mm_tcache *cache, int class, unsigned count) {
+    mm_arena *arena = arena_lock_own(cache);
+    mm_chunk *chunk;
+    while (count-- > 0 && (chunk = tcache_pop(cache, class))) {
+        mm_arena *owner = chunk_arena(chunk);
+        if (owner == arena)
+            class_free_chunk(arena, chunk);
+        else
+            arena_remote_free(owner, chunk);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void tcache_destroy(void *arg) {
+    mm_tcache *cache = arg;
+    cache->disabled = 1;
+    for (int class = 0; class < NUM_CLASSES; class++) {
+        if (cache->counts[class])
+            tcache_flush(cache, class, cache->counts[class]);
+    }
+
+    pthread_mutex_lock(&tcache_list_lock);
+    retired_hits += cache->hits;
+    retired_misses += cache->misses;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        tcache_list = cache->next;
+    pthread_mutex_unlock(&tcache_list_lock);
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* Arranges for CACHE to be emptied when its thread exits, and to be seen by mm_stats(). */
+static void tcache_register(mm_tcache *cache) {
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, cache);
+    cache->registered = 1;
+
+    pthread_mutex_lock(&tcache_list_lock);
+    cache->prev = NULL;
+    cache->next = tcache_list;
+    if (tcache_list)
+        tcache_list->prev = cache;
+    tcache_list = cache;
+    pthread_mutex_unlock(&tcache_list_lock);
+}
+
+/* Takes up to COUNT more chunks of CLASS from ARENA, whose lock is held, into CACHE. */
+static void tcache_fill_locked(mm_tcache *cache, mm_arena *arena, int class, unsigned count) {
+    while (cache->counts[class] < count) {
+        mm_chunk *chunk = class_alloc(arena, class);
+        if (!chunk)
+            break;
+        tcache_push(cache, class, chunk);
+    }
+}
+
+/*
+ * Takes a chunk of CLASS from the heap for an empty CACHE, bringing half a
+ * cache's worth more along. Returns NULL if memory runs out.
+ */
+static mm_chunk *tcache_refill(mm_tcache *cache, int class) {
+    if (!cache->registered)
+        tcache_register(cache);
+    tcache_count(&cache->misses);
+
+    mm_arena *arena = arena_lock_own(cache);
+    tcache_fill_locked(cache, arena, class, tcache_limit(class) / 2 + 1);
+    pthread_mutex_unlock(&arena->lock);
+    if (!cache->chunks[class] && arena != &main_arena) {
+        arena_lock(&main_arena);
+        tcache_fill_locked(cache, &main_arena, class, tcache_limit(class) / 2 + 1);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+    return tcache_pop(cache, class);
+}
+
+/* Caches the small CHUNK, handing half the cache back if it is full. */
+static void tcache_free(mm_tcache *cache, mm_chunk *chunk) {
+    if (!cache->registered)
+        tcache_register(cache);
+    int class = class_floor(chunk_size(chunk));
+    tcache_push(cache, class, chunk);
+    if (cache->counts[class] > tcache_limit(class))
+        tcache_flush(cache, class, tcache_limit(class) / 2);
+}
 
 void *mm_malloc(size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (size == 0)
+        return NULL;
+    if (size > MM_MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t chunk_bytes = request_size(size);
+    mm_chunk *chunk;
+    mm_tcache *cache = &tcache;
+    if (chunk_bytes <= SMALL_MAX_CHUNK && !cache->disabled) {
+        int class = class_ceil(chunk_bytes);
+        chunk = tcache_pop(cache, class);
+        if (chunk)
+            tcache_count(&cache->hits);
+        else
+            chunk = tcache_refill(cache, class);
+    } else {
+        pthread_once(&mm_init_once, mm_init);
+        chunk = NULL;
+        if (size >= mmap_threshold && chunk_bytes > SMALL_MAX_CHUNK)
+            chunk = mmap_alloc(chunk_bytes);
+        if (!chunk)
+            chunk = arena_alloc(cache, chunk_bytes);
+    }
+
+    if (!chunk) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return chunk_payload(chunk);
 }
 
 void *mm_realloc(void *ptr, size_t size) {
-    /* YOUR CODE HERE */
-    return NULL;
+    if (!ptr)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    if (size > MM_MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    mm_chunk *chunk = payload_chunk(ptr);
+    size_t chunk_bytes = request_size(size);
+    if (chunk->head & CHUNK_SMALL) {
+        if (chunk_bytes <= chunk_size(chunk))
+            return ptr;
+    } else if (chunk->head & CHUNK_MMAPPED) {
+        if (chunk_bytes <= chunk_size(chunk) && chunk_size(chunk) - chunk_bytes < page_size)
+            return ptr;
+        mm_chunk *moved = mmap_resize(chunk, chunk_bytes);
+        if (moved)
+            return chunk_payload(moved);
+    } else {
+        mm_arena *owner = chunk_arena(chunk);
+        arena_lock(owner);
+        int resized = heap_resize(owner, chunk, chunk_bytes);
+        pthread_mutex_unlock(&owner->lock);
+        if (resized == 0)
+            return ptr;
+    }
+
+    void *new_ptr = mm_malloc(size);
+    if (!new_ptr)
+        return NULL;
+    size_t usable = chunk_size(chunk) - CHUNK_HEADER_SIZE;
+    memcpy(new_ptr, ptr, size < usable ? size : usable);
+    mm_free(ptr);
+    return new_ptr;
 }
 
 void mm_free(void *ptr) {
-    /* YOUR CODE HERE */
+    if (!ptr)
+        return;
+    mm_chunk *chunk = payload_chunk(ptr);
+    mm_tcache *cache = &tcache;
+    if ((chunk->head & CHUNK_SMALL) && !cache->disabled) {
+        tcache_free(cache, chunk);
+        return;
+    }
+    if (chunk->head & CHUNK_MMAPPED) {
+        mmap_free(chunk);
+        return;
+    }
+
+    mm_arena *owner = chunk_arena(chunk);
+    if (owner != cache->arena && !cache->disabled) {
+        arena_remote_free(owner, chunk);
+        return;
+    }
+    arena_lock(owner);
+    arena_free_locked(owner, chunk);
+    pthread_mutex_unlock(&owner->lock);
+}
+
+void *mm_calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = mm_malloc(total);
+    /* A mapping of its own comes from the kernel zeroed. */
+    if (ptr && !(payload_chunk(ptr)->head & CHUNK_MMAPPED))
+        memset(ptr, 0, total);
+    return ptr;
+}
+
+void *mm_memalign(size_t alignment, size_t size) {
+    if (alignment & (alignment - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= MM_ALIGNMENT)
+        return mm_malloc(size);
+    if (size == 0)
+        return NULL;
+    if (size > MM_MAX_REQUEST || alignment > MM_MAX_REQUEST) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* Small blocks up to a cache line apart come from the first class that lines them up. */
+    size_t chunk_bytes = request_size(size);
+    if (alignment <= MM_CACHE_LINE && chunk_bytes <= SMALL_MAX_CHUNK) {
+        int class = class_ceil(chunk_bytes);
+        while (!class_aligned(class))
+            class++;
+        return mm_malloc(class_size(class) - CHUNK_HEADER_SIZE);
+    }
+
+    /* Otherwise allocate enough to free a chunk in front of the aligned one, on the general path. */
+    pthread_once(&mm_init_once, mm_init);
+    if (size >= mmap_threshold) {
+        mm_chunk *chunk = mmap_alloc(chunk_bytes + alignment);
+        if (chunk)
+            return chunk_payload(mmap_align(chunk, alignment));
+    }
+    size_t padded = chunk_bytes + alignment + MIN_CHUNK_SIZE;
+    if (padded <= SMALL_MAX_CHUNK)
+        padded = SMALL_MAX_CHUNK + MM_ALIGNMENT;
+    mm_chunk *chunk = arena_alloc(&tcache, padded);
+    if (!chunk) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    mm_arena *owner = chunk_arena(chunk);
+    arena_lock(owner);
+    chunk = heap_align(owner, chunk, alignment, chunk_bytes);
+    pthread_mutex_unlock(&owner->lock);
+    return chunk_payload(chunk);
+}
+
+void *mm_aligned_alloc(size_t alignment, size_t size) {
+    return mm_memalign(alignment, size);
+}
+
+size_t mm_usable_size(void *ptr) {
+    return ptr ? chunk_size(payload_chunk(ptr)) - CHUNK_HEADER_SIZE : 0;
+}
+
+/*
+ * A child of fork() has only the thread that forked, so a lock another
+ * thread held at the time would stay locked in it forever. The allocator's
+ * locks are all taken around fork() instead.
+ */
+static void mm_fork_prepare(void) {
+    pthread_mutex_lock(&arenas_lock);
+    for (unsigned i = 0; i < MM_MAX_ARENAS; i++) {
+        if (arenas[i])
+            pthread_mutex_lock(&arenas[i]->lock);
+    }
+    pthread_mutex_lock(&tcache_list_lock);
+}
+
+static void mm_fork_parent(void) {
+    pthread_mutex_unlock(&tcache_list_lock);
+    for (unsigned i = MM_MAX_ARENAS; i-- > 0;) {
+        if (arenas[i])
+            pthread_mutex_unlock(&arenas[i]->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+/* The caches of the other threads are gone with them, chunks and all. */
+static void mm_fork_child(void) {
+    tcache_list = NULL;
+    if (tcache.registered && !tcache.disabled) {
+        tcache.next = tcache.prev = NULL;
+        tcache_list = &tcache;
+    }
+    mm_fork_parent();
+}
+
+__attribute__((constructor)) static void mm_fork_register(void) {
+    pthread_atfork(mm_fork_prepare, mm_fork_parent, mm_fork_child);
+}
+
+/* Adds what ARENA, whose lock is held, knows to STATS. */
+static void arena_stats(mm_arena *arena, struct mm_stats *stats) {
+    size_t heap = 0;
+    for (mm_segment *segment = arena->first_segment; segment; segment = segment->next)
+        heap += segment->end - (char *) segment;
+    stats->heap += heap;
+    stats->free += arena->free_bytes;
+    stats->in_use += heap - arena->free_bytes - arena->run_bytes;
+    for (int class = 0; class < NUM_CLASSES; class++) {
+        /* Everything carved, for now; mm_stats() takes out what is free. */
+        stats->classes[class].in_use += arena->class_chunks[class];
+        stats->classes[class].free += arena->class_count[class];
+    }
+    stats->locks += arena->locks;
+    stats->contended += __atomic_load_n(&arena->contended, __ATOMIC_RELAXED);
+    stats->arenas++;
+}
+
+void mm_stats(struct mm_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (unsigned i = 0; i < MM_MAX_ARENAS; i++) {
+        mm_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (!arena)
+            continue;
+        pthread_mutex_lock(&arena->lock);
+        arena_drain_remote(arena);
+        arena_stats(arena, stats);
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    pthread_mutex_lock(&tcache_list_lock);
+    stats->cache_hits = retired_hits;
+    stats->cache_misses = retired_misses;
+    for (mm_tcache *cache = tcache_list; cache; cache = cache->next) {
+        stats->cache_hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        stats->cache_misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+        for (int class = 0; class < NUM_CLASSES; class++)
+            stats->classes[class].cached += __atomic_load_n(&cache->counts[class], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&tcache_list_lock);
+
+    for (int class = 0; class < NUM_CLASSES; class++) {
+        size_t size = class_size(class), carved = stats->classes[class].in_use;
+        size_t free = stats->classes[class].free + stats->classes[class].cached;
+        stats->classes[class].size = size;
+        stats->classes[class].in_use = carved > free ? carved - free : 0;
+        stats->in_use += stats->classes[class].in_use * size;
+        stats->free += free * size;
+    }
+    if (stats->heap)
+        stats->fragmentation = 1 - (double) stats->in_use / stats->heap;
+
+    stats->mmapped = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+    stats->mmap_count = __atomic_load_n(&mmap_count, __ATOMIC_RELAXED);
+    stats->mapped = stats->heap + stats->mmapped;
+    stats->in_use += stats->mmapped;
+}
+
+static double percent(unsigned long long part, unsigned long long whole) {
+    return whole ? 100.0 * part / whole : 0;
+}
+
+static void mm_print_stats(FILE *stream, struct mm_stats *stats) {
+    fprintf(stream, "mapped %zu bytes: %zu in heaps, %zu in %zu mappings\n",
+        stats->mapped, stats->heap, stats->mmapped, stats->mmap_count);
+    fprintf(stream, "in use %zu bytes, free %zu, heaps %.1f%% fragmented\n",
+        stats->in_use, stats->free, 100 * stats->fragmentation);
+    fprintf(stream, "%u arenas: %llu locks, %.1f%% contended\n",
+        stats->arenas, stats->locks, percent(stats->contended, stats->locks));
+    fprintf(stream, "thread caches: %llu hits, %llu misses, %.1f%% hit\n",
+        stats->cache_hits, stats->cache_misses,
+        percent(stats->cache_hits, stats->cache_hits + stats->cache_misses));
+    fprintf(stream, "%6s %10s %10s %10s\n", "class", "in use", "free", "cached");
+    for (int class = 0; class < NUM_CLASSES; class++) {
+        fprintf(stream, "%6zu %10zu %10zu %10zu\n", stats->classes[class].size,
+            stats->classes[class].in_use, stats->classes[class].free,
+            stats->classes[class].cached);
+    }
+}
+
+static void mm_stats_at_exit(void) {
+    struct mm_stats stats;
+    mm_stats(&stats);
+    mm_print_stats(stderr, &stats);
+}
+
+/* Writes ARENA's segments and chunks to STREAM; ARENA's lock is held. */
+static void arena_dump(FILE *stream, mm_arena *arena) {
+    fprintf(stream, "arena %p: %llu locks, %llu contended\n", (void *) arena, arena->locks,
+        __atomic_load_n(&arena->contended, __ATOMIC_RELAXED));
+    for (mm_segment *segment = arena->first_segment; segment; segment = segment->next) {
+        fprintf(stream, "  segment %p-%p\n", (void *) segment, (void *) segment->end);
+        for (mm_chunk *chunk = segment_first_chunk(segment); chunk_size(chunk);
+                chunk = chunk_next(chunk)) {
+            fprintf(stream, "    %p %10zu ", (void *) chunk, chunk_size(chunk));
+            if (chunk->head & CHUNK_SMALL) {
+                fprintf(stream, "run of %zu-byte chunks, %u of %u handed out\n",
+                    chunk_size(chunk_at(chunk, run_header(chunk)->first)), run_header(chunk)->live,
+                    run_header(chunk)->count);
+            } else {
+                fprintf(stream, "%s\n", chunk->head & CHUNK_INUSE ? "in use" : "free");
+            }
+        }
+    }
+}
+
+void mm_dump_heap(FILE *stream) {
+    /* The statistics go first, so STREAM has its buffer before an arena is locked. */
+    struct mm_stats stats;
+    mm_stats(&stats);
+    mm_print_stats(stream, &stats);
+    for (unsigned i = 0; i < MM_MAX_ARENAS; i++) {
+        mm_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        if (!arena)
+            continue;
+        pthread_mutex_lock(&arena->lock);
+        arena_drain_remote(arena);
+        arena_dump(stream, arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
 }
@@ -2,12 +2,77 @@
  * mm_alloc.h
  *
  * A clone of the interface documented in "man 3 malloc".
+ *
+ * These environment variables tune how memory is taken from and given
+ * back to the kernel; they are read once, on the first allocation:
+ *
+ *   MM_MMAP_THRESHOLD  requests of at least this many bytes get a mapping
+ *                      of their own, unmapped again on free (default 128KB)
+ *   MM_TRIM_THRESHOLD  free chunks larger than this give their pages back
+ *                      to the kernel (default 128KB)
+ *   MM_HUGE_PAGES      if 1, the heaps ask for 2MB transparent huge pages,
+ *                      which cuts TLB misses for programs that allocate a
+ *                      lot, and grow and shrink 2MB at a time
+ *
+ * A fourth, MM_STATS, writes the statistics of mm_stats() to stderr when the
+ * program exits, if it is set to anything.
  */
 
 #pragma once
 
+#include <stdio.h>
 #include <stdlib.h>
 
 void *mm_malloc(size_t size);
 void *mm_realloc(void *ptr, size_t size);
 void mm_free(void *ptr);
+void *mm_calloc(size_t count, size_t size);
+
+/*
+ * Returns SIZE bytes whose address is a multiple of ALIGNMENT, a power of
+ * two. mm_aligned_alloc() is the same, by its C11 name. Blocks from
+ * mm_malloc() are 16-byte aligned; those of 33 to 48 and of 81 to 4080
+ * bytes are also 64-byte (cache-line) aligned.
+ */
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+
+/* Returns how many bytes at PTR, from mm_malloc() and the like, are usable. */
+size_t mm_usable_size(void *ptr);
+
+#define MM_NUM_CLASSES 15
+
+/*
+ * A snapshot of the allocator, taken by mm_stats(). Arenas are looked at one
+ * at a time, so the numbers are only consistent with each other while no
+ * other thread is allocating.
+ */
+struct mm_stats {
+    size_t mapped;              /* Bytes of address space taken from the kernel... */
+    size_t heap;                /* ...in arena heaps... */
+    size_t mmapped;             /* ...and in large allocations' own mappings. */
+    size_t mmap_count;          /* Large allocations with a mapping of their own. */
+    size_t in_use;              /* Bytes in allocated chunks, headers included. */
+    size_t free;                /* Bytes in free chunks, thread caches included. */
+    double fragmentation;       /* Share of the heaps not in allocated chunks. */
+    unsigned arenas;
+    struct {
+        size_t size;            /* Chunk size, header included. */
+        size_t in_use;          /* Chunks allocated... */
+        size_t free;            /* ...free in an arena... */
+        size_t cached;          /* ...and free in a thread cache. */
+    } classes[MM_NUM_CLASSES];
+    unsigned long long locks;           /* Arena lock acquisitions... */
+    unsigned long long contended;       /* ...and how often the lock was held already. */
+    unsigned long long cache_hits;      /* Small allocations a thread cache served... */
+    unsigned long long cache_misses;    /* ...and those it had to be refilled for. */
+};
+
+/*
+ * Fills in STATS. This takes each arena's lock briefly but does not walk
+ * the heaps, so it is cheap enough to poll from a live process.
+ */
+void mm_stats(struct mm_stats *stats);
+
+/* Writes the statistics to STREAM, followed by every arena's heap, chunk by chunk. */
+void mm_dump_heap(FILE *stream);
@@ -0,0 +1,613 @@
+/*
+ * mm_bench.c
+ *
+ * Allocator benchmarks. The program calls the C library's malloc family,
+ * so the same binary measures the system allocator, or mm_alloc when run
+ * with LD_PRELOAD=./hw3preload.so ("make bench" runs both).
+ *
+ *   larson      each thread replaces random blocks of 16-1024 bytes in an
+ *               array, and every LARSON_ROUNDS operations hands the array
+ *               to a new thread, which frees what its predecessor allocated
+ *   threadtest  each thread allocates THREADTEST_BLOCKS 64-byte blocks and
+ *               frees them again, over and over
+ *   prodcons    half the threads allocate blocks of 16-1024 bytes and pass
+ *               them to the other half, which free them
+ *   realloc     each thread grows a buffer a few bytes at a time up to
+ *               REALLOC_MAX bytes with realloc(), then frees it
+ *   replay      replays a trace recorded with MM_TRACE (see mm_preload.c),
+ *               one thread per thread in the trace
+ *
+ * A run prints the operations per second, how far the RSS grew and the
+ * peak of the bytes the program held at once, both sampled every
+ * millisecond. Fragmentation is the share of the RSS growth that did not
+ * hold live data at that peak.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+
+#define LARSON_BLOCKS 1000
+#define LARSON_ROUNDS 10000
+#define THREADTEST_BLOCKS 1000
+#define PRODCONS_QUEUE 1024
+#define REALLOC_MAX (256 * 1024)
+
+/* A benchmark thread. Its counters are read by the main thread while it runs. */
+struct worker {
+    int (*run)(struct worker *);        /* Returns 1 if it handed on to a new thread. */
+    unsigned index;
+    unsigned seed;
+    long long live;             /* Bytes allocated minus bytes freed. */
+    unsigned long long ops;
+    int done;
+    void *state;                /* Per-workload. */
+};
+
+static struct worker workers[MAX_THREADS];
+static unsigned num_workers;
+static int stop;
+
+static int stopped(void) {
+    return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+/* Counts an operation by W that changed the bytes it holds by BYTES. */
+static inline void account(struct worker *w, long long bytes) {
+    __atomic_store_n(&w->live, w->live + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->ops, w->ops + 1, __ATOMIC_RELAXED);
+}
+
+static size_t random_size(struct worker *w, size_t min, size_t max) {
+    return min + rand_r(&w->seed) % (max - min + 1);
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *w = arg;
+    if (!w->run(w))
+        __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Runs W in a new, detached thread. Returns -1 if it cannot be created. */
+static int spawn(struct worker *w) {
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int error = pthread_create(&thread, &attributes, worker_thread, w);
+    pthread_attr_destroy(&attributes);
+    return error ? -1 : 0;
+}
+
+/* larson */
+
+static int larson_run(struct worker *w) {
+    char **blocks = w->state;
+    for (int round = 0; round < LARSON_ROUNDS && !stopped(); round++) {
+        int slot = rand_r(&w->seed) % LARSON_BLOCKS;
+        if (blocks[slot]) {
+            size_t size;
+            memcpy(&size, blocks[slot], sizeof(size));
+            free(blocks[slot]);
+            account(w, -(long long) size);
+        }
+        size_t size = random_size(w, 16, 1024);
+        blocks[slot] = malloc(size);
+        memcpy(blocks[slot], &size, sizeof(size));
+        account(w, size);
+    }
+
+    /* Hand the blocks on to a new thread. */
+    return !stopped() && spawn(w) == 0;
+}
+
+static void larson_start(struct worker *w) {
+    char **blocks = calloc(LARSON_BLOCKS, sizeof(*blocks));
+    for (int slot = 0; slot < LARSON_BLOCKS; slot++) {
+        size_t size = random_size(w, 16, 1024);
+        blocks[slot] = malloc(size);
+        memcpy(blocks[slot], &size, sizeof(size));
+        w->live += size;
+    }
+    w->state = blocks;
+    w->run = larson_run;
+}
+
+static void larson_finish(struct worker *w) {
+    char **blocks = w->state;
+    for (int slot = 0; slot < LARSON_BLOCKS; slot++)
+        free(blocks[slot]);
+    free(blocks);
+}
+
+/* threadtest */
+
+static int threadtest_run(struct worker *w) {
+    void *blocks[THREADTEST_BLOCKS];
+    while (!stopped()) {
+        for (int i = 0; i < THREADTEST_BLOCKS; i++) {
+            blocks[i] = malloc(64);
+            *(char *) blocks[i] = 0;
+            account(w, 64);
+        }
+        for (int i = 0; i < THREADTEST_BLOCKS; i++) {
+            free(blocks[i]);
+            account(w, -64);
+        }
+    }
+    return 0;
+}
+
+static void threadtest_start(struct worker *w) {
+    w->run = threadtest_run;
+}
+
+/* prodcons */
+
+/* A single-producer, single-consumer ring shared by a pair of workers. */
+struct queue {
+    void *blocks[PRODCONS_QUEUE];
+    unsigned long head;         /* Next to pop; written by the consumer. */
+    unsigned long tail;         /* Next to push; written by the producer. */
+    int done;                   /* The producer has stopped. */
+};
+
+static int producer_run(struct worker *w) {
+    struct queue *queue = w->state;
+    while (!stopped()) {
+        unsigned long tail = queue->tail;
+        if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == PRODCONS_QUEUE) {
+            sched_yield();
+            continue;
+        }
+        size_t size = random_size(w, 16, 1024);
+        void *block = malloc(size);
+        memcpy(block, &size, sizeof(size));
+        account(w, size);
+        queue->blocks[tail % PRODCONS_QUEUE] = block;
+        __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&queue->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int consumer_run(struct worker *w) {
+    struct queue *queue = w->state;
+    for (;;) {
+        int done = __atomic_load_n(&queue->done, __ATOMIC_ACQUIRE);
+        unsigned long head = queue->head;
+        if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+            if (done)
+                return 0;
+            sched_yield();
+            continue;
+        }
+        void *block = queue->blocks[head % PRODCONS_QUEUE];
+        __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+        size_t size;
+        memcpy(&size, block, sizeof(size));
+        free(block);
+        account(w, -(long long) size);
+    }
+}
+
+/* Even workers produce for the odd one after them. */
+static void prodcons_start(struct worker *w) {
+    if (w->index % 2 == 0) {
+        w->state = calloc(1, sizeof(struct queue));
+        w->run = producer_run;
+    } else {
+        w->state = workers[w->index - 1].state;
+        w->run = consumer_run;
+    }
+}
+
+static void prodcons_finish(struct worker *w) {
+    if (w->index % 2 == 1)
+        free(w->state);
+}
+
+/* realloc */
+
+static int realloc_run(struct worker *w) {
+    while (!stopped()) {
+        char *buffer = NULL;
+        size_t size = 0;
+        while (size < REALLOC_MAX) {
+            size_t grown = size + random_size(w, 1, 64);
+            buffer = realloc(buffer, grown);
+            buffer[grown - 1] = 0;
+            account(w, grown - size);
+            size = grown;
+        }
+        free(buffer);
+        account(w, -(long long) size);
+    }
+    return 0;
+}
+
+static void realloc_start(struct worker *w) {
+    w->run = realloc_run;
+}
+
+/* replay */
+
+/*
+ * A trace is a line per call, as MM_TRACE writes them:
+ *
+ *   THREAD m SIZE RESULT        malloc() and the like
+ *   THREAD r PTR SIZE RESULT    realloc()
+ *   THREAD f PTR                free()
+ *
+ * Each block the trace allocates becomes an object. Replaying a thread's
+ * calls in order only needs one thing from the others: a call on an object
+ * allocated by another thread waits until that thread has allocated it.
+ */
+struct trace_op {
+    char kind;
+    unsigned object;            /* m and r: the object allocated; f: the one freed. */
+    unsigned old_object;        /* r: the one reallocated. */
+    size_t size;
+};
+
+struct trace_thread {
+    struct trace_op *ops;
+    size_t count;
+    size_t capacity;
+};
+
+static void **trace_objects;
+static size_t *trace_sizes;
+static unsigned num_trace_objects;
+
+/* Maps the addresses of live blocks in the trace to their objects. */
+struct trace_map {
+    uintptr_t *addresses;
+    unsigned *objects;
+    size_t capacity;
+    size_t count;
+};
+
+static size_t trace_map_slot(struct trace_map *map, uintptr_t address) {
+    size_t slot = (address >> 4) * 0x9e3779b97f4a7c15ULL % map->capacity;
+    while (map->addresses[slot] && map->addresses[slot] != address)
+        slot = (slot + 1) % map->capacity;
+    return slot;
+}
+
+static void trace_map_put(struct trace_map *map, uintptr_t address, unsigned object) {
+    if (2 * (map->count + 1) > map->capacity) {
+        struct trace_map grown = { NULL, NULL, map->capacity ? 2 * map->capacity : 1024, 0 };
+        grown.addresses = calloc(grown.capacity, sizeof(*grown.addresses));
+        grown.objects = calloc(grown.capacity, sizeof(*grown.objects));
+        for (size_t i = 0; i < map->capacity; i++) {
+            if (map->addresses[i])
+                trace_map_put(&grown, map->addresses[i], map->objects[i]);
+        }
+        free(map->addresses);
+        free(map->objects);
+        *map = grown;
+    }
+    size_t slot = trace_map_slot(map, address);
+    if (!map->addresses[slot])
+        map->count++;
+    map->addresses[slot] = address;
+    map->objects[slot] = object;
+}
+
+/* Removes ADDRESS and returns its object, or 0 if it was not allocated in the trace. */
+static unsigned trace_map_take(struct trace_map *map, uintptr_t address) {
+    if (!map->capacity)
+        return 0;
+    size_t slot = trace_map_slot(map, address);
+    if (!map->addresses[slot])
+        return 0;
+    unsigned object = map->objects[slot];
+
+    /* Close the gap, moving later entries of the probe sequence back. */
+    map->addresses[slot] = 0;
+    map->count--;
+    for (size_t next = (slot + 1) % map->capacity; map->addresses[next];
+            next = (next + 1) % map->capacity) {
+        uintptr_t moved = map->addresses[next];
+        unsigned moved_object = map->objects[next];
+        map->addresses[next] = 0;
+        map->count--;
+        trace_map_put(map, moved, moved_object);
+    }
+    return object;
+}
+
+static void trace_push(struct trace_thread *thread, struct trace_op op) {
+    if (thread->count == thread->capacity) {
+        thread->capacity = thread->capacity ? 2 * thread->capacity : 1024;
+        thread->ops = realloc(thread->ops, thread->capacity * sizeof(*thread->ops));
+    }
+    thread->ops[thread->count++] = op;
+}
+
+/* Object 0 stands for none, so objects count from 1. */
+static unsigned trace_new_object(size_t size) {
+    static unsigned capacity;
+    if (++num_trace_objects >= capacity) {
+        capacity = capacity ? 2 * capacity : 1024;
+        trace_sizes = realloc(trace_sizes, capacity * sizeof(*trace_sizes));
+    }
+    trace_sizes[num_trace_objects] = size;
+    return num_trace_objects;
+}
+
+/* Reads the trace at PATH into one trace_thread per thread in it. Returns -1 on error. */
+static int trace_load(char *path, struct trace_thread *threads, unsigned *num_threads) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return -1;
+    }
+    unsigned thread_ids[MAX_THREADS];
+    struct trace_map map = { NULL, NULL, 0, 0 };
+    char line[256];
+    *num_threads = 0;
+    for (int number = 1; fgets(line, sizeof(line), file); number++) {
+        unsigned id;
+        char kind;
+        uintptr_t ptr = 0, result = 0;
+        size_t size = 0;
+        int fields = sscanf(line, "%u %c", &id, &kind);
+        if (fields == 2 && kind == 'm')
+            fields += sscanf(line, "%*u %*c %zu %" SCNxPTR, &size, &result);
+        else if (fields == 2 && kind == 'r')
+            fields += sscanf(line, "%*u %*c %" SCNxPTR " %zu %" SCNxPTR, &ptr, &size, &result);
+        else if (fields == 2 && kind == 'f')
+            fields += sscanf(line, "%*u %*c %" SCNxPTR, &ptr);
+        if (fields != (kind == 'm' ? 4 : kind == 'r' ? 5 : 3)) {
+            fprintf(stderr, "%s:%d: bad trace line\n", path, number);
+            fclose(file);
+            return -1;
+        }
+
+        unsigned thread = 0;
+        while (thread < *num_threads && thread_ids[thread] != id)
+            thread++;
+        if (thread == *num_threads) {
+            if (thread == MAX_THREADS) {
+                fprintf(stderr, "%s:%d: more than %d threads\n", path, number, MAX_THREADS);
+                fclose(file);
+                return -1;
+            }
+            thread_ids[(*num_threads)++] = id;
+        }
+
+        /* Calls on blocks allocated before tracing started are left out. */
+        struct trace_op op = { kind, 0, 0, size };
+        if (kind == 'f' || kind == 'r')
+            op.old_object = trace_map_take(&map, ptr);
+        if (kind == 'r' && !result && size) {
+            /* A realloc() that failed left the block as it was. */
+            if (op.old_object)
+                trace_map_put(&map, ptr, op.old_object);
+            continue;
+        }
+        if (kind == 'f') {
+            op.object = op.old_object;
+            if (!op.object)
+                continue;
+        } else if (result) {
+            op.object = trace_new_object(size);
+            trace_map_put(&map, result, op.object);
+        } else if (!op.old_object) {
+            continue;
+        }
+        if (kind == 'r' && !op.old_object)
+            op.kind = 'm';
+        trace_push(&threads[thread], op);
+    }
+    fclose(file);
+    free(map.addresses);
+    free(map.objects);
+    trace_objects = calloc(num_trace_objects + 1, sizeof(*trace_objects));
+    return 0;
+}
+
+/* Returns OBJECT's block once its allocation has been replayed. */
+static void *trace_wait(unsigned object) {
+    void *ptr;
+    while (!(ptr = __atomic_load_n(&trace_objects[object], __ATOMIC_ACQUIRE)))
+        sched_yield();
+    return ptr;
+}
+
+static int replay_run(struct worker *w) {
+    struct trace_thread *thread = w->state;
+    for (size_t i = 0; i < thread->count; i++) {
+        struct trace_op *op = &thread->ops[i];
+        if (op->kind == 'f') {
+            free(trace_wait(op->object));
+            account(w, -(long long) trace_sizes[op->object]);
+            continue;
+        }
+        void *ptr;
+        long long bytes = op->size;
+        if (op->kind == 'r') {
+            ptr = realloc(trace_wait(op->old_object), op->size);
+            bytes -= trace_sizes[op->old_object];
+        } else {
+            ptr = malloc(op->size);
+        }
+        if (!op->object) {
+            /* A realloc() to 0 bytes, which freed the block. */
+            account(w, bytes);
+            continue;
+        }
+        __atomic_store_n(&trace_objects[op->object], ptr, __ATOMIC_RELEASE);
+        account(w, bytes);
+    }
+    return 0;
+}
+
+static void replay_start(struct worker *w) {
+    w->run = replay_run;
+}
+
+/* The harness */
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * Names the allocator that malloc() resolves to: "system" while it is the
+ * C library's own, "mm_alloc" when a preloaded shim replaced it.
+ */
+static const char *allocator_name(void) {
+    Dl_info malloc_info, libc_info;
+    if (!dladdr(dlsym(RTLD_DEFAULT, "malloc"), &malloc_info) ||
+            !dladdr(dlsym(RTLD_DEFAULT, "printf"), &libc_info))
+        return "system";
+    return malloc_info.dli_fbase == libc_info.dli_fbase ? "system" : "mm_alloc";
+}
+
+/* Reads the RSS without stdio, which would allocate while it is being measured. */
+static long rss_kb(void) {
+    static int fd = -1;
+    char buffer[128];
+    if (fd < 0)
+        fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0)
+        return 0;
+    buffer[length] = '\0';
+    long pages = 0;
+    sscanf(buffer, "%*s %ld", &pages);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long long total_live(void) {
+    long long live = 0;
+    for (unsigned i = 0; i < num_workers; i++)
+        live += __atomic_load_n(&workers[i].live, __ATOMIC_RELAXED);
+    return live;
+}
+
+static unsigned running(void) {
+    unsigned count = 0;
+    for (unsigned i = 0; i < num_workers; i++)
+        count += !__atomic_load_n(&workers[i].done, __ATOMIC_ACQUIRE);
+    return count;
+}
+
+static char *USAGE =
+    "Usage: ./mm_bench [--threads 4] [--seconds 5] larson|threadtest|prodcons|realloc\n"
+    "       ./mm_bench replay TRACE\n"
+    "Run with LD_PRELOAD=./hw3preload.so to measure mm_alloc instead of the system allocator.\n";
+
+static void exit_with_usage(void) {
+    fprintf(stderr, "%s", USAGE);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    unsigned threads = 4;
+    double seconds = 5;
+    char *workload = NULL, *trace_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--threads", argv[i]) == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp("--seconds", argv[i]) == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if (!workload) {
+            workload = argv[i];
+        } else if (strcmp("replay", workload) == 0 && !trace_path) {
+            trace_path = argv[i];
+        } else {
+            exit_with_usage();
+        }
+    }
+    if (!workload || threads < 1 || threads > MAX_THREADS || seconds <= 0)
+        exit_with_usage();
+
+    void (*start)(struct worker *) = NULL;
+    void (*finish)(struct worker *) = NULL;
+    struct trace_thread trace_threads[MAX_THREADS] = { { NULL, 0, 0 } };
+    if (strcmp("larson", workload) == 0) {
+        start = larson_start;
+        finish = larson_finish;
+    } else if (strcmp("threadtest", workload) == 0) {
+        start = threadtest_start;
+    } else if (strcmp("prodcons", workload) == 0) {
+        start = prodcons_start;
+        finish = prodcons_finish;
+        threads += threads % 2;
+    } else if (strcmp("realloc", workload) == 0) {
+        start = realloc_start;
+    } else if (strcmp("replay", workload) == 0 && trace_path) {
+        start = replay_start;
+        if (trace_load(trace_path, trace_threads, &threads) < 0)
+            exit(EXIT_FAILURE);
+    } else {
+        exit_with_usage();
+    }
+
+    long base_rss = rss_kb(), peak_rss = base_rss;
+    num_workers = threads;
+    double started = now();
+    for (unsigned i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].seed = i + 1;
+        if (trace_path)
+            workers[i].state = &trace_threads[i];
+        start(&workers[i]);
+        if (spawn(&workers[i]) < 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Sample the RSS and how much the threads hold between them; a replay ends when the trace does. */
+    long long peak_live = 0;
+    struct timespec tick = { 0, 1000000 };
+    for (;;) {
+        long long live = total_live();
+        if (live > peak_live)
+            peak_live = live;
+        long rss = rss_kb();
+        if (rss > peak_rss)
+            peak_rss = rss;
+        if (trace_path ? !running() : now() - started >= seconds)
+            break;
+        nanosleep(&tick, NULL);
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    while (running())
+        nanosleep(&tick, NULL);
+    double elapsed = now() - started;
+    long rss = peak_rss - base_rss;
+
+    unsigned long long ops = 0;
+    for (unsigned i = 0; i < threads; i++)
+        ops += workers[i].ops;
+    for (unsigned i = 0; finish && i < threads; i++)
+        finish(&workers[i]);
+
+    double fragmentation = rss > 0 ? 1 - peak_live / 1024.0 / rss : 0;
+    printf("%-10s %-8s %3u threads %9.2f Mops/s  RSS growth %8ld KB  peak live %8lld KB  "
+        "fragmentation %5.1f%%\n", workload,
+        allocator_name(), threads,
+        ops / elapsed / 1e6, rss, peak_live / 1024, fragmentation < 0 ? 0 : 100 * fragmentation);
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * mm_preload.c
+ *
+ * The C library's malloc family, backed by mm_alloc, so that any program
+ * can be run on it unchanged:
+ *
+ *   LD_PRELOAD=./hw3preload.so ../hw2/httpserver --files www/
+ *
+ * Every function that hands out or takes back malloc()ed memory has to be
+ * here. A pointer from one of ours reaching the C library's free(), or the
+ * other way around, would corrupt both heaps.
+ *
+ * The shim is built with -fvisibility=hidden and exports only these
+ * functions. Were mm_alloc's own mm_* functions exported too, they would
+ * override those of any other copy of it in the process, such as the
+ * hw3lib.so that mm_test loads, mixing the two copies' heaps.
+ *
+ * Setting MM_TRACE to a file name records every call in that file, for
+ * mm_bench to replay: a line per call, with a number for the calling
+ * thread, "m SIZE RESULT" for malloc() and the like, "r PTR SIZE RESULT"
+ * for realloc() and "f PTR" for free(). Addresses are in hex. A child of
+ * fork() goes on writing to the same file, so traces of programs that fork
+ * do not replay as they ran.
+ */
+
+#include "mm_alloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+static int trace_fd = -1;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static unsigned trace_threads;
+static __thread unsigned trace_thread;
+
+static void trace_open(void) {
+    char *path = getenv("MM_TRACE");
+    if (path && *path)
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+}
+
+static int tracing(void) {
+    pthread_once(&trace_once, trace_open);
+    return trace_fd >= 0;
+}
+
+/* Writes a line of the trace in one write(), so the lines of different threads do not mix. */
+static void trace(char *format, ...) {
+    if (!trace_thread)
+        trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    char line[128];
+    int length = snprintf(line, sizeof(line), "%u ", trace_thread);
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(line + length, sizeof(line) - length, format, args);
+    va_end(args);
+    line[length++] = '\n';
+    write(trace_fd, line, length);
+}
+
+static void *trace_alloc(size_t size, void *ptr) {
+    if (tracing())
+        trace("m %zu %" PRIxPTR, size, (uintptr_t) ptr);
+    return ptr;
+}
+
+/* mm_malloc(0) returns NULL, which callers of malloc(0) would take for running out of memory. */
+EXPORT void *malloc(size_t size) {
+    return trace_alloc(size, mm_malloc(size ? size : 1));
+}
+
+/* Traced first: once freed, the block may be handed out, and traced, by another thread. */
+EXPORT void free(void *ptr) {
+    if (ptr && tracing())
+        trace("f %" PRIxPTR, (uintptr_t) ptr);
+    mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t count, size_t size) {
+    void *ptr = mm_calloc(count && size ? count : 1, count && size ? size : 1);
+    return trace_alloc(count * size, ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+    void *result = mm_realloc(ptr, size);
+    if (tracing())
+        trace("r %" PRIxPTR " %zu %" PRIxPTR, (uintptr_t) ptr, size, (uintptr_t) result);
+    return result;
+}
+
+EXPORT void *reallocarray(void *ptr, size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+EXPORT int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)))
+        return EINVAL;
+    int saved_errno = errno;
+    void *result = trace_alloc(size, mm_memalign(alignment, size ? size : 1));
+    if (!result) {
+        errno = saved_errno;
+        return ENOMEM;
+    }
+    *ptr = result;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    return trace_alloc(size, mm_aligned_alloc(alignment, size ? size : 1));
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+    return trace_alloc(size, mm_memalign(alignment, size ? size : 1));
+}
+
+EXPORT void *valloc(size_t size) {
+    return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return memalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
+}
@@ -1,12 +1,17 @@
 #include <assert.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Function pointers to hw3 functions */
 void* (*mm_malloc)(size_t);
 void* (*mm_realloc)(void*, size_t);
 void (*mm_free)(void*);
+void* (*mm_calloc)(size_t, size_t);
+void* (*mm_memalign)(size_t, size_t);
 
 void load_alloc_functions() {
     void *handle = dlopen("hw3lib.so", RTLD_NOW);
@@ -33,6 +38,164 @@ void load_alloc_functions() {
         fprintf(stderr, "%s\n", dlerror());
         exit(1);
     }
+
+    mm_calloc = dlsym(handle, "mm_calloc");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    mm_memalign = dlsym(handle, "mm_memalign");
+    if ((error = dlerror()) != NULL)  {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+}
+
+/* Every size class hands out distinct, aligned blocks that can be written in full. */
+void test_size_classes() {
+    char *blocks[64];
+    for (int i = 0; i < 64; i++) {
+        size_t size = (size_t) 1 << (i % 13);
+        blocks[i] = mm_malloc(size);
+        assert(blocks[i] != NULL);
+        assert((uintptr_t) blocks[i] % 16 == 0);
+        memset(blocks[i], i, size);
+    }
+    for (int i = 0; i < 64; i++) {
+        size_t size = (size_t) 1 << (i % 13);
+        for (size_t j = 0; j < size; j++)
+            assert(blocks[i][j] == (char) i);
+        mm_free(blocks[i]);
+    }
+
+    /* A freed block goes back to its class and is the next one handed out. */
+    void *first = mm_malloc(100);
+    mm_free(first);
+    assert(mm_malloc(100) == first);
+    mm_free(first);
+}
+
+/*
+ * Freed neighbours merge, so their space can be handed out again as one
+ * block. Runs first, while consecutive allocations are carved one after
+ * another from the same free memory.
+ */
+void test_coalescing() {
+    char *a = mm_malloc(40000);
+    char *b = mm_malloc(40000);
+    char *c = mm_malloc(40000);
+    assert(a != NULL && b != NULL && c != NULL);
+    mm_free(b);
+    mm_free(a);
+    char *ab = mm_malloc(80000);
+    assert(ab == a);
+    mm_free(c);
+    mm_free(ab);
+}
+
+void test_large() {
+    size_t size = 1 << 20;
+    char *data = mm_malloc(size);
+    assert(data != NULL);
+    memset(data, 0x5a, size);
+    assert(data[0] == 0x5a && data[size - 1] == 0x5a);
+    mm_free(data);
+}
+
+void test_realloc() {
+    char *data = mm_realloc(NULL, 10);
+    assert(data != NULL);
+    strcpy(data, "hw3");
+    for (size_t size = 16; size <= 1 << 16; size *= 2) {
+        data = mm_realloc(data, size);
+        assert(data != NULL);
+        assert(strcmp(data, "hw3") == 0);
+    }
+    assert(mm_realloc(data, 0) == NULL);
+}
+
+/* Growing into a free neighbour, or shrinking, must not move the block. */
+void test_realloc_in_place() {
+    char *a = mm_malloc(8000), *b = mm_malloc(8000), *c = mm_malloc(8000);
+    assert(a != NULL && b != NULL && c != NULL);
+    strcpy(a, "hw3");
+    mm_free(b);
+    assert(mm_realloc(a, 14000) == a);
+    assert(mm_realloc(a, 5000) == a);
+    assert(strcmp(a, "hw3") == 0);
+    mm_free(a);
+    mm_free(c);
+}
+
+/* Aligned blocks land on their boundary and can be written and freed like any other. */
+void test_memalign() {
+    for (size_t alignment = 32; alignment <= 1 << 16; alignment *= 4) {
+        size_t sizes[] = { 1, 100, 5000, 200000 };
+        for (int i = 0; i < 4; i++) {
+            char *data = mm_memalign(alignment, sizes[i]);
+            assert(data != NULL);
+            assert((uintptr_t) data % alignment == 0);
+            memset(data, 1, sizes[i]);
+            mm_free(data);
+        }
+    }
+    assert(mm_memalign(48, 16) == NULL);
+
+    /* Cache-line alignment of small blocks comes from their size class. */
+    for (size_t size = 1; size <= 4096; size += 7) {
+        char *data = mm_memalign(64, size);
+        assert(data != NULL);
+        assert((uintptr_t) data % 64 == 0);
+        memset(data, 1, size);
+        mm_free(data);
+    }
+    for (size_t size = 81; size <= 4080; size += 13) {
+        char *data = mm_malloc(size);
+        assert((uintptr_t) data % 64 == 0);
+        mm_free(data);
+    }
+
+    char *zeroed = mm_calloc(1000, 10);
+    assert(zeroed != NULL);
+    for (int i = 0; i < 10000; i++)
+        assert(zeroed[i] == 0);
+    mm_free(zeroed);
+    assert(mm_calloc(SIZE_MAX / 2, 4) == NULL);
+}
+
+#define NUM_THREADS 4
+#define THREAD_ROUNDS 20000
+
+/* Churns blocks in a thread; the one it returns is freed by another thread. */
+void *thread_churn(void *arg) {
+    unsigned seed = (unsigned) (uintptr_t) arg;
+    char *blocks[32] = { NULL };
+    for (int i = 0; i < THREAD_ROUNDS; i++) {
+        int slot = rand_r(&seed) % 32;
+        if (blocks[slot]) {
+            assert(blocks[slot][0] == (char) slot);
+            mm_free(blocks[slot]);
+        }
+        size_t size = 1 + rand_r(&seed) % (rand_r(&seed) % 8 ? 512 : 16384);
+        blocks[slot] = mm_malloc(size);
+        assert(blocks[slot] != NULL);
+        memset(blocks[slot], slot, size);
+    }
+    for (int slot = 1; slot < 32; slot++)
+        mm_free(blocks[slot]);
+    return blocks[0];
+}
+
+void test_threads() {
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++)
+        assert(pthread_create(&threads[i], NULL, thread_churn, (void *) (uintptr_t) i) == 0);
+    for (int i = 0; i < NUM_THREADS; i++) {
+        void *leftover;
+        assert(pthread_join(threads[i], &leftover) == 0);
+        mm_free(leftover);
+    }
 }
 
 int main() {
@@ -42,6 +205,14 @@ int main() {
     assert(data != NULL);
     data[0] = 0x162;
     mm_free(data);
+
+    test_coalescing();
+    test_size_classes();
+    test_large();
+    test_realloc();
+    test_realloc_in_place();
+    test_memalign();
+    test_threads();
     printf("malloc test successful!\n");
     return 0;
 }